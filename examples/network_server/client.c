@@ -52,7 +52,8 @@ bool listdir(int fd, char *path)
     /* Construct and send the request to server */
     {
         ListFilesRequest request = {};
-        pb_ostream_t output = pb_ostream_from_socket(fd);
+        socket_output_t buffer;
+        pb_ostream_t output = pb_ostream_from_socket(fd, &buffer);
         
         /* In our protocol, path is optional. If it is not given,
          * the server will list the root directory. */
@@ -72,9 +73,10 @@ bool listdir(int fd, char *path)
             strcpy(request.path, path);
         }
         
-        /* Encode the request. It is written to the socket immediately
-         * through our custom stream. */
-        if (!pb_encode_delimited(&output, ListFilesRequest_fields, &request))
+        /* Encode the request. It is written to the socket through our
+         * buffered stream when flushed. */
+        if (!pb_encode_delimited(&output, ListFilesRequest_fields, &request) ||
+            !pb_ostream_flush(&output))
         {
             fprintf(stderr, "Encoding failed: %s\n", PB_GET_ERROR(&output));
             return false;
@@ -84,7 +86,8 @@ bool listdir(int fd, char *path)
     /* Read back the response from server */
     {
         ListFilesResponse response = {};
-        pb_istream_t input = pb_istream_from_socket(fd);
+        socket_input_t buffer;
+        pb_istream_t input = pb_istream_from_socket(fd, &buffer);
         
         if (!pb_decode_delimited(&input, ListFilesResponse_fields, &response))
         {
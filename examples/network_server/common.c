@@ -8,36 +8,41 @@
 
 #include "common.h"
 
-static bool write_callback(pb_ostream_t *stream, const uint8_t *buf, size_t count)
+/* Output is collected in a buffer and sent in large blocks. */
+static size_t write_callback(void *state, const uint8_t *buf, size_t count)
 {
-    int fd = (intptr_t)stream->state;
-    return send(fd, buf, count, 0) == count;
+    int fd = (intptr_t)state;
+    ssize_t result = send(fd, buf, count, 0);
+    
+    if (result <= 0)
+        return 0; /* Error */
+    
+    return (size_t)result;
 }
 
-static bool read_callback(pb_istream_t *stream, uint8_t *buf, size_t count)
+/* Input is read through a buffer, so recv() can return as much data
+ * as is available instead of being called for every few bytes. */
+static size_t read_callback(void *state, uint8_t *buf, size_t count)
 {
-    int fd = (intptr_t)stream->state;
-    int result;
-    
-    if (count == 0)
-        return true;
-
-    result = recv(fd, buf, count, MSG_WAITALL);
+    int fd = (intptr_t)state;
+    ssize_t result = recv(fd, buf, count, 0);
     
-    if (result == 0)
-        stream->bytes_left = 0; /* EOF */
+    if (result <= 0)
+        return 0; /* EOF or error */
     
-    return result == count;
+    return (size_t)result;
 }
 
-pb_ostream_t pb_ostream_from_socket(int fd)
+pb_ostream_t pb_ostream_from_socket(int fd, socket_output_t *output)
 {
-    pb_ostream_t stream = {&write_callback, (void*)(intptr_t)fd, SIZE_MAX, 0};
-    return stream;
+    pb_ostream_buffer_init(&output->state, &write_callback, (void*)(intptr_t)fd,
+                           output->buffer, sizeof(output->buffer));
+    return pb_ostream_from_buffered(&output->state, SIZE_MAX);
 }
 
-pb_istream_t pb_istream_from_socket(int fd)
+pb_istream_t pb_istream_from_socket(int fd, socket_input_t *input)
 {
-    pb_istream_t stream = {&read_callback, (void*)(intptr_t)fd, SIZE_MAX};
-    return stream;
+    pb_istream_buffer_init(&input->state, &read_callback, (void*)(intptr_t)fd,
+                           input->buffer, sizeof(input->buffer));
+    return pb_istream_from_buffered(&input->state, SIZE_MAX);
 }
@@ -2,8 +2,24 @@
 #define _PB_EXAMPLE_COMMON_H_
 
 #include <pb.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
 
-pb_ostream_t pb_ostream_from_socket(int fd);
-pb_istream_t pb_istream_from_socket(int fd);
+/* Buffer for data received from a socket. It must be kept for as long
+ * as the input stream is used. */
+typedef struct {
+    pb_istream_buffer_t state;
+    pb_byte_t buffer[256];
+} socket_input_t;
+
+/* Buffer for data to be sent to a socket. Call pb_ostream_flush()
+ * after encoding to send the remaining data. */
+typedef struct {
+    pb_ostream_buffer_t state;
+    pb_byte_t buffer[256];
+} socket_output_t;
+
+pb_ostream_t pb_ostream_from_socket(int fd, socket_output_t *output);
+pb_istream_t pb_istream_from_socket(int fd, socket_input_t *input);
 
 #endif
\ No newline at end of file
@@ -72,7 +72,8 @@ void handle_connection(int connfd)
     /* Decode the message from the client and open the requested directory. */
     {
         ListFilesRequest request = {};
-        pb_istream_t input = pb_istream_from_socket(connfd);
+        socket_input_t buffer;
+        pb_istream_t input = pb_istream_from_socket(connfd, &buffer);
         
         if (!pb_decode_delimited(&input, ListFilesRequest_fields, &request))
         {
@@ -87,7 +88,8 @@ void handle_connection(int connfd)
     /* List the files in the directory and transmit the response to client */
     {
         ListFilesResponse response = {};
-        pb_ostream_t output = pb_ostream_from_socket(connfd);
+        socket_output_t buffer;
+        pb_ostream_t output = pb_ostream_from_socket(connfd, &buffer);
         
         if (directory == NULL)
         {
@@ -104,7 +106,8 @@ void handle_connection(int connfd)
             response.file = directory;
         }
         
-        if (!pb_encode_delimited(&output, ListFilesResponse_fields, &response))
+        if (!pb_encode_delimited(&output, ListFilesResponse_fields, &response) ||
+            !pb_ostream_flush(&output))
         {
             printf("Encoding failed: %s\n", PB_GET_ERROR(&output));
         }
@@ -535,12 +535,26 @@ class Field:
         else:
             raise NotImplementedError(desc.label)
 
+        # View fields only store a reference to the data, so they don't need
+        # max_size. They can be used for strings and bytes.
+        self.view = (field_options.type == nanopb_pb2.FT_VIEW)
+        if self.view:
+            if desc.type not in (FieldD.TYPE_STRING, FieldD.TYPE_BYTES) or field_options.fixed_length:
+                raise Exception("Field '%s' is defined as FT_VIEW, but only "
+                                "string and bytes fields can be views." % self.name)
+
+            if desc.label == FieldD.LABEL_REPEATED and self.max_count is None:
+                raise Exception("Field '%s' is defined as repeated FT_VIEW, "
+                                "but max_count is not given." % self.name)
+
+            field_options.type = nanopb_pb2.FT_STATIC
+
         # Check if the field can be implemented with static allocation
         # i.e. whether the data size is known.
-        if desc.type == FieldD.TYPE_STRING and self.max_size is None:
+        if desc.type == FieldD.TYPE_STRING and self.max_size is None and not self.view:
             can_be_static = False
 
-        if desc.type == FieldD.TYPE_BYTES and self.max_size is None:
+        if desc.type == FieldD.TYPE_BYTES and self.max_size is None and not self.view:
             can_be_static = False
 
         # Decide how the field data will be allocated
@@ -584,6 +598,13 @@ class Field:
             if self.default is not None:
                 self.default = self.ctype + self.default
             self.enc_size = None # Needs to be filled in when enum values are known
+        elif self.view:
+            # String views have their own type so that they can be
+            # validated as UTF-8 text.
+            self.view_of_bytes = (desc.type == FieldD.TYPE_BYTES)
+            self.pbtype = 'VIEW' if self.view_of_bytes else 'STRING_VIEW'
+            self.ctype = 'usr_pb_view_t'
+            self.data_item_size = 16
         elif desc.type == FieldD.TYPE_STRING:
             self.pbtype = 'STRING'
             self.ctype = 'char'
@@ -692,6 +713,8 @@ class Field:
                 inner_init = '{0, {0}}'
             elif self.pbtype == 'FIXED_LENGTH_BYTES':
                 inner_init = '{0}'
+            elif self.pbtype in ('VIEW', 'STRING_VIEW'):
+                inner_init = '{NULL, 0}'
             elif self.pbtype in ('ENUM', 'UENUM'):
                 inner_init = '_%s_MIN' % self.ctype
             else:
@@ -714,6 +737,16 @@ class Field:
                     inner_init = '{0}'
                 else:
                     inner_init = '{%s}' % ','.join(data)
+            elif self.pbtype in ('VIEW', 'STRING_VIEW'):
+                if self.view_of_bytes:
+                    data = codecs.escape_decode(self.default)[0]
+                else:
+                    data = self.default.encode('utf-8')
+                if len(data) == 0:
+                    inner_init = '{NULL, 0}'
+                else:
+                    literal = codecs.escape_encode(data)[0].decode('ascii')
+                    inner_init = '{(const usr_pb_byte_t*)"%s", %d}' % (literal, len(data))
             elif self.pbtype in ['FIXED32', 'UINT32']:
                 inner_init = str(self.default) + 'u'
             elif self.pbtype in ['FIXED64', 'UINT64']:
@@ -792,6 +825,19 @@ class Field:
                                                      name + ',',
                                                      self.tag)
 
+    def descriptor_width(self, width):
+        '''Return the number of words in the field_info array for this field.
+        Must match the usr_PB_FIELDINFO_WIDTH_AUTO logic in usr_pb.h.
+        '''
+        if width != 'AUTO':
+            return int(width)
+        elif self.allocation == 'CALLBACK' or self.rules in ['REPEATED', 'FIXARRAY']:
+            return 2
+        elif self.pbtype in ['BYTES', 'STRING', 'MESSAGE', 'MSG_W_CB', 'FIXED_LENGTH_BYTES', 'VIEW', 'STRING_VIEW']:
+            return 2
+        else:
+            return 1
+
     def data_size(self, dependencies):
         '''Return estimated size of this field in the C struct.
         This is used to try to automatically pick right descriptor size.
@@ -845,7 +891,7 @@ class Field:
         including the field tag. If the size cannot be determined, returns
         None.'''
 
-        if self.allocation != 'STATIC':
+        if self.allocation != 'STATIC' or self.pbtype in ('VIEW', 'STRING_VIEW'):
             return None
 
         if self.pbtype in ['MESSAGE', 'MSG_W_CB']:
@@ -1134,6 +1180,7 @@ class Message(ProtoElement):
         self.math_include_required = False
         self.packed = message_options.packed_struct
         self.descriptorsize = message_options.descriptorsize
+        self.tag_lookup = message_options.tag_lookup
 
         if message_options.msgid:
             self.msgid = message_options.msgid
@@ -1301,6 +1348,21 @@ class Message(ProtoElement):
                 count += 1
         return count
 
+    def field_indexes(self):
+        '''Return the #defines for building field masks for this message.
+        The indexes must match the field_info array generated by usr_PB_BIND,
+        which is sorted by tag number.
+        '''
+        sorted_fields = list(self.all_fields())
+        sorted_fields.sort(key = lambda x: x.tag)
+
+        identifier = '%s_FIELDMASK_WORDS' % self.name
+        result = '#define %-40s %d\n' % (identifier, max(1, (len(sorted_fields) + 31) // 32))
+        for index, field in enumerate(sorted_fields):
+            identifier = '%s_%s_index' % (self.name, field.name)
+            result += '#define %-40s %d\n' % (identifier, index)
+        return result
+
     def fields_declaration(self, dependencies):
         '''Return X-macro declaration of all fields in this message.'''
         Field.macro_x_param = 'X'
@@ -1360,7 +1422,142 @@ class Message(ProtoElement):
         if width == 1:
           width = 'AUTO'
 
-        result = 'usr_PB_BIND(%s, %s, %s)\n' % (self.name, self.name, width)
+        result = ''
+        lookup = 'NULL'
+        lookup_table = self.tag_lookup_definition(width)
+        if lookup_table:
+            result += lookup_table
+            lookup = '%s_field_lookup' % self.name
+
+        init_mode = self.default_init_mode(dependencies)
+        if init_mode == 'IMAGE':
+            result += 'static const %s %s_default_image = %s_init_default;\n' % (self.name, self.name, self.name)
+            result += 'usr_PB_BIND_EX(%s, %s, %s, %s, &%s_default_image, sizeof(%s))\n' % (
+                self.name, self.name, width, lookup, self.name, self.name)
+        elif init_mode == 'ZERO':
+            result += 'usr_PB_BIND_EX(%s, %s, %s, %s, NULL, sizeof(%s))\n' % (
+                self.name, self.name, width, lookup, self.name)
+        elif lookup_table:
+            result += 'usr_PB_BIND_WITH_LOOKUP(%s, %s, %s, %s)\n' % (self.name, self.name, width, lookup)
+        else:
+            result += 'usr_PB_BIND(%s, %s, %s)\n' % (self.name, self.name, width)
+        return result
+
+    def default_init_mode(self, dependencies):
+        '''Return how the runtime can set this message to its default values:
+        'ZERO' if setting the whole structure to zero is enough,
+        'IMAGE' if it can be copied from a constant initialized with
+        _init_default, and 'FIELDS' if each field must be handled separately.
+        '''
+        memcpy_ok, zero, exact = self.default_init_info(dependencies)
+        if not memcpy_ok:
+            return 'FIELDS'
+        elif zero:
+            return 'ZERO'
+        elif exact:
+            return 'IMAGE'
+        else:
+            return 'FIELDS'
+
+    def default_init_info(self, dependencies):
+        '''Return tuple (memcpy_ok, zero, exact) for default_init_mode():
+        memcpy_ok: There are no callback fields or extensions, here or in
+                   static submessages, that would be overwritten.
+        zero:      All default values are zero.
+        exact:     _init_default matches the values set by the runtime.
+        '''
+        if not self.desc:
+            # Extension pseudo-messages are initialized through the extension
+            return (False, False, False)
+
+        zero = not self.default_value(dependencies)
+        exact = True
+        other_dependencies = dict(x for x in dependencies.items() if x[0] != str(self.name))
+
+        for field in self.all_fields():
+            if field.allocation == 'CALLBACK' or field.pbtype in ('EXTENSION', 'MSG_W_CB'):
+                return (False, False, False)
+
+            if field.allocation != 'STATIC':
+                continue
+
+            # Contents of arrays and oneofs are not initialized by the runtime,
+            # only the count or which_ field is.
+            has_contents = field.rules not in ('REPEATED', 'FIXARRAY', 'ONEOF')
+
+            if field.pbtype == 'MESSAGE':
+                submsg = other_dependencies.get(str(field.submsgname))
+                if submsg is None:
+                    return (False, False, False)
+
+                sub_memcpy_ok, sub_zero, sub_exact = submsg.default_init_info(other_dependencies)
+                if not sub_memcpy_ok:
+                    return (False, False, False)
+
+                if has_contents:
+                    zero = zero and sub_zero
+                    exact = exact and sub_exact
+            elif not has_contents:
+                pass
+            elif field.pbtype in ('ENUM', 'UENUM') and field.default is None:
+                # _init_default uses the smallest value, while the default
+                # is the first value listed.
+                enumtype = dependencies.get(str(field.ctype))
+                if enumtype is None:
+                    exact = False
+                else:
+                    values = [v for n,v in enumtype.values]
+                    if values and values[0] != min(values):
+                        exact = False
+            elif field.pbtype in ('FLOAT', 'DOUBLE') and field.default is not None:
+                # INFINITY and NAN require math.h
+                if 'inf' in str(field.default) or 'nan' in str(field.default):
+                    exact = False
+
+        return (True, zero, exact)
+
+    def tag_lookup_definition(self, width):
+        '''Return the tag lookup table enabled by the tag_lookup option.
+        The table contains the iterator indexes for each tag number, so the
+        values must match the field_info array generated by usr_PB_BIND.
+        To limit the size, tags above 4 * field count + 64 are left out of
+        the table and are found by searching instead.
+        '''
+        if not self.tag_lookup or not self.fields:
+            return None
+
+        sorted_fields = list(self.all_fields())
+        sorted_fields.sort(key = lambda x: x.tag)
+        count = len(sorted_fields)
+        tag_limit = 4 * count + 64
+
+        entries = {}
+        field_info_index = 0
+        required_index = 0
+        submsg_index = 0
+        for index, field in enumerate(sorted_fields):
+            if field.pbtype != 'EXTENSION' and field.tag <= tag_limit:
+                entries[field.tag] = (index, field_info_index, required_index, submsg_index, field.name)
+
+            field_info_index += field.descriptor_width(width)
+            required_index += (field.rules == 'REQUIRED')
+            submsg_index += (field.pbtype in ['MESSAGE', 'MSG_W_CB'])
+
+        if not entries:
+            return None
+
+        length = max(entries.keys()) + 1
+        result = 'static const usr_pb_field_lookup_t %s_field_lookup[%d] = {\n' % (self.name, length)
+        result += '    {%3d,   0,   0,   0}, /* table length */\n' % length
+        for tag in range(1, length):
+            if tag in entries:
+                index, field_info_index, required_index, submsg_index, name = entries[tag]
+                result += '    {%3d, %3d, %3d, %3d}, /* %d: %s */\n' % (index, field_info_index,
+                                                                       required_index, submsg_index,
+                                                                       tag, name)
+            else:
+                result += '    {%3d,   0,   0,   0},\n' % count
+        result += '};\n'
         return result
 
     def required_descriptor_width(self, dependencies):
@@ -1783,6 +1980,11 @@ class ProtoFile:
                 yield extension.tags()
             yield '\n'
 
+            yield '/* Field indexes (for use in field masks with usr_pb_decode_projected) */\n'
+            for msg in sort_dependencies(self.messages):
+                yield msg.field_indexes()
+            yield '\n'
+
             yield '/* Struct field encoding specification for nanopb */\n'
             for msg in self.messages:
                 yield msg.fields_declaration(self.dependencies) + '\n'
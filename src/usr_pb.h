@@ -47,6 +47,26 @@
  * the string processing slightly and slightly increases code size. */
 /* #define usr_PB_VALIDATE_UTF8 1 */
 
+/* Do not use SIMD instructions, even if the compiler enables them.
+ * Nanopb uses SSE2, AVX2 or NEON for some bulk operations when the
+ * compiler flags allow it, and portable C code otherwise. */
+/* #define usr_PB_NO_SIMD 1 */
+
+/* Maximum nesting depth of submessages accepted by usr_pb_validate(). */
+/* #define usr_PB_VALIDATE_MAX_DEPTH 32 */
+
+/* Number of fields whose array entries usr_pb_validate() counts at a time.
+ * Messages with arrays in later fields are checked again for each set. */
+/* #define usr_PB_VALIDATE_ARRAY_FIELDS 64 */
+
+/* Nesting depth of submessages that usr_pb_encoder_write() can stop in. */
+/* #define usr_PB_ENCODER_MAX_DEPTH 4 */
+
+/* Store an unpacked copy of the field descriptors, so that the field
+ * iterator does not need to decode the packed format on every field.
+ * Speeds up encoding and decoding at the cost of some constant data. */
+/* #define usr_PB_EXPANDED_DESCRIPTORS 1 */
+
 /******************************************************************
  * You usually don't need to change anything below this line.     *
  * Feel free to look around and use the defined macros, though.   *
@@ -169,6 +189,21 @@ extern "C" {
 #error You should not lower usr_PB_MAX_REQUIRED_FIELDS from the default value (64).
 #endif
 
+/* Nesting depth of submessages checked by usr_pb_validate(). */
+#ifndef usr_PB_VALIDATE_MAX_DEPTH
+#define usr_PB_VALIDATE_MAX_DEPTH 32
+#endif
+
+/* Number of fields counted at a time by usr_pb_validate(). */
+#ifndef usr_PB_VALIDATE_ARRAY_FIELDS
+#define usr_PB_VALIDATE_ARRAY_FIELDS 64
+#endif
+
+/* Nesting depth of submessages that usr_pb_encoder_write() can stop in. */
+#ifndef usr_PB_ENCODER_MAX_DEPTH
+#define usr_PB_ENCODER_MAX_DEPTH 4
+#endif
+
 #ifdef usr_PB_WITHOUT_64BIT
 #ifdef usr_PB_CONVERT_DOUBLE_FLOAT
 /* Cannot use doubles without 64-bit types */
@@ -176,6 +211,20 @@ extern "C" {
 #endif
 #endif
 
+/* Detect little-endian platforms with 8-bit bytes, where fixed32 and
+ * fixed64 values have the same layout in memory as on the wire and
+ * can be copied as is. Can also be defined on the compiler command line. */
+#ifndef usr_PB_LITTLE_ENDIAN_8BIT
+#if ((defined(__BYTE_ORDER) && __BYTE_ORDER == __LITTLE_ENDIAN) || \
+     (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || \
+      defined(__LITTLE_ENDIAN__) || defined(__ARMEL__) || \
+      defined(__THUMBEL__) || defined(__AARCH64EL__) || defined(_MIPSEL) || \
+      defined(_M_IX86) || defined(_M_X64) || defined(_M_ARM)) \
+     && CHAR_BIT == 8
+#define usr_PB_LITTLE_ENDIAN_8BIT 1
+#endif
+#endif
+
 /* List of possible field types. These are used in the autogenerated code.
  * Least-significant 4 bits tell the scalar type
  * Most-significant 4 bits specify repeated/required/packed etc.
@@ -223,8 +272,18 @@ typedef uint_least8_t usr_pb_type_t;
  * usr_pb_byte_t[data_size] rather than usr_pb_bytes_array_t. */
 #define usr_PB_LTYPE_FIXED_LENGTH_BYTES 0x0BU
 
+/* Bytes stored as a reference to data outside the message.
+ * The field is a usr_pb_view_t. When decoding from a memory buffer, it
+ * points directly into the input data instead of copying it. */
+#define usr_PB_LTYPE_VIEW 0x0CU
+
+/* String stored as a usr_pb_view_t, same as usr_PB_LTYPE_VIEW otherwise.
+ * The text is not null terminated. With usr_PB_VALIDATE_UTF8, it is
+ * checked in the same way as other strings. */
+#define usr_PB_LTYPE_STRING_VIEW 0x0DU
+
 /* Number of declared LTYPES */
-#define usr_PB_LTYPES_COUNT 0x0CU
+#define usr_PB_LTYPES_COUNT 0x0EU
 #define usr_PB_LTYPE_MASK 0x0FU
 
 /**** Field repetition rules ****/
@@ -249,6 +308,8 @@ typedef uint_least8_t usr_pb_type_t;
 #define usr_PB_LTYPE(x) ((x) & usr_PB_LTYPE_MASK)
 #define usr_PB_LTYPE_IS_SUBMSG(x) (usr_PB_LTYPE(x) == usr_PB_LTYPE_SUBMESSAGE || \
                                usr_PB_LTYPE(x) == usr_PB_LTYPE_SUBMSG_W_CB)
+#define usr_PB_LTYPE_IS_VIEW(x) (usr_PB_LTYPE(x) == usr_PB_LTYPE_VIEW || \
+                             usr_PB_LTYPE(x) == usr_PB_LTYPE_STRING_VIEW)
 
 /* Data type used for storing sizes of struct fields
  * and array counts.
@@ -276,6 +337,32 @@ typedef struct usr_pb_field_iter_s usr_pb_field_iter_t;
 /* This structure is used in auto-generated constants
  * to specify struct fields.
  */
+/* Optional lookup table from tag number to field position, generated with
+ * the tag_lookup option. It is indexed by tag number, and an entry with index
+ * equal to field_count marks an unused tag. Tag number 0 is never used, so its
+ * entry stores the number of entries in the table instead. Fields with larger
+ * tag numbers are found by searching through the descriptor. */
+typedef struct {
+    usr_pb_size_t index;
+    usr_pb_size_t field_info_index;
+    usr_pb_size_t required_field_index;
+    usr_pb_size_t submessage_index;
+} usr_pb_field_lookup_t;
+
+#ifdef usr_PB_EXPANDED_DESCRIPTORS
+/* Unpacked field descriptor, generated alongside field_info when
+ * usr_PB_EXPANDED_DESCRIPTORS is defined. Contains the same information
+ * as the packed format, one entry per field. */
+typedef struct {
+    uint32_t data_offset;
+    usr_pb_size_t tag;
+    usr_pb_size_t data_size;
+    usr_pb_size_t array_size;
+    int_least8_t size_offset;
+    usr_pb_type_t type;
+} usr_pb_field_record_t;
+#endif
+
 typedef struct usr_pb_msgdesc_s usr_pb_msgdesc_t;
 struct usr_pb_msgdesc_s {
     const uint32_t *field_info;
@@ -287,6 +374,18 @@ struct usr_pb_msgdesc_s {
     usr_pb_size_t field_count;
     usr_pb_size_t required_field_count;
     usr_pb_size_t largest_tag;
+
+    const usr_pb_field_lookup_t *field_lookup; /* Tag lookup table, or NULL */
+
+    /* When default_size is nonzero, the whole structure can be set to its
+     * default values by copying default_size bytes from default_image,
+     * or by setting them to zero if default_image is NULL. */
+    const void *default_image;
+    size_t default_size;
+
+#ifdef usr_PB_EXPANDED_DESCRIPTORS
+    const usr_pb_field_record_t *field_records;
+#endif
 };
 
 /* Iterator for message descriptor */
@@ -295,7 +394,7 @@ struct usr_pb_field_iter_s {
     void *message;                   /* Pointer to start of the structure */
 
     usr_pb_size_t index;                 /* Index of the field */
-    usr_pb_size_t field_info_index;      /* Index to descriptor->field_info array */
+    usr_pb_size_t field_info_index;      /* Index to descriptor->field_info array (unused with usr_PB_EXPANDED_DESCRIPTORS) */
     usr_pb_size_t required_field_index;  /* Index that counts only the required fields */
     usr_pb_size_t submessage_index;      /* Index that counts only submessages */
 
@@ -338,6 +437,17 @@ struct usr_pb_bytes_array_s {
 };
 typedef struct usr_pb_bytes_array_s usr_pb_bytes_array_t;
 
+/* This structure is used for string and bytes fields with the FT_VIEW
+ * option. The data is not copied into the message, and is not null
+ * terminated. After decoding, ptr points into the input buffer, which
+ * must be kept alive as long as the message is used.
+ */
+struct usr_pb_view_s {
+    const usr_pb_byte_t *ptr;
+    usr_pb_size_t size;
+};
+typedef struct usr_pb_view_s usr_pb_view_t;
+
 /* This structure is used for giving the callback function.
  * It is stored in the message structure and filled in by the method that
  * calls usr_pb_decode.
@@ -458,6 +568,16 @@ struct usr_pb_extension_s {
 
 /* Binding of a message field set into a specific structure */
 #define usr_PB_BIND(msgname, structname, width) \
+    usr_PB_BIND_EX(msgname, structname, width, NULL, NULL, 0)
+
+/* Same as usr_PB_BIND, but also stores a tag lookup table in the descriptor */
+#define usr_PB_BIND_WITH_LOOKUP(msgname, structname, width, lookup) \
+    usr_PB_BIND_EX(msgname, structname, width, lookup, NULL, 0)
+
+/* Same as usr_PB_BIND_WITH_LOOKUP, but also stores the default value image
+ * and its size, as described in usr_pb_msgdesc_t. */
+#define usr_PB_BIND_EX(msgname, structname, width, lookup, default_image, default_size) \
+    usr_PB_FIELD_RECORDS(msgname, structname) \
     const uint32_t structname ## _field_info[] usr_PB_PROGMEM = \
     { \
         msgname ## _FIELDLIST(usr_PB_GEN_FIELD_INFO_ ## width, structname) \
@@ -477,6 +597,10 @@ struct usr_pb_extension_s {
        0 msgname ## _FIELDLIST(usr_PB_GEN_FIELD_COUNT, structname), \
        0 msgname ## _FIELDLIST(usr_PB_GEN_REQ_FIELD_COUNT, structname), \
        0 msgname ## _FIELDLIST(usr_PB_GEN_LARGEST_TAG, structname), \
+       lookup, \
+       default_image, \
+       default_size \
+       usr_PB_FIELD_RECORDS_REF(structname) \
     }; \
     msgname ## _FIELDLIST(usr_PB_GEN_FIELD_INFO_ASSERT_ ## width, structname)
 
@@ -486,6 +610,28 @@ struct usr_pb_extension_s {
 #define usr_PB_GEN_LARGEST_TAG(structname, atype, htype, ltype, fieldname, tag) \
     * 0 + tag
 
+/* Unpacked descriptor array for usr_PB_EXPANDED_DESCRIPTORS */
+#ifdef usr_PB_EXPANDED_DESCRIPTORS
+#define usr_PB_FIELD_RECORDS(msgname, structname) \
+    const usr_pb_field_record_t structname ## _field_records[] = \
+    { \
+        msgname ## _FIELDLIST(usr_PB_GEN_FIELD_RECORD, structname) \
+        {0, 0, 0, 0, 0, 0} \
+    };
+#define usr_PB_FIELD_RECORDS_REF(structname) , structname ## _field_records
+#else
+#define usr_PB_FIELD_RECORDS(msgname, structname)
+#define usr_PB_FIELD_RECORDS_REF(structname)
+#endif
+
+#define usr_PB_GEN_FIELD_RECORD(structname, atype, htype, ltype, fieldname, tag) \
+    {(uint32_t)(usr_PB_DATA_OFFSET_ ## atype(_usr_PB_HTYPE_ ## htype, structname, fieldname)), \
+     (usr_pb_size_t)(tag), \
+     (usr_pb_size_t)(usr_PB_DATA_SIZE_ ## atype(_usr_PB_HTYPE_ ## htype, structname, fieldname)), \
+     (usr_pb_size_t)(usr_PB_ARRAY_SIZE_ ## atype(_usr_PB_HTYPE_ ## htype, structname, fieldname)), \
+     (int_least8_t)(usr_PB_SIZE_OFFSET_ ## atype(_usr_PB_HTYPE_ ## htype, structname, fieldname)), \
+     (usr_pb_type_t)(usr_PB_ATYPE_ ## atype | usr_PB_HTYPE_ ## htype | usr_PB_LTYPE_MAP_ ## ltype)},
+
 /* X-macro for generating the entries in struct_field_info[] array. */
 #define usr_PB_GEN_FIELD_INFO_1(structname, atype, htype, ltype, fieldname, tag) \
     usr_PB_FIELDINFO_1(tag, usr_PB_ATYPE_ ## atype | usr_PB_HTYPE_ ## htype | usr_PB_LTYPE_MAP_ ## ltype, \
@@ -683,6 +829,8 @@ struct usr_pb_extension_s {
 #define usr_PB_SI_usr_PB_LTYPE_UINT64(t)
 #define usr_PB_SI_usr_PB_LTYPE_EXTENSION(t)
 #define usr_PB_SI_usr_PB_LTYPE_FIXED_LENGTH_BYTES(t)
+#define usr_PB_SI_usr_PB_LTYPE_VIEW(t)
+#define usr_PB_SI_usr_PB_LTYPE_STRING_VIEW(t)
 #define usr_PB_SUBMSG_DESCRIPTOR(t)    &(t ## _msg),
 
 /* The field descriptors use a variable width format, with width of either
@@ -802,6 +950,8 @@ struct usr_pb_extension_s {
 #define usr_PB_FI_WIDTH_usr_PB_LTYPE_UINT64    1
 #define usr_PB_FI_WIDTH_usr_PB_LTYPE_EXTENSION 1
 #define usr_PB_FI_WIDTH_usr_PB_LTYPE_FIXED_LENGTH_BYTES 2
+#define usr_PB_FI_WIDTH_usr_PB_LTYPE_VIEW      2
+#define usr_PB_FI_WIDTH_usr_PB_LTYPE_STRING_VIEW 2
 
 /* The mapping from protobuf types to LTYPEs is done using these macros. */
 #define usr_PB_LTYPE_MAP_BOOL               usr_PB_LTYPE_BOOL
@@ -825,6 +975,8 @@ struct usr_pb_extension_s {
 #define usr_PB_LTYPE_MAP_UINT64             usr_PB_LTYPE_UVARINT
 #define usr_PB_LTYPE_MAP_EXTENSION          usr_PB_LTYPE_EXTENSION
 #define usr_PB_LTYPE_MAP_FIXED_LENGTH_BYTES usr_PB_LTYPE_FIXED_LENGTH_BYTES
+#define usr_PB_LTYPE_MAP_VIEW               usr_PB_LTYPE_VIEW
+#define usr_PB_LTYPE_MAP_STRING_VIEW        usr_PB_LTYPE_STRING_VIEW
 
 /* These macros are used for giving out error messages.
  * They are mostly a debugging aid; the main error information
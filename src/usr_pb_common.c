@@ -5,15 +5,62 @@
 
 #include "usr_pb_common.h"
 
+/* Vector instructions used for finding runs of bytes below 0x80: ASCII text
+ * in UTF-8 validation, and single-byte varints in packed arrays. The block
+ * size is the number of bytes checked at a time. */
+#ifndef usr_PB_NO_SIMD
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define usr_PB_SIMD_AVX2 1
+#define usr_PB_SIMD_BLOCK_SIZE 32
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define usr_PB_SIMD_SSE2 1
+#define usr_PB_SIMD_BLOCK_SIZE 16
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define usr_PB_SIMD_NEON 1
+#define usr_PB_SIMD_BLOCK_SIZE 16
+#endif
+#endif
+
+#ifndef usr_PB_SIMD_BLOCK_SIZE
+#define usr_PB_SIMD_BLOCK_SIZE sizeof(size_t)
+#endif
+
+/* Quick checks on the field at iter->index, done before loading the rest
+ * of the descriptor. The packed format has only the lowest 6 bits of the
+ * tag number in the first word, so a match there is only a candidate. */
+#ifdef usr_PB_EXPANDED_DESCRIPTORS
+#define usr_PB_ITER_TAG_MAY_MATCH(iter, tag) ((iter)->descriptor->field_records[(iter)->index].tag == (tag))
+#define usr_PB_ITER_PEEK_TYPE(iter) ((iter)->descriptor->field_records[(iter)->index].type)
+#else
+#define usr_PB_ITER_TAG_MAY_MATCH(iter, tag) (((usr_PB_PROGMEM_READU32((iter)->descriptor->field_info[(iter)->field_info_index]) >> 2) & 0x3F) == ((tag) & 0x3F))
+#define usr_PB_ITER_PEEK_TYPE(iter) ((usr_pb_type_t)((usr_PB_PROGMEM_READU32((iter)->descriptor->field_info[(iter)->field_info_index]) >> 8) & 0xFF))
+#endif
+
 static bool load_descriptor_values(usr_pb_field_iter_t *iter)
 {
+#ifndef usr_PB_EXPANDED_DESCRIPTORS
     uint32_t word0;
+#endif
     uint32_t data_offset;
     int_least8_t size_offset;
 
     if (iter->index >= iter->descriptor->field_count)
         return false;
 
+#ifdef usr_PB_EXPANDED_DESCRIPTORS
+    {
+        const usr_pb_field_record_t *record = &iter->descriptor->field_records[iter->index];
+        iter->type = record->type;
+        iter->tag = record->tag;
+        iter->array_size = record->array_size;
+        iter->data_size = record->data_size;
+        size_offset = record->size_offset;
+        data_offset = record->data_offset;
+    }
+#else
     word0 = usr_PB_PROGMEM_READU32(iter->descriptor->field_info[iter->field_info_index]);
     iter->type = (usr_pb_type_t)((word0 >> 8) & 0xFF);
 
@@ -70,6 +117,7 @@ static bool load_descriptor_values(usr_pb_field_iter_t *iter)
             break;
         }
     }
+#endif
 
     if (!iter->message)
     {
@@ -85,13 +133,6 @@ static bool load_descriptor_values(usr_pb_field_iter_t *iter)
         {
             iter->pSize = (char*)iter->pField - size_offset;
         }
-        else if (usr_PB_HTYPE(iter->type) == usr_PB_HTYPE_REPEATED &&
-                 (usr_PB_ATYPE(iter->type) == usr_PB_ATYPE_STATIC ||
-                  usr_PB_ATYPE(iter->type) == usr_PB_ATYPE_POINTER))
-        {
-            /* Fixed count array */
-            iter->pSize = &iter->array_size;
-        }
         else
         {
             iter->pSize = NULL;
@@ -107,6 +148,15 @@ static bool load_descriptor_values(usr_pb_field_iter_t *iter)
         }
     }
 
+    if (size_offset == 0 && usr_PB_HTYPE(iter->type) == usr_PB_HTYPE_REPEATED &&
+        (usr_PB_ATYPE(iter->type) == usr_PB_ATYPE_STATIC ||
+         usr_PB_ATYPE(iter->type) == usr_PB_ATYPE_POINTER))
+    {
+        /* Fixed count array, recognized by pSize also when there is
+         * no message, as in usr_pb_validate() */
+        iter->pSize = &iter->array_size;
+    }
+
     if (usr_PB_LTYPE_IS_SUBMSG(iter->type))
     {
         iter->submsg_desc = iter->descriptor->submsg_info[iter->submessage_index];
@@ -133,6 +183,9 @@ static void advance_iterator(usr_pb_field_iter_t *iter)
     }
     else
     {
+#ifdef usr_PB_EXPANDED_DESCRIPTORS
+        usr_pb_type_t prev_type = iter->descriptor->field_records[iter->index - 1].type;
+#else
         /* Increment indexes based on previous field type.
          * All field info formats have the following fields:
          * - lowest 2 bits tell the amount of words in the descriptor (2^n words)
@@ -148,6 +201,7 @@ static void advance_iterator(usr_pb_field_iter_t *iter)
          * Because the data is is constants from generator, there is no danger of overflow.
          */
         iter->field_info_index = (usr_pb_size_t)(iter->field_info_index + descriptor_len);
+#endif
         iter->required_field_index = (usr_pb_size_t)(iter->required_field_index + (usr_PB_HTYPE(prev_type) == usr_PB_HTYPE_REQUIRED));
         iter->submessage_index = (usr_pb_size_t)(iter->submessage_index + usr_PB_LTYPE_IS_SUBMSG(prev_type));
     }
@@ -168,8 +222,13 @@ bool usr_pb_field_iter_begin_extension(usr_pb_field_iter_t *iter, usr_pb_extensi
     const usr_pb_msgdesc_t *msg = (const usr_pb_msgdesc_t*)extension->type->arg;
     bool status;
 
-    uint32_t word0 = usr_PB_PROGMEM_READU32(msg->field_info[0]);
-    if (usr_PB_ATYPE(word0 >> 8) == usr_PB_ATYPE_POINTER)
+#ifdef usr_PB_EXPANDED_DESCRIPTORS
+    usr_pb_type_t type = msg->field_records[0].type;
+#else
+    usr_pb_type_t type = (usr_pb_type_t)(usr_PB_PROGMEM_READU32(msg->field_info[0]) >> 8);
+#endif
+
+    if (usr_PB_ATYPE(type) == usr_PB_ATYPE_POINTER)
     {
         /* For pointer extensions, the pointer is stored directly
          * in the extension structure. This avoids having an extra
@@ -204,8 +263,17 @@ bool usr_pb_field_iter_find(usr_pb_field_iter_t *iter, uint32_t tag)
     }
     else
     {
-        usr_pb_size_t start = iter->index;
-        uint32_t fieldinfo;
+        usr_pb_size_t start;
+
+        const usr_pb_field_lookup_t *lookup = iter->descriptor->field_lookup;
+
+        if (lookup && tag != 0 && tag < lookup[0].index)
+        {
+            /* Jump directly to the field using the generated table */
+            return usr_pb_field_iter_restore(iter, &lookup[tag]);
+        }
+
+        start = iter->index;
 
         if (tag < iter->tag)
         {
@@ -221,9 +289,7 @@ bool usr_pb_field_iter_find(usr_pb_field_iter_t *iter, uint32_t tag)
             advance_iterator(iter);
 
             /* Do fast check for tag number match */
-            fieldinfo = usr_PB_PROGMEM_READU32(iter->descriptor->field_info[iter->field_info_index]);
-
-            if (((fieldinfo >> 2) & 0x3F) == (tag & 0x3F))
+            if (usr_PB_ITER_TAG_MAY_MATCH(iter, tag))
             {
                 /* Good candidate, check further */
                 (void)load_descriptor_values(iter);
@@ -243,6 +309,26 @@ bool usr_pb_field_iter_find(usr_pb_field_iter_t *iter, uint32_t tag)
     }
 }
 
+void usr_pb_field_iter_save(const usr_pb_field_iter_t *iter, usr_pb_field_lookup_t *pos)
+{
+    pos->index = iter->index;
+    pos->field_info_index = iter->field_info_index;
+    pos->required_field_index = iter->required_field_index;
+    pos->submessage_index = iter->submessage_index;
+}
+
+bool usr_pb_field_iter_restore(usr_pb_field_iter_t *iter, const usr_pb_field_lookup_t *pos)
+{
+    if (pos->index >= iter->descriptor->field_count)
+        return false;
+
+    iter->index = pos->index;
+    iter->field_info_index = pos->field_info_index;
+    iter->required_field_index = pos->required_field_index;
+    iter->submessage_index = pos->submessage_index;
+    return load_descriptor_values(iter);
+}
+
 bool usr_pb_field_iter_find_extension(usr_pb_field_iter_t *iter)
 {
     if (usr_PB_LTYPE(iter->type) == usr_PB_LTYPE_EXTENSION)
@@ -252,7 +338,6 @@ bool usr_pb_field_iter_find_extension(usr_pb_field_iter_t *iter)
     else
     {
         usr_pb_size_t start = iter->index;
-        uint32_t fieldinfo;
 
         do
         {
@@ -260,9 +345,7 @@ bool usr_pb_field_iter_find_extension(usr_pb_field_iter_t *iter)
             advance_iterator(iter);
 
             /* Do fast check for field type */
-            fieldinfo = usr_PB_PROGMEM_READU32(iter->descriptor->field_info[iter->field_info_index]);
-
-            if (usr_PB_LTYPE((fieldinfo >> 8) & 0xFF) == usr_PB_LTYPE_EXTENSION)
+            if (usr_PB_LTYPE(usr_PB_ITER_PEEK_TYPE(iter)) == usr_PB_LTYPE_EXTENSION)
             {
                 return load_descriptor_values(iter);
             }
@@ -321,67 +404,143 @@ bool usr_pb_default_field_callback(usr_pb_istream_t *istream, usr_pb_ostream_t *
 
 }
 
+size_t usr_pb_ascii_blocks(const usr_pb_byte_t *s, size_t len)
+{
+    size_t i = 0;
+
+#if defined(usr_PB_SIMD_AVX2)
+    while (len - i >= 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(const void*)(s + i));
+        if (_mm256_movemask_epi8(v) != 0)
+            break;
+        i += 32;
+    }
+#elif defined(usr_PB_SIMD_SSE2)
+    while (len - i >= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(const void*)(s + i));
+        if (_mm_movemask_epi8(v) != 0)
+            break;
+        i += 16;
+    }
+#elif defined(usr_PB_SIMD_NEON)
+    while (len - i >= 16)
+    {
+        uint8x16_t v = vld1q_u8(s + i);
+        if (vmaxvq_u8(v) >= 0x80)
+            break;
+        i += 16;
+    }
+#else
+    const size_t highbits = ((size_t)-1 / 0xFF) * 0x80;
+
+    while (len - i >= sizeof(size_t))
+    {
+        size_t word;
+        memcpy(&word, s + i, sizeof(size_t));
+        if ((word & highbits) != 0)
+            break;
+        i += sizeof(size_t);
+    }
+#endif
+
+    return i;
+}
+
 #ifdef usr_PB_VALIDATE_UTF8
 
-/* This function checks whether a string is valid UTF-8 text.
+/* Return the length of the UTF-8 character at s, or 0 if it is not valid.
+ * At most left bytes are available.
  *
  * Algorithm is adapted from https://www.cl.cam.ac.uk/~mgk25/ucs/utf8_check.c
  * Original copyright: Markus Kuhn <http://www.cl.cam.ac.uk/~mgk25/> 2005-03-30
  * Licensed under "Short code license", which allows use under MIT license or
  * any compatible with it.
  */
+static size_t utf8_char_length(const usr_pb_byte_t *s, size_t left)
+{
+    if (s[0] < 0x80)
+    {
+        /* 0xxxxxxx */
+        return 1;
+    }
+    else if ((s[0] & 0xe0) == 0xc0)
+    {
+        /* 110XXXXx 10xxxxxx */
+        if (left < 2 ||
+            (s[1] & 0xc0) != 0x80 ||
+            (s[0] & 0xfe) == 0xc0)                        /* overlong? */
+            return 0;
+        else
+            return 2;
+    }
+    else if ((s[0] & 0xf0) == 0xe0)
+    {
+        /* 1110XXXX 10Xxxxxx 10xxxxxx */
+        if (left < 3 ||
+            (s[1] & 0xc0) != 0x80 ||
+            (s[2] & 0xc0) != 0x80 ||
+            (s[0] == 0xe0 && (s[1] & 0xe0) == 0x80) ||    /* overlong? */
+            (s[0] == 0xed && (s[1] & 0xe0) == 0xa0) ||    /* surrogate? */
+            (s[0] == 0xef && s[1] == 0xbf &&
+            (s[2] & 0xfe) == 0xbe))                 /* U+FFFE or U+FFFF? */
+            return 0;
+        else
+            return 3;
+    }
+    else if ((s[0] & 0xf8) == 0xf0)
+    {
+        /* 11110XXX 10XXxxxx 10xxxxxx 10xxxxxx */
+        if (left < 4 ||
+            (s[1] & 0xc0) != 0x80 ||
+            (s[2] & 0xc0) != 0x80 ||
+            (s[3] & 0xc0) != 0x80 ||
+            (s[0] == 0xf0 && (s[1] & 0xf0) == 0x80) ||    /* overlong? */
+            (s[0] == 0xf4 && s[1] > 0x8f) || s[0] > 0xf4) /* > U+10FFFF? */
+            return 0;
+        else
+            return 4;
+    }
+    else
+    {
+        return 0;
+    }
+}
 
-bool usr_pb_validate_utf8(const char *str)
+bool usr_pb_validate_utf8_len(const char *str, size_t len)
 {
     const usr_pb_byte_t *s = (const usr_pb_byte_t*)str;
-    while (*s)
+    size_t i = 0;
+
+    while (i < len)
     {
-        if (*s < 0x80)
-        {
-            /* 0xxxxxxx */
-            s++;
-        }
-        else if ((s[0] & 0xe0) == 0xc0)
-        {
-            /* 110XXXXx 10xxxxxx */
-            if ((s[1] & 0xc0) != 0x80 ||
-                (s[0] & 0xfe) == 0xc0)                        /* overlong? */
-                return false;
-            else
-                s += 2;
-        }
-        else if ((s[0] & 0xf0) == 0xe0)
-        {
-            /* 1110XXXX 10Xxxxxx 10xxxxxx */
-            if ((s[1] & 0xc0) != 0x80 ||
-                (s[2] & 0xc0) != 0x80 ||
-                (s[0] == 0xe0 && (s[1] & 0xe0) == 0x80) ||    /* overlong? */
-                (s[0] == 0xed && (s[1] & 0xe0) == 0xa0) ||    /* surrogate? */
-                (s[0] == 0xef && s[1] == 0xbf &&
-                (s[2] & 0xfe) == 0xbe))                 /* U+FFFE or U+FFFF? */
-                return false;
-            else
-                s += 3;
-        }
-        else if ((s[0] & 0xf8) == 0xf0)
-        {
-            /* 11110XXX 10XXxxxx 10xxxxxx 10xxxxxx */
-            if ((s[1] & 0xc0) != 0x80 ||
-                (s[2] & 0xc0) != 0x80 ||
-                (s[3] & 0xc0) != 0x80 ||
-                (s[0] == 0xf0 && (s[1] & 0xf0) == 0x80) ||    /* overlong? */
-                (s[0] == 0xf4 && s[1] > 0x8f) || s[0] > 0xf4) /* > U+10FFFF? */
-                return false;
-            else
-                s += 4;
-        }
+        size_t block_end;
+
+        /* Skip plain ASCII text a block at a time, then check the block
+         * that contains other characters one character at a time. */
+        i += usr_pb_ascii_blocks(s + i, len - i);
+
+        if (len - i > usr_PB_SIMD_BLOCK_SIZE)
+            block_end = i + usr_PB_SIMD_BLOCK_SIZE;
         else
+            block_end = len;
+
+        while (i < block_end)
         {
-            return false;
+            size_t length = utf8_char_length(s + i, len - i);
+            if (length == 0)
+                return false;
+            i += length;
         }
     }
 
     return true;
 }
 
+bool usr_pb_validate_utf8(const char *str)
+{
+    return usr_pb_validate_utf8_len(str, strlen(str));
+}
+
 #endif
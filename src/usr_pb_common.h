@@ -32,13 +32,28 @@ bool usr_pb_field_iter_next(usr_pb_field_iter_t *iter);
  * Returns false if no such field exists. */
 bool usr_pb_field_iter_find(usr_pb_field_iter_t *iter, uint32_t tag);
 
+/* Store the position of the iterator, and later move an iterator of the
+ * same message back to it. Restore returns false if the position is not
+ * a field of the message. */
+void usr_pb_field_iter_save(const usr_pb_field_iter_t *iter, usr_pb_field_lookup_t *pos);
+bool usr_pb_field_iter_restore(usr_pb_field_iter_t *iter, const usr_pb_field_lookup_t *pos);
+
 /* Find a field with type usr_PB_LTYPE_EXTENSION, or return false if not found.
  * There can be only one extension range field per message. */
 bool usr_pb_field_iter_find_extension(usr_pb_field_iter_t *iter);
 
+/* Return the number of bytes below 0x80 at the start of s, counted in whole
+ * blocks of a vector register or machine word. Used for skipping ASCII text
+ * in UTF-8 validation and runs of single-byte varints in packed arrays. */
+size_t usr_pb_ascii_blocks(const usr_pb_byte_t *s, size_t len);
+
 #ifdef usr_PB_VALIDATE_UTF8
 /* Validate UTF-8 text string */
 bool usr_pb_validate_utf8(const char *s);
+
+/* Validate len bytes of UTF-8 text. The text does not need to be null
+ * terminated, and null characters in it are accepted. */
+bool usr_pb_validate_utf8_len(const char *s, size_t len);
 #endif
 
 #ifdef __cplusplus
@@ -22,9 +22,22 @@
  **************************************/
 
 static bool checkreturn buf_read(usr_pb_istream_t *stream, usr_pb_byte_t *buf, size_t count);
+#ifndef usr_PB_BUFFER_ONLY
+static bool checkreturn buffered_read(usr_pb_istream_t *stream, usr_pb_byte_t *buf, size_t count);
+#endif
+static const usr_pb_byte_t *direct_input(const usr_pb_istream_t *stream, size_t *count);
+static void consume_input(usr_pb_istream_t *stream, size_t count);
 static bool checkreturn usr_pb_decode_varint32_eof(usr_pb_istream_t *stream, uint32_t *dest, bool *eof);
+static bool checkreturn buf_decode_varint32(usr_pb_istream_t *stream, const usr_pb_byte_t *start, uint32_t *dest);
 static bool checkreturn read_raw_value(usr_pb_istream_t *stream, usr_pb_wire_type_t wire_type, usr_pb_byte_t *buf, size_t *size);
 static bool checkreturn decode_basic_field(usr_pb_istream_t *stream, usr_pb_wire_type_t wire_type, usr_pb_field_iter_t *field);
+static bool checkreturn prepare_static_field(usr_pb_istream_t *stream, usr_pb_field_iter_t *field);
+static bool checkreturn decode_packed_fixed(usr_pb_istream_t *stream, const usr_pb_field_iter_t *field, size_t max_count, size_t *count);
+#ifndef usr_PB_WITHOUT_64BIT
+static void store_small_varints(const usr_pb_field_iter_t *field, void *dest, const usr_pb_byte_t *s, size_t count);
+static bool checkreturn decode_packed_varint(usr_pb_istream_t *stream, const usr_pb_field_iter_t *field, size_t max_count, size_t *count);
+#endif
+static bool checkreturn decode_packed_entries(usr_pb_istream_t *stream, const usr_pb_field_iter_t *field, size_t max_count, size_t *count);
 static bool checkreturn decode_static_field(usr_pb_istream_t *stream, usr_pb_wire_type_t wire_type, usr_pb_field_iter_t *field);
 static bool checkreturn decode_pointer_field(usr_pb_istream_t *stream, usr_pb_wire_type_t wire_type, usr_pb_field_iter_t *field);
 static bool checkreturn decode_callback_field(usr_pb_istream_t *stream, usr_pb_wire_type_t wire_type, usr_pb_field_iter_t *field);
@@ -32,18 +45,69 @@ static bool checkreturn decode_field(usr_pb_istream_t *stream, usr_pb_wire_type_
 static bool checkreturn default_extension_decoder(usr_pb_istream_t *stream, usr_pb_extension_t *extension, uint32_t tag, usr_pb_wire_type_t wire_type);
 static bool checkreturn decode_extension(usr_pb_istream_t *stream, uint32_t tag, usr_pb_wire_type_t wire_type, usr_pb_extension_t *extension);
 static bool usr_pb_field_set_to_default(usr_pb_field_iter_t *field);
-static bool usr_pb_message_set_to_defaults(usr_pb_field_iter_t *iter);
+static bool usr_pb_message_set_to_defaults(usr_pb_field_iter_t *iter, const uint32_t *mask);
+static bool checkreturn begin_message(usr_pb_istream_t *stream, usr_pb_decoder_frame_t *frame, const usr_pb_msgdesc_t *fields, void *dest_struct, unsigned int flags, const uint32_t *mask);
+static bool is_extension_tag(usr_pb_decoder_frame_t *frame, uint32_t tag);
+static bool checkreturn begin_fixed_count(usr_pb_istream_t *stream, usr_pb_decoder_frame_t *frame);
+static bool checkreturn begin_field(usr_pb_istream_t *stream, usr_pb_decoder_frame_t *frame, usr_pb_wire_type_t wire_type);
+static bool selected_fields_seen(const usr_pb_decoder_frame_t *frame);
+static bool checkreturn end_message(usr_pb_istream_t *stream, usr_pb_decoder_frame_t *frame);
+static bool checkreturn prepare_stack_submessage(usr_pb_istream_t *stream, usr_pb_wire_type_t wire_type, usr_pb_field_iter_t *field, bool *push);
+static bool checkreturn usr_pb_decode_stack_inner(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, void *dest_struct, unsigned int flags, usr_pb_decoder_frame_t *stack, size_t stack_size);
+#ifdef usr_PB_CONVERT_DOUBLE_FLOAT
+static float convert_double_to_float(uint64_t value);
+#endif
+#ifdef usr_PB_VALIDATE_UTF8
+static bool checkreturn validate_string_utf8(usr_pb_istream_t *stream, size_t size);
+#endif
+static bool checkreturn validate_field(usr_pb_istream_t *stream, usr_pb_wire_type_t wire_type, const usr_pb_field_iter_t *iter, usr_pb_size_t *count, size_t depth);
+static bool checkreturn validate_fields(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, size_t depth, usr_pb_size_t base, bool *more);
+static bool checkreturn validate_message(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, size_t depth);
+static size_t encode_length_prefix(usr_pb_byte_t *buf, uint32_t value);
+static void splice_bytes(usr_pb_byte_t *buf, size_t *len, size_t pos, size_t old_size, const usr_pb_byte_t *data, size_t new_size, bool apply);
+static bool checkreturn find_last_field(usr_pb_istream_t *stream, const uint32_t *tag_path, size_t depth, const usr_pb_byte_t **pos, usr_pb_wire_type_t *wire_type);
+static bool checkreturn patch_field(usr_pb_istream_t *stream, usr_pb_byte_t *buf, size_t *len, const uint32_t *tag_path, size_t depth, size_t target, const usr_pb_byte_t *value, size_t value_len, bool apply);
+static bool decoder_failed(usr_pb_decoder_t *dec, const usr_pb_istream_t *stream);
+static bool substream_failed(usr_pb_istream_t *stream, const usr_pb_istream_t *substream);
+static bool checkreturn collect_value(usr_pb_istream_t *stream, usr_pb_decoder_t *dec, const usr_pb_byte_t **buf, size_t limit, size_t size, const usr_pb_byte_t **value, size_t *length);
+static bool checkreturn decode_value(usr_pb_istream_t *stream, usr_pb_decoder_t *dec, const usr_pb_byte_t *value, size_t length);
+static bool checkreturn decode_length(usr_pb_istream_t *stream, const usr_pb_byte_t *value, size_t length, uint32_t *size);
+static bool checkreturn decoder_begin_field(usr_pb_istream_t *stream, usr_pb_decoder_t *dec, const usr_pb_byte_t *value, size_t length);
+static bool checkreturn decoder_push(usr_pb_istream_t *stream, usr_pb_decoder_t *dec, size_t size);
+static bool checkreturn decoder_begin_string(usr_pb_istream_t *stream, usr_pb_decoder_t *dec, size_t size);
+static bool checkreturn decoder_end_string(usr_pb_istream_t *stream, usr_pb_decoder_t *dec);
+static bool checkreturn decoder_begin_delimited(usr_pb_istream_t *stream, usr_pb_decoder_t *dec, size_t size);
+static bool checkreturn decoder_pop(usr_pb_istream_t *stream, usr_pb_decoder_t *dec);
+static bool checkreturn decoder_step(usr_pb_istream_t *stream, usr_pb_decoder_t *dec, const usr_pb_byte_t **buf, const usr_pb_byte_t *end);
 static bool checkreturn usr_pb_dec_bool(usr_pb_istream_t *stream, const usr_pb_field_iter_t *field);
 static bool checkreturn usr_pb_dec_varint(usr_pb_istream_t *stream, const usr_pb_field_iter_t *field);
 static bool checkreturn usr_pb_dec_bytes(usr_pb_istream_t *stream, const usr_pb_field_iter_t *field);
 static bool checkreturn usr_pb_dec_string(usr_pb_istream_t *stream, const usr_pb_field_iter_t *field);
+static bool checkreturn usr_pb_dec_view(usr_pb_istream_t *stream, const usr_pb_field_iter_t *field);
 static bool checkreturn usr_pb_dec_submessage(usr_pb_istream_t *stream, const usr_pb_field_iter_t *field);
 static bool checkreturn usr_pb_dec_fixed_length_bytes(usr_pb_istream_t *stream, const usr_pb_field_iter_t *field);
 static bool checkreturn usr_pb_skip_varint(usr_pb_istream_t *stream);
 static bool checkreturn usr_pb_skip_string(usr_pb_istream_t *stream);
 
 #ifdef usr_PB_ENABLE_MALLOC
+/* Arena allocations are aligned to the size of this union. Each allocation
+ * is preceded by one such unit that stores the size of the allocation. */
+typedef union {
+    size_t size;
+    void *ptr;
+    double dbl;
+#ifndef usr_PB_WITHOUT_64BIT
+    uint64_t u64;
+#endif
+} usr_pb_arena_unit_t;
+
+#define usr_PB_ARENA_UNIT sizeof(usr_pb_arena_unit_t)
+
+static void *arena_realloc(usr_pb_arena_t *arena, void *ptr, size_t size);
 static bool checkreturn allocate_field(usr_pb_istream_t *stream, void *pData, size_t data_size, size_t array_size);
+static bool checkreturn reserve_array_entry(usr_pb_istream_t *stream, usr_pb_wire_type_t wire_type, const usr_pb_field_iter_t *field, usr_pb_array_alloc_t *alloc);
+static bool checkreturn prepare_pointer_field(usr_pb_istream_t *stream, usr_pb_field_iter_t *field);
+static bool checkreturn trim_pointer_arrays(usr_pb_istream_t *stream, usr_pb_field_iter_t *iter);
 static void initialize_pointer_field(void *pItem, usr_pb_field_iter_t *field);
 static bool checkreturn usr_pb_release_union_field(usr_pb_istream_t *stream, usr_pb_field_iter_t *field);
 static void usr_pb_release_single_field(usr_pb_field_iter_t *field);
@@ -57,11 +121,26 @@ static void usr_pb_release_single_field(usr_pb_field_iter_t *field);
 #define usr_pb_uint64_t uint64_t
 #endif
 
+static bool checkreturn store_varint(usr_pb_istream_t *stream, const usr_pb_field_iter_t *field, void *dest, usr_pb_uint64_t value);
+
 #define usr_PB_WT_PACKED ((usr_pb_wire_type_t)0xFF)
 
-typedef struct {
-    uint32_t bitfield[(usr_PB_MAX_REQUIRED_FIELDS + 31) / 32];
-} usr_pb_fields_seen_t;
+/* Memory buffer streams and buffered streams are recognized by their
+ * callback, which allows decoding varints directly from the buffer. */
+#ifdef usr_PB_BUFFER_ONLY
+#define usr_PB_ISTREAM_IS_BUFFER(stream) true
+#define usr_PB_ISTREAM_IS_BUFFERED(stream) false
+#else
+#define usr_PB_ISTREAM_IS_BUFFER(stream) ((stream)->callback == &buf_read)
+#define usr_PB_ISTREAM_IS_BUFFERED(stream) ((stream)->callback == &buffered_read)
+#endif
+
+/* Longest possible varint. When at least this many bytes are left in a
+ * memory buffer, varints can be decoded without per-byte length checks. */
+#define usr_PB_VARINT_MAX_LENGTH 10
+
+/* Size of the pieces in which usr_pb_validate() checks strings. */
+#define usr_PB_VALIDATE_CHUNK_SIZE 64
 
 /*******************************
  * usr_pb_istream_t implementation *
@@ -82,16 +161,82 @@ static bool checkreturn buf_read(usr_pb_istream_t *stream, usr_pb_byte_t *buf, s
     return true;
 }
 
+#ifndef usr_PB_BUFFER_ONLY
+static bool checkreturn buffered_read(usr_pb_istream_t *stream, usr_pb_byte_t *buf, size_t count)
+{
+    usr_pb_istream_buffer_t *ib = (usr_pb_istream_buffer_t*)stream->state;
+
+    while (count > 0)
+    {
+        size_t n = ib->end - ib->pos;
+
+        if (n == 0 && buf != NULL && count >= ib->size)
+        {
+            /* Large reads go directly to the destination */
+            n = ib->read(ib->state, buf, count);
+            if (n == 0)
+            {
+                stream->bytes_left = 0; /* EOF */
+                return false;
+            }
+
+            buf += n;
+            count -= n;
+            continue;
+        }
+
+        if (n == 0)
+        {
+            ib->pos = 0;
+            ib->end = ib->read(ib->state, ib->buffer, ib->size);
+            n = ib->end;
+            if (n == 0)
+            {
+                stream->bytes_left = 0; /* EOF */
+                return false;
+            }
+        }
+
+        if (n > count)
+            n = count;
+
+        if (buf != NULL)
+        {
+            memcpy(buf, ib->buffer + ib->pos, n);
+            buf += n;
+        }
+
+        ib->pos += n;
+        count -= n;
+    }
+
+    return true;
+}
+#endif
+
 bool checkreturn usr_pb_read(usr_pb_istream_t *stream, usr_pb_byte_t *buf, size_t count)
 {
     if (count == 0)
         return true;
 
 #ifndef usr_PB_BUFFER_ONLY
-	if (buf == NULL && stream->callback != buf_read)
+	if (buf == NULL && stream->callback != buf_read && stream->callback != buffered_read)
 	{
 		/* Skip input bytes */
 		usr_pb_byte_t tmp[16];
+
+		if (stream->skip != NULL)
+		{
+			if (stream->bytes_left < count)
+				usr_PB_RETURN_ERROR(stream, "end-of-stream");
+
+			if (!stream->skip(stream, count))
+				usr_PB_RETURN_ERROR(stream, "io error");
+
+			stream->bytes_left -= count;
+			return true;
+		}
+
 		while (count > 16)
 		{
 			if (!usr_pb_read(stream, tmp, 16))
@@ -127,6 +272,17 @@ static bool checkreturn usr_pb_readbyte(usr_pb_istream_t *stream, usr_pb_byte_t
         usr_PB_RETURN_ERROR(stream, "end-of-stream");
 
 #ifndef usr_PB_BUFFER_ONLY
+    if (usr_PB_ISTREAM_IS_BUFFERED(stream))
+    {
+        usr_pb_istream_buffer_t *ib = (usr_pb_istream_buffer_t*)stream->state;
+        if (ib->pos < ib->end)
+        {
+            *buf = ib->buffer[ib->pos++];
+            stream->bytes_left--;
+            return true;
+        }
+    }
+
     if (!stream->callback(stream, buf, 1))
         usr_PB_RETURN_ERROR(stream, "io error");
 #else
@@ -160,18 +316,140 @@ usr_pb_istream_t usr_pb_istream_from_buffer(const usr_pb_byte_t *buf, size_t msg
 #ifndef usr_PB_NO_ERRMSG
     stream.errmsg = NULL;
 #endif
+#ifdef usr_PB_ENABLE_MALLOC
+    stream.arena = NULL;
+#endif
+#ifndef usr_PB_BUFFER_ONLY
+    stream.skip = NULL;
+#endif
+    return stream;
+}
+
+#ifndef usr_PB_BUFFER_ONLY
+void usr_pb_istream_buffer_init(usr_pb_istream_buffer_t *ib,
+                            size_t (*read)(void *state, usr_pb_byte_t *buf, size_t count),
+                            void *state, usr_pb_byte_t *buf, size_t bufsize)
+{
+    ib->read = read;
+    ib->state = state;
+    ib->buffer = buf;
+    ib->size = bufsize;
+    ib->pos = 0;
+    ib->end = 0;
+}
+
+usr_pb_istream_t usr_pb_istream_from_buffered(usr_pb_istream_buffer_t *ib, size_t msglen)
+{
+    usr_pb_istream_t stream = usr_pb_istream_from_buffer(NULL, msglen);
+    stream.callback = &buffered_read;
+    stream.state = ib;
     return stream;
 }
+#endif
+
+/* Get a pointer to input data that is already in memory, so that it can be
+ * accessed without calling the stream callback. The number of bytes available
+ * there is stored in *count, which is 0 for custom streams.
+ */
+static const usr_pb_byte_t *direct_input(const usr_pb_istream_t *stream, size_t *count)
+{
+#ifndef usr_PB_BUFFER_ONLY
+    if (usr_PB_ISTREAM_IS_BUFFERED(stream))
+    {
+        const usr_pb_istream_buffer_t *ib = (const usr_pb_istream_buffer_t*)stream->state;
+        *count = ib->end - ib->pos;
+        if (*count > stream->bytes_left)
+            *count = stream->bytes_left;
+        return ib->buffer + ib->pos;
+    }
+#endif
+
+    if (usr_PB_ISTREAM_IS_BUFFER(stream))
+    {
+        *count = stream->bytes_left;
+        return (const usr_pb_byte_t*)stream->state;
+    }
+
+    *count = 0;
+    return NULL;
+}
+
+/* Advance the stream past data returned by direct_input(). */
+static void consume_input(usr_pb_istream_t *stream, size_t count)
+{
+#ifndef usr_PB_BUFFER_ONLY
+    if (usr_PB_ISTREAM_IS_BUFFERED(stream))
+        ((usr_pb_istream_buffer_t*)stream->state)->pos += count;
+    else
+#endif
+        stream->state = (usr_pb_byte_t*)stream->state + count;
+
+    stream->bytes_left -= count;
+}
 
 /********************
  * Helper functions *
  ********************/
 
+/* Decode a varint directly from memory returned by direct_input(). Caller
+ * must check that at least usr_PB_VARINT_MAX_LENGTH bytes are available. */
+static bool checkreturn buf_decode_varint32(usr_pb_istream_t *stream, const usr_pb_byte_t *start, uint32_t *dest)
+{
+    const usr_pb_byte_t *p = start;
+    usr_pb_byte_t byte;
+    uint_fast8_t bitpos = 0;
+    uint32_t result = 0;
+
+    /* The first 5 bytes contain the 32 bits of the value. */
+    do
+    {
+        byte = *p++;
+        result |= (uint32_t)(byte & 0x7F) << bitpos;
+        bitpos = (uint_fast8_t)(bitpos + 7);
+    } while ((byte & 0x80) && bitpos < 35);
+
+    if (byte & 0x80)
+    {
+        /* Note: The varint could have trailing 0x80 bytes, or 0xFF for negative. */
+        do
+        {
+            usr_pb_byte_t sign_extension = (bitpos < 63) ? 0xFF : 0x01;
+            bool valid_extension;
+
+            if (bitpos >= 64)
+                usr_PB_RETURN_ERROR(stream, "varint overflow");
+
+            byte = *p++;
+            valid_extension = ((byte & 0x7F) == 0x00 ||
+                     ((result >> 31) != 0 && byte == sign_extension));
+
+            if (!valid_extension)
+                usr_PB_RETURN_ERROR(stream, "varint overflow");
+
+            bitpos = (uint_fast8_t)(bitpos + 7);
+        } while (byte & 0x80);
+    }
+    else if (bitpos == 35 && (byte & 0x70) != 0)
+    {
+        /* The last byte was at bitpos=28, so only bottom 4 bits fit. */
+        usr_PB_RETURN_ERROR(stream, "varint overflow");
+    }
+
+    consume_input(stream, (size_t)(p - start));
+    *dest = result;
+    return true;
+}
+
 static bool checkreturn usr_pb_decode_varint32_eof(usr_pb_istream_t *stream, uint32_t *dest, bool *eof)
 {
     usr_pb_byte_t byte;
     uint32_t result;
+    size_t available;
+    const usr_pb_byte_t *input = direct_input(stream, &available);
     
+    if (available >= usr_PB_VARINT_MAX_LENGTH)
+        return buf_decode_varint32(stream, input, dest);
+
     if (!usr_pb_readbyte(stream, &byte))
     {
         if (stream->bytes_left == 0)
@@ -242,7 +520,29 @@ bool checkreturn usr_pb_decode_varint(usr_pb_istream_t *stream, uint64_t *dest)
     usr_pb_byte_t byte;
     uint_fast8_t bitpos = 0;
     uint64_t result = 0;
+    size_t available;
+    const usr_pb_byte_t *start = direct_input(stream, &available);
     
+    if (available >= usr_PB_VARINT_MAX_LENGTH)
+    {
+        /* Read directly from memory, the whole varint fits. */
+        const usr_pb_byte_t *p = start;
+
+        do
+        {
+            if (bitpos >= 64)
+                usr_PB_RETURN_ERROR(stream, "varint overflow");
+
+            byte = *p++;
+            result |= (uint64_t)(byte & 0x7F) << bitpos;
+            bitpos = (uint_fast8_t)(bitpos + 7);
+        } while (byte & 0x80);
+
+        consume_input(stream, (size_t)(p - start));
+        *dest = result;
+        return true;
+    }
+
     do
     {
         if (bitpos >= 64)
@@ -265,7 +565,7 @@ bool checkreturn usr_pb_skip_varint(usr_pb_istream_t *stream)
     usr_pb_byte_t byte;
     do
     {
-        if (!usr_pb_read(stream, &byte, 1))
+        if (!usr_pb_readbyte(stream, &byte))
             return false;
     } while (byte & 0x80);
     return true;
@@ -456,65 +756,42 @@ static bool checkreturn decode_basic_field(usr_pb_istream_t *stream, usr_pb_wire
 
             return usr_pb_dec_fixed_length_bytes(stream, field);
 
+        case usr_PB_LTYPE_VIEW:
+        case usr_PB_LTYPE_STRING_VIEW:
+            if (wire_type != usr_PB_WT_STRING)
+                usr_PB_RETURN_ERROR(stream, "wrong wire type");
+
+            return usr_pb_dec_view(stream, field);
+
         default:
             usr_PB_RETURN_ERROR(stream, "invalid field type");
     }
 }
 
-static bool checkreturn decode_static_field(usr_pb_istream_t *stream, usr_pb_wire_type_t wire_type, usr_pb_field_iter_t *field)
+/* Update the has_ field, array count or oneof tag of a static field
+ * before decoding a single value into field->pData. */
+static bool checkreturn prepare_static_field(usr_pb_istream_t *stream, usr_pb_field_iter_t *field)
 {
     switch (usr_PB_HTYPE(field->type))
     {
         case usr_PB_HTYPE_REQUIRED:
-            return decode_basic_field(stream, wire_type, field);
+            return true;
             
         case usr_PB_HTYPE_OPTIONAL:
             if (field->pSize != NULL)
                 *(bool*)field->pSize = true;
-            return decode_basic_field(stream, wire_type, field);
+            return true;
     
         case usr_PB_HTYPE_REPEATED:
-            if (wire_type == usr_PB_WT_STRING
-                && usr_PB_LTYPE(field->type) <= usr_PB_LTYPE_LAST_PACKABLE)
-            {
-                /* Packed array */
-                bool status = true;
-                usr_pb_istream_t substream;
-                usr_pb_size_t *size = (usr_pb_size_t*)field->pSize;
-                field->pData = (char*)field->pField + field->data_size * (*size);
-
-                if (!usr_pb_make_string_substream(stream, &substream))
-                    return false;
-
-                while (substream.bytes_left > 0 && *size < field->array_size)
-                {
-                    if (!decode_basic_field(&substream, usr_PB_WT_PACKED, field))
-                    {
-                        status = false;
-                        break;
-                    }
-                    (*size)++;
-                    field->pData = (char*)field->pData + field->data_size;
-                }
-
-                if (substream.bytes_left != 0)
-                    usr_PB_RETURN_ERROR(stream, "array overflow");
-                if (!usr_pb_close_string_substream(stream, &substream))
-                    return false;
-
-                return status;
-            }
-            else
-            {
-                /* Repeated field */
-                usr_pb_size_t *size = (usr_pb_size_t*)field->pSize;
-                field->pData = (char*)field->pField + field->data_size * (*size);
+        {
+            usr_pb_size_t *size = (usr_pb_size_t*)field->pSize;
+            field->pData = (char*)field->pField + field->data_size * (*size);
 
-                if ((*size)++ >= field->array_size)
-                    usr_PB_RETURN_ERROR(stream, "array overflow");
+            if ((*size)++ >= field->array_size)
+                usr_PB_RETURN_ERROR(stream, "array overflow");
 
-                return decode_basic_field(stream, wire_type, field);
-            }
+            return true;
+        }
 
         case usr_PB_HTYPE_ONEOF:
             if (usr_PB_LTYPE_IS_SUBMSG(field->type) &&
@@ -537,103 +814,485 @@ static bool checkreturn decode_static_field(usr_pb_istream_t *stream, usr_pb_wir
                     usr_pb_field_iter_t submsg_iter;
                     if (usr_pb_field_iter_begin(&submsg_iter, field->submsg_desc, field->pData))
                     {
-                        if (!usr_pb_message_set_to_defaults(&submsg_iter))
+                        if (!usr_pb_message_set_to_defaults(&submsg_iter, NULL))
                             usr_PB_RETURN_ERROR(stream, "failed to set defaults");
                     }
                 }
             }
             *(usr_pb_size_t*)field->pSize = field->tag;
-
-            return decode_basic_field(stream, wire_type, field);
+            return true;
 
         default:
             usr_PB_RETURN_ERROR(stream, "invalid field type");
     }
 }
 
-#ifdef usr_PB_ENABLE_MALLOC
-/* Allocate storage for the field and store the pointer at iter->pData.
- * array_size is the number of entries to reserve in an array.
- * Zero size is not allowed, use usr_pb_free() for releasing.
+/* Decode entries of a packed fixed32 or fixed64 array in bulk, up to
+ * max_count of them, into consecutive array entries starting at
+ * field->pData. The number of entries decoded is stored in *count; any
+ * that remain are left for the caller to decode one at a time.
+ *
+ * On little-endian platforms the entries are read with a single
+ * usr_pb_read(), which is a memcpy() for memory buffers. Doubles that are
+ * converted to floats are converted directly from the input buffer.
  */
-static bool checkreturn allocate_field(usr_pb_istream_t *stream, void *pData, size_t data_size, size_t array_size)
-{    
-    void *ptr = *(void**)pData;
-    
-    if (data_size == 0 || array_size == 0)
-        usr_PB_RETURN_ERROR(stream, "invalid size");
-    
-#ifdef __AVR__
-    /* Workaround for AVR libc bug 53284: http://savannah.nongnu.org/bugs/?53284
-     * Realloc to size of 1 byte can cause corruption of the malloc structures.
-     */
-    if (data_size == 1 && array_size == 1)
-    {
-        data_size = 2;
-    }
+static bool checkreturn decode_packed_fixed(usr_pb_istream_t *stream, const usr_pb_field_iter_t *field, size_t max_count, size_t *count)
+{
+    size_t wire_size;
+    size_t n;
+
+    *count = 0;
+
+    if (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_FIXED32)
+        wire_size = 4;
+#ifndef usr_PB_WITHOUT_64BIT
+    else if (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_FIXED64)
+        wire_size = 8;
 #endif
+    else
+        return true;
 
-    /* Check for multiplication overflows.
-     * This code avoids the costly division if the sizes are small enough.
-     * Multiplication is safe as long as only half of bits are set
-     * in either multiplicand.
-     */
+    n = stream->bytes_left / wire_size;
+    if (n > max_count)
+        n = max_count;
+
+#ifdef usr_PB_CONVERT_DOUBLE_FLOAT
+    if (wire_size == 8 && field->data_size == sizeof(float))
     {
-        const size_t check_limit = (size_t)1 << (sizeof(size_t) * 4);
-        if (data_size >= check_limit || array_size >= check_limit)
+        size_t avail;
+        const usr_pb_byte_t *p = direct_input(stream, &avail);
+        float *dest = (float*)field->pData;
+        size_t i;
+
+        if (n > avail / 8)
+            n = avail / 8;
+
+        if (n == 0)
+            return true;
+
+        for (i = 0; i < n; i++, p += 8)
         {
-            const size_t size_max = (size_t)-1;
-            if (size_max / array_size < data_size)
-            {
-                usr_PB_RETURN_ERROR(stream, "size too large");
-            }
+            uint64_t value = ((uint64_t)p[0] << 0) |
+                             ((uint64_t)p[1] << 8) |
+                             ((uint64_t)p[2] << 16) |
+                             ((uint64_t)p[3] << 24) |
+                             ((uint64_t)p[4] << 32) |
+                             ((uint64_t)p[5] << 40) |
+                             ((uint64_t)p[6] << 48) |
+                             ((uint64_t)p[7] << 56);
+            dest[i] = convert_double_to_float(value);
         }
+
+        consume_input(stream, n * 8);
+        *count = n;
+        return true;
     }
-    
-    /* Allocate new or expand previous allocation */
-    /* Note: on failure the old pointer will remain in the structure,
-     * the message must be freed by caller also on error return. */
-    ptr = usr_pb_realloc(ptr, array_size * data_size);
-    if (ptr == NULL)
-        usr_PB_RETURN_ERROR(stream, "realloc failed");
-    
-    *(void**)pData = ptr;
+#endif
+
+#ifdef usr_PB_LITTLE_ENDIAN_8BIT
+    if (field->data_size == wire_size && n > 0)
+    {
+        if (!usr_pb_read(stream, (usr_pb_byte_t*)field->pData, n * wire_size))
+            return false;
+
+        *count = n;
+    }
+#endif
+
     return true;
 }
 
-/* Clear a newly allocated item in case it contains a pointer, or is a submessage. */
-static void initialize_pointer_field(void *pItem, usr_pb_field_iter_t *field)
+#ifndef usr_PB_WITHOUT_64BIT
+/* Store count single-byte varints from s into consecutive array entries.
+ * The values are below 128, so they fit in any field size without range
+ * checks, and ZigZag decoding is the only conversion needed. */
+static void store_small_varints(const usr_pb_field_iter_t *field, void *dest, const usr_pb_byte_t *s, size_t count)
 {
-    if (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_STRING ||
-        usr_PB_LTYPE(field->type) == usr_PB_LTYPE_BYTES)
+    bool zigzag = (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_SVARINT);
+    size_t i;
+
+    if (field->data_size == sizeof(int64_t))
     {
-        *(void**)pItem = NULL;
+        int64_t *d = (int64_t*)dest;
+        for (i = 0; i < count; i++)
+            d[i] = zigzag ? ((int64_t)(s[i] >> 1) ^ -(int64_t)(s[i] & 1)) : (int64_t)s[i];
     }
-    else if (usr_PB_LTYPE_IS_SUBMSG(field->type))
+    else if (field->data_size == sizeof(int32_t))
     {
-        /* We memset to zero so that any callbacks are set to NULL.
-         * Default values will be set by usr_pb_dec_submessage(). */
-        memset(pItem, 0, field->data_size);
+        int32_t *d = (int32_t*)dest;
+        for (i = 0; i < count; i++)
+            d[i] = zigzag ? ((int32_t)(s[i] >> 1) ^ -(int32_t)(s[i] & 1)) : (int32_t)s[i];
+    }
+    else if (field->data_size == sizeof(int_least16_t))
+    {
+        int_least16_t *d = (int_least16_t*)dest;
+        for (i = 0; i < count; i++)
+            d[i] = (int_least16_t)(zigzag ? ((s[i] >> 1) ^ -(s[i] & 1)) : s[i]);
+    }
+    else
+    {
+        int_least8_t *d = (int_least8_t*)dest;
+        for (i = 0; i < count; i++)
+            d[i] = (int_least8_t)(zigzag ? ((s[i] >> 1) ^ -(s[i] & 1)) : s[i]);
     }
 }
-#endif
 
-static bool checkreturn decode_pointer_field(usr_pb_istream_t *stream, usr_pb_wire_type_t wire_type, usr_pb_field_iter_t *field)
+/* Decode entries of a packed varint array in bulk, directly from memory
+ * returned by direct_input(), up to max_count of them. Works like
+ * decode_packed_fixed(). Runs of single-byte values are found a block at a
+ * time and stored without range checks. Other values are decoded while
+ * at least usr_PB_VARINT_MAX_LENGTH bytes are left, so that there is no
+ * need for per-byte length checks, and the last few are left to the caller.
+ */
+static bool checkreturn decode_packed_varint(usr_pb_istream_t *stream, const usr_pb_field_iter_t *field, size_t max_count, size_t *count)
 {
-#ifndef usr_PB_ENABLE_MALLOC
-    usr_PB_UNUSED(wire_type);
-    usr_PB_UNUSED(field);
-    usr_PB_RETURN_ERROR(stream, "no malloc support");
-#else
-    switch (usr_PB_HTYPE(field->type))
+    size_t avail;
+    const usr_pb_byte_t *start = direct_input(stream, &avail);
+    const usr_pb_byte_t *p = start;
+    char *dest = (char*)field->pData;
+    size_t n = 0;
+
+    *count = 0;
+
+    if (field->data_size != sizeof(int64_t) && field->data_size != sizeof(int32_t) &&
+        field->data_size != sizeof(int_least16_t) && field->data_size != sizeof(int_least8_t))
     {
-        case usr_PB_HTYPE_REQUIRED:
-        case usr_PB_HTYPE_OPTIONAL:
-        case usr_PB_HTYPE_ONEOF:
-            if (usr_PB_LTYPE_IS_SUBMSG(field->type) && *(void**)field->pField != NULL)
-            {
-                /* Duplicate field, have to release the old allocation first. */
-                /* FIXME: Does this work correctly for oneofs? */
+        return true; /* usr_pb_dec_varint() reports the error */
+    }
+
+    while (n < max_count && avail - (size_t)(p - start) >= usr_PB_VARINT_MAX_LENGTH)
+    {
+        usr_pb_byte_t byte = *p++;
+        uint64_t value = byte & 0x7F;
+
+        if (byte & 0x80)
+        {
+            uint_fast8_t bitpos = 7;
+
+            do
+            {
+                if (bitpos >= 64)
+                    usr_PB_RETURN_ERROR(stream, "varint overflow");
+
+                byte = *p++;
+                value |= (uint64_t)(byte & 0x7F) << bitpos;
+                bitpos = (uint_fast8_t)(bitpos + 7);
+            } while (byte & 0x80);
+        }
+        else
+        {
+            /* Check if a run of single-byte values starts here */
+            size_t limit = avail - (size_t)(p - start) + 1;
+            size_t run;
+
+            if (limit > max_count - n)
+                limit = max_count - n;
+
+            run = usr_pb_ascii_blocks(p - 1, limit);
+            if (run > 0)
+            {
+                store_small_varints(field, dest, p - 1, run);
+                dest += field->data_size * run;
+                p += run - 1;
+                n += run;
+                continue;
+            }
+        }
+
+        if (!store_varint(stream, field, dest, value))
+            return false;
+
+        dest += field->data_size;
+        n++;
+    }
+
+    consume_input(stream, (size_t)(p - start));
+    *count = n;
+    return true;
+}
+#endif
+
+/* Decode entries of a packed array in bulk, for the types that support it.
+ * See decode_packed_fixed(). */
+static bool checkreturn decode_packed_entries(usr_pb_istream_t *stream, const usr_pb_field_iter_t *field, size_t max_count, size_t *count)
+{
+    switch (usr_PB_LTYPE(field->type))
+    {
+        case usr_PB_LTYPE_FIXED32:
+        case usr_PB_LTYPE_FIXED64:
+            return decode_packed_fixed(stream, field, max_count, count);
+
+#ifndef usr_PB_WITHOUT_64BIT
+        case usr_PB_LTYPE_VARINT:
+        case usr_PB_LTYPE_UVARINT:
+        case usr_PB_LTYPE_SVARINT:
+            return decode_packed_varint(stream, field, max_count, count);
+#endif
+
+        default:
+            *count = 0;
+            return true;
+    }
+}
+
+static bool checkreturn decode_static_field(usr_pb_istream_t *stream, usr_pb_wire_type_t wire_type, usr_pb_field_iter_t *field)
+{
+    if (usr_PB_HTYPE(field->type) == usr_PB_HTYPE_REPEATED
+        && wire_type == usr_PB_WT_STRING
+        && usr_PB_LTYPE(field->type) <= usr_PB_LTYPE_LAST_PACKABLE)
+    {
+        /* Packed array */
+        bool status = true;
+        usr_pb_istream_t substream;
+        usr_pb_size_t *size = (usr_pb_size_t*)field->pSize;
+        size_t count = 0;
+        field->pData = (char*)field->pField + field->data_size * (*size);
+
+        if (!usr_pb_make_string_substream(stream, &substream))
+            return false;
+
+        if (*size < field->array_size &&
+            !decode_packed_entries(&substream, field, (size_t)(field->array_size - *size), &count))
+        {
+            status = false;
+        }
+
+        *size = (usr_pb_size_t)(*size + count);
+        field->pData = (char*)field->pData + field->data_size * count;
+
+        while (status && substream.bytes_left > 0 && *size < field->array_size)
+        {
+            if (!decode_basic_field(&substream, usr_PB_WT_PACKED, field))
+            {
+                status = false;
+                break;
+            }
+            (*size)++;
+            field->pData = (char*)field->pData + field->data_size;
+        }
+
+        if (substream.bytes_left != 0)
+            usr_PB_RETURN_ERROR(stream, "array overflow");
+        if (!usr_pb_close_string_substream(stream, &substream))
+            return false;
+
+        return status;
+    }
+
+    if (!prepare_static_field(stream, field))
+        return false;
+
+    return decode_basic_field(stream, wire_type, field);
+}
+
+#ifdef usr_PB_ENABLE_MALLOC
+/* Allocate a new block from the arena, or resize an earlier one. Like
+ * realloc(), the contents are preserved and NULL is returned if there is
+ * not enough space. The most recent allocation is resized in place, and
+ * other blocks are copied to the end of the arena when they grow.
+ */
+static void *arena_realloc(usr_pb_arena_t *arena, void *ptr, size_t size)
+{
+    size_t old_size = 0;
+    size_t offset;
+
+    /* Round up to a whole number of units */
+    if (size > (size_t)-1 - usr_PB_ARENA_UNIT)
+        return NULL;
+    size = (size + usr_PB_ARENA_UNIT - 1) / usr_PB_ARENA_UNIT * usr_PB_ARENA_UNIT;
+
+    if (ptr != NULL)
+    {
+        offset = (size_t)((usr_pb_byte_t*)ptr - arena->buffer);
+        memcpy(&old_size, arena->buffer + offset - usr_PB_ARENA_UNIT, sizeof(size_t));
+
+        if (offset == arena->last)
+        {
+            /* Most recent allocation can be resized in place */
+            if (size > arena->size - offset)
+                return NULL;
+
+            arena->used = offset + size;
+            memcpy(arena->buffer + offset - usr_PB_ARENA_UNIT, &size, sizeof(size_t));
+            return ptr;
+        }
+        else if (size <= old_size)
+        {
+            /* Space of earlier allocations is not reused until reset */
+            return ptr;
+        }
+    }
+
+    if (arena->size - arena->used < usr_PB_ARENA_UNIT ||
+        arena->size - arena->used - usr_PB_ARENA_UNIT < size)
+    {
+        return NULL;
+    }
+
+    offset = arena->used + usr_PB_ARENA_UNIT;
+    memcpy(arena->buffer + arena->used, &size, sizeof(size_t));
+    arena->used = offset + size;
+    arena->last = offset;
+
+    if (ptr != NULL)
+        memcpy(arena->buffer + offset, ptr, old_size);
+
+    return arena->buffer + offset;
+}
+
+/* Allocate storage for the field and store the pointer at iter->pData.
+ * array_size is the number of entries to reserve in an array.
+ * Zero size is not allowed, use usr_pb_free() for releasing.
+ */
+static bool checkreturn allocate_field(usr_pb_istream_t *stream, void *pData, size_t data_size, size_t array_size)
+{    
+    void *ptr = *(void**)pData;
+    
+    if (data_size == 0 || array_size == 0)
+        usr_PB_RETURN_ERROR(stream, "invalid size");
+    
+#ifdef __AVR__
+    /* Workaround for AVR libc bug 53284: http://savannah.nongnu.org/bugs/?53284
+     * Realloc to size of 1 byte can cause corruption of the malloc structures.
+     */
+    if (data_size == 1 && array_size == 1)
+    {
+        data_size = 2;
+    }
+#endif
+
+    /* Check for multiplication overflows.
+     * This code avoids the costly division if the sizes are small enough.
+     * Multiplication is safe as long as only half of bits are set
+     * in either multiplicand.
+     */
+    {
+        const size_t check_limit = (size_t)1 << (sizeof(size_t) * 4);
+        if (data_size >= check_limit || array_size >= check_limit)
+        {
+            const size_t size_max = (size_t)-1;
+            if (size_max / array_size < data_size)
+            {
+                usr_PB_RETURN_ERROR(stream, "size too large");
+            }
+        }
+    }
+    
+    /* Allocate new or expand previous allocation */
+    /* Note: on failure the old pointer will remain in the structure,
+     * the message must be freed by caller also on error return. */
+    if (stream->arena)
+        ptr = arena_realloc(stream->arena, ptr, array_size * data_size);
+    else
+        ptr = usr_pb_realloc(ptr, array_size * data_size);
+    if (ptr == NULL)
+        usr_PB_RETURN_ERROR(stream, "realloc failed");
+    
+    *(void**)pData = ptr;
+    return true;
+}
+
+/* Make sure that a pointer array has room for one more entry, before
+ * decode_pointer_field() appends to it. The allocation is doubled when it
+ * runs out, to avoid reallocating for every entry. Packed arrays are
+ * allocated by decode_pointer_field() based on the data length.
+ */
+static bool checkreturn reserve_array_entry(usr_pb_istream_t *stream, usr_pb_wire_type_t wire_type, const usr_pb_field_iter_t *field, usr_pb_array_alloc_t *alloc)
+{
+    usr_pb_size_t size = *(usr_pb_size_t*)field->pSize;
+    usr_pb_size_t capacity;
+
+    alloc->needs_trim = true;
+
+    if (wire_type == usr_PB_WT_STRING
+        && usr_PB_LTYPE(field->type) <= usr_PB_LTYPE_LAST_PACKABLE)
+    {
+        /* Packed array will reallocate to its own size estimate */
+        alloc->field_index = usr_PB_SIZE_MAX;
+        return true;
+    }
+
+    if (alloc->field_index != field->index)
+    {
+        /* Arrays that are not tracked are allocated at least up to their count */
+        alloc->field_index = field->index;
+        alloc->capacity = size;
+    }
+
+    if (size < alloc->capacity || size == usr_PB_SIZE_MAX)
+        return true; /* Enough space, or decode_pointer_field() reports the error */
+
+    if (size < 4)
+        capacity = 4;
+    else if (size < usr_PB_SIZE_MAX / 2)
+        capacity = (usr_pb_size_t)(size * 2);
+    else
+        capacity = usr_PB_SIZE_MAX;
+
+    if (!allocate_field(stream, field->pField, field->data_size, capacity))
+        return false;
+
+    alloc->capacity = capacity;
+    return true;
+}
+
+/* Shrink the pointer arrays in the message to the number of decoded entries,
+ * releasing the extra capacity reserved during decoding. */
+static bool checkreturn trim_pointer_arrays(usr_pb_istream_t *stream, usr_pb_field_iter_t *iter)
+{
+    if (!usr_pb_field_iter_begin(iter, iter->descriptor, iter->message))
+        return true;
+
+    do
+    {
+        if (usr_PB_ATYPE(iter->type) == usr_PB_ATYPE_POINTER &&
+            usr_PB_HTYPE(iter->type) == usr_PB_HTYPE_REPEATED &&
+            *(void**)iter->pField != NULL)
+        {
+            usr_pb_size_t count = *(usr_pb_size_t*)iter->pSize;
+
+            if (count > 0 && !allocate_field(stream, iter->pField, iter->data_size, count))
+                return false;
+        }
+    } while (usr_pb_field_iter_next(iter));
+
+    return true;
+}
+
+/* Clear a newly allocated item in case it contains a pointer, or is a submessage. */
+static void initialize_pointer_field(void *pItem, usr_pb_field_iter_t *field)
+{
+    if (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_STRING ||
+        usr_PB_LTYPE(field->type) == usr_PB_LTYPE_BYTES)
+    {
+        *(void**)pItem = NULL;
+    }
+    else if (usr_PB_LTYPE_IS_SUBMSG(field->type))
+    {
+        /* We memset to zero so that any callbacks are set to NULL.
+         * Default values will be set by usr_pb_dec_submessage(). */
+        memset(pItem, 0, field->data_size);
+    }
+}
+#endif
+
+#ifdef usr_PB_ENABLE_MALLOC
+/* Allocate storage for a single value of a pointer field, other than a
+ * packed array entry or a non-repeated string or bytes field, and point
+ * field->pData to it. */
+static bool checkreturn prepare_pointer_field(usr_pb_istream_t *stream, usr_pb_field_iter_t *field)
+{
+    switch (usr_PB_HTYPE(field->type))
+    {
+        case usr_PB_HTYPE_REQUIRED:
+        case usr_PB_HTYPE_OPTIONAL:
+        case usr_PB_HTYPE_ONEOF:
+            if (usr_PB_LTYPE_IS_SUBMSG(field->type) && *(void**)field->pField != NULL &&
+                stream->arena == NULL)
+            {
+                /* Duplicate field, have to release the old allocation first.
+                 * Arena allocations are only released by resetting the arena. */
+                /* FIXME: Does this work correctly for oneofs? */
                 usr_pb_release_single_field(field);
             }
         
@@ -642,546 +1301,2239 @@ static bool checkreturn decode_pointer_field(usr_pb_istream_t *stream, usr_pb_wi
                 *(usr_pb_size_t*)field->pSize = field->tag;
             }
 
-            if (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_STRING ||
-                usr_PB_LTYPE(field->type) == usr_PB_LTYPE_BYTES)
+            if (!allocate_field(stream, field->pField, field->data_size, 1))
+                return false;
+            
+            field->pData = *(void**)field->pField;
+            initialize_pointer_field(field->pData, field);
+            return true;
+    
+        case usr_PB_HTYPE_REPEATED:
+        {
+            /* Normal repeated field, i.e. only one item at a time.
+             * Storage for the new entry has already been reserved by
+             * reserve_array_entry(). */
+            usr_pb_size_t *size = (usr_pb_size_t*)field->pSize;
+
+            if (*size == usr_PB_SIZE_MAX)
+                usr_PB_RETURN_ERROR(stream, "too many array entries");
+
+            field->pData = *(char**)field->pField + field->data_size * (*size);
+            (*size)++;
+            initialize_pointer_field(field->pData, field);
+            return true;
+        }
+
+        default:
+            usr_PB_RETURN_ERROR(stream, "invalid field type");
+    }
+}
+#endif
+
+static bool checkreturn decode_pointer_field(usr_pb_istream_t *stream, usr_pb_wire_type_t wire_type, usr_pb_field_iter_t *field)
+{
+#ifndef usr_PB_ENABLE_MALLOC
+    usr_PB_UNUSED(wire_type);
+    usr_PB_UNUSED(field);
+    usr_PB_RETURN_ERROR(stream, "no malloc support");
+#else
+    if (usr_PB_HTYPE(field->type) == usr_PB_HTYPE_REPEATED
+        && wire_type == usr_PB_WT_STRING
+        && usr_PB_LTYPE(field->type) <= usr_PB_LTYPE_LAST_PACKABLE)
+    {
+        /* Packed array, multiple items come in at once. */
+        bool status = true;
+        usr_pb_size_t *size = (usr_pb_size_t*)field->pSize;
+        size_t allocated_size = *size;
+        size_t count;
+        usr_pb_istream_t substream;
+        
+        if (!usr_pb_make_string_substream(stream, &substream))
+            return false;
+        
+        while (substream.bytes_left)
+        {
+            if (*size == usr_PB_SIZE_MAX)
             {
-                /* usr_pb_dec_string and usr_pb_dec_bytes handle allocation themselves */
-                field->pData = field->pField;
-                return decode_basic_field(stream, wire_type, field);
+#ifndef usr_PB_NO_ERRMSG
+                stream->errmsg = "too many array entries";
+#endif
+                status = false;
+                break;
             }
-            else
+
+            if ((size_t)*size + 1 > allocated_size)
             {
-                if (!allocate_field(stream, field->pField, field->data_size, 1))
-                    return false;
+                /* Allocate more storage. This tries to guess the
+                 * number of remaining entries. Round the division
+                 * upwards. */
+                size_t remain = (substream.bytes_left - 1) / field->data_size + 1;
+                if (remain < usr_PB_SIZE_MAX - allocated_size)
+                    allocated_size += remain;
+                else
+                    allocated_size += 1;
                 
-                field->pData = *(void**)field->pField;
-                initialize_pointer_field(field->pData, field);
-                return decode_basic_field(stream, wire_type, field);
+                if (!allocate_field(&substream, field->pField, field->data_size, allocated_size))
+                {
+                    status = false;
+                    break;
+                }
             }
-    
-        case usr_PB_HTYPE_REPEATED:
-            if (wire_type == usr_PB_WT_STRING
-                && usr_PB_LTYPE(field->type) <= usr_PB_LTYPE_LAST_PACKABLE)
+
+            field->pData = *(char**)field->pField + field->data_size * (*size);
+
+            /* Fill the allocated entries in bulk, if the type allows it */
+            if (!decode_packed_entries(&substream, field, allocated_size - *size, &count))
             {
-                /* Packed array, multiple items come in at once. */
-                bool status = true;
-                usr_pb_size_t *size = (usr_pb_size_t*)field->pSize;
-                size_t allocated_size = *size;
-                usr_pb_istream_t substream;
-                
-                if (!usr_pb_make_string_substream(stream, &substream))
-                    return false;
-                
-                while (substream.bytes_left)
-                {
-                    if (*size == usr_PB_SIZE_MAX)
-                    {
-#ifndef usr_PB_NO_ERRMSG
-                        stream->errmsg = "too many array entries";
-#endif
-                        status = false;
-                        break;
-                    }
+                status = false;
+                break;
+            }
+
+            if (count > 0)
+            {
+                *size = (usr_pb_size_t)(*size + count);
+                continue;
+            }
+
+            /* Decode the array entry */
+            initialize_pointer_field(field->pData, field);
+            if (!decode_basic_field(&substream, usr_PB_WT_PACKED, field))
+            {
+                status = false;
+                break;
+            }
+            
+            (*size)++;
+        }
+        if (!usr_pb_close_string_substream(stream, &substream))
+            return false;
+        
+        return status;
+    }
+
+    if (usr_PB_HTYPE(field->type) != usr_PB_HTYPE_REPEATED &&
+        (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_STRING ||
+         usr_PB_LTYPE(field->type) == usr_PB_LTYPE_BYTES))
+    {
+        /* usr_pb_dec_string and usr_pb_dec_bytes handle allocation themselves */
+        if (usr_PB_HTYPE(field->type) == usr_PB_HTYPE_ONEOF)
+        {
+            *(usr_pb_size_t*)field->pSize = field->tag;
+        }
+
+        field->pData = field->pField;
+        return decode_basic_field(stream, wire_type, field);
+    }
+
+    if (!prepare_pointer_field(stream, field))
+        return false;
+
+    return decode_basic_field(stream, wire_type, field);
+#endif
+}
+
+static bool checkreturn decode_callback_field(usr_pb_istream_t *stream, usr_pb_wire_type_t wire_type, usr_pb_field_iter_t *field)
+{
+    if (!field->descriptor->field_callback)
+        return usr_pb_skip_field(stream, wire_type);
+
+    if (wire_type == usr_PB_WT_STRING)
+    {
+        usr_pb_istream_t substream;
+        size_t prev_bytes_left;
+        
+        if (!usr_pb_make_string_substream(stream, &substream))
+            return false;
+        
+        do
+        {
+            prev_bytes_left = substream.bytes_left;
+            if (!field->descriptor->field_callback(&substream, NULL, field))
+                usr_PB_RETURN_ERROR(stream, "callback failed");
+        } while (substream.bytes_left > 0 && substream.bytes_left < prev_bytes_left);
+        
+        if (!usr_pb_close_string_substream(stream, &substream))
+            return false;
+
+        return true;
+    }
+    else
+    {
+        /* Copy the single scalar value to stack.
+         * This is required so that we can limit the stream length,
+         * which in turn allows to use same callback for packed and
+         * not-packed fields. */
+        usr_pb_istream_t substream;
+        usr_pb_byte_t buffer[10];
+        size_t size = sizeof(buffer);
+        
+        if (!read_raw_value(stream, wire_type, buffer, &size))
+            return false;
+        substream = usr_pb_istream_from_buffer(buffer, size);
+        
+        return field->descriptor->field_callback(&substream, NULL, field);
+    }
+}
+
+static bool checkreturn decode_field(usr_pb_istream_t *stream, usr_pb_wire_type_t wire_type, usr_pb_field_iter_t *field)
+{
+#ifdef usr_PB_ENABLE_MALLOC
+    /* When decoding an oneof field, check if there is old data that must be
+     * released first. */
+    if (usr_PB_HTYPE(field->type) == usr_PB_HTYPE_ONEOF)
+    {
+        if (!usr_pb_release_union_field(stream, field))
+            return false;
+    }
+#endif
+
+    switch (usr_PB_ATYPE(field->type))
+    {
+        case usr_PB_ATYPE_STATIC:
+            return decode_static_field(stream, wire_type, field);
+        
+        case usr_PB_ATYPE_POINTER:
+            return decode_pointer_field(stream, wire_type, field);
+        
+        case usr_PB_ATYPE_CALLBACK:
+            return decode_callback_field(stream, wire_type, field);
+        
+        default:
+            usr_PB_RETURN_ERROR(stream, "invalid field type");
+    }
+}
+
+/* Default handler for extension fields. Expects to have a usr_pb_msgdesc_t
+ * pointer in the extension->type->arg field, pointing to a message with
+ * only one field in it.  */
+static bool checkreturn default_extension_decoder(usr_pb_istream_t *stream,
+    usr_pb_extension_t *extension, uint32_t tag, usr_pb_wire_type_t wire_type)
+{
+    usr_pb_field_iter_t iter;
+
+    if (!usr_pb_field_iter_begin_extension(&iter, extension))
+        usr_PB_RETURN_ERROR(stream, "invalid extension");
+
+    if (iter.tag != tag || !iter.message)
+        return true;
+
+    extension->found = true;
+    return decode_field(stream, wire_type, &iter);
+}
+
+/* Try to decode an unknown field as an extension field. Tries each extension
+ * decoder in turn, until one of them handles the field or loop ends. */
+static bool checkreturn decode_extension(usr_pb_istream_t *stream,
+    uint32_t tag, usr_pb_wire_type_t wire_type, usr_pb_extension_t *extension)
+{
+    size_t pos = stream->bytes_left;
+    
+    while (extension != NULL && pos == stream->bytes_left)
+    {
+        bool status;
+        if (extension->type->decode)
+            status = extension->type->decode(stream, extension, tag, wire_type);
+        else
+            status = default_extension_decoder(stream, extension, tag, wire_type);
+
+        if (!status)
+            return false;
+        
+        extension = extension->next;
+    }
+    
+    return true;
+}
+
+/* Initialize message fields to default values, recursively */
+static bool usr_pb_field_set_to_default(usr_pb_field_iter_t *field)
+{
+    usr_pb_type_t type;
+    type = field->type;
+
+    if (usr_PB_LTYPE(type) == usr_PB_LTYPE_EXTENSION)
+    {
+        usr_pb_extension_t *ext = *(usr_pb_extension_t* const *)field->pData;
+        while (ext != NULL)
+        {
+            usr_pb_field_iter_t ext_iter;
+            if (usr_pb_field_iter_begin_extension(&ext_iter, ext))
+            {
+                ext->found = false;
+                if (!usr_pb_message_set_to_defaults(&ext_iter, NULL))
+                    return false;
+            }
+            ext = ext->next;
+        }
+    }
+    else if (usr_PB_ATYPE(type) == usr_PB_ATYPE_STATIC)
+    {
+        bool init_data = true;
+        if (usr_PB_HTYPE(type) == usr_PB_HTYPE_OPTIONAL && field->pSize != NULL)
+        {
+            /* Set has_field to false. Still initialize the optional field
+             * itself also. */
+            *(bool*)field->pSize = false;
+        }
+        else if (usr_PB_HTYPE(type) == usr_PB_HTYPE_REPEATED ||
+                 usr_PB_HTYPE(type) == usr_PB_HTYPE_ONEOF)
+        {
+            /* REPEATED: Set array count to 0, no need to initialize contents.
+               ONEOF: Set which_field to 0. */
+            *(usr_pb_size_t*)field->pSize = 0;
+            init_data = false;
+        }
+
+        if (init_data)
+        {
+            if (usr_PB_LTYPE_IS_SUBMSG(field->type) &&
+                (field->submsg_desc->default_value != NULL ||
+                 field->submsg_desc->field_callback != NULL ||
+                 field->submsg_desc->submsg_info[0] != NULL))
+            {
+                /* Initialize submessage to defaults.
+                 * Only needed if it has default values
+                 * or callback/submessage fields. */
+                usr_pb_field_iter_t submsg_iter;
+                if (usr_pb_field_iter_begin(&submsg_iter, field->submsg_desc, field->pData))
+                {
+                    if (!usr_pb_message_set_to_defaults(&submsg_iter, NULL))
+                        return false;
+                }
+            }
+            else
+            {
+                /* Initialize to zeros */
+                memset(field->pData, 0, (size_t)field->data_size);
+            }
+        }
+    }
+    else if (usr_PB_ATYPE(type) == usr_PB_ATYPE_POINTER)
+    {
+        /* Initialize the pointer to NULL. */
+        *(void**)field->pField = NULL;
+
+        /* Initialize array count to 0. */
+        if (usr_PB_HTYPE(type) == usr_PB_HTYPE_REPEATED ||
+            usr_PB_HTYPE(type) == usr_PB_HTYPE_ONEOF)
+        {
+            *(usr_pb_size_t*)field->pSize = 0;
+        }
+    }
+    else if (usr_PB_ATYPE(type) == usr_PB_ATYPE_CALLBACK)
+    {
+        /* Don't overwrite callback */
+    }
+
+    return true;
+}
+
+/* Initialize the message, or only the fields selected in mask if it is not NULL */
+static bool usr_pb_message_set_to_defaults(usr_pb_field_iter_t *iter, const uint32_t *mask)
+{
+    usr_pb_istream_t defstream = usr_PB_ISTREAM_EMPTY;
+    uint32_t tag = 0;
+    usr_pb_wire_type_t wire_type = usr_PB_WT_VARINT;
+    bool eof;
+
+    if (iter->descriptor->default_size > 0 && !mask)
+    {
+        /* Generator has determined that the whole structure can be
+         * initialized at once, without any callback fields to preserve. */
+        if (iter->descriptor->default_image)
+            memcpy(iter->message, iter->descriptor->default_image, iter->descriptor->default_size);
+        else
+            memset(iter->message, 0, iter->descriptor->default_size);
+
+        return true;
+    }
+
+    if (iter->descriptor->default_value)
+    {
+        defstream = usr_pb_istream_from_buffer(iter->descriptor->default_value, (size_t)-1);
+        if (!usr_pb_decode_tag(&defstream, &wire_type, &tag, &eof))
+            return false;
+    }
+
+    do
+    {
+        bool selected = !mask || usr_PB_FIELDMASK_HAS(mask, iter->index);
+
+        if (selected && !usr_pb_field_set_to_default(iter))
+            return false;
+
+        if (tag != 0 && iter->tag == tag)
+        {
+            /* We have a default value for this field in the defstream */
+            if (!selected)
+            {
+                if (!usr_pb_skip_field(&defstream, wire_type))
+                    return false;
+            }
+            else if (!decode_field(&defstream, wire_type, iter))
+            {
+                return false;
+            }
+
+            if (!usr_pb_decode_tag(&defstream, &wire_type, &tag, &eof))
+                return false;
+
+            if (selected && iter->pSize)
+                *(bool*)iter->pSize = false;
+        }
+    } while (usr_pb_field_iter_next(iter));
+
+    return true;
+}
+
+/*********************
+ * Decode all fields *
+ *********************/
+
+/* Start decoding a message into dest_struct */
+static bool checkreturn begin_message(usr_pb_istream_t *stream, usr_pb_decoder_frame_t *frame, const usr_pb_msgdesc_t *fields, void *dest_struct, unsigned int flags, const uint32_t *mask)
+{
+    frame->end = (size_t)-1;
+    frame->mask = mask;
+    frame->extension_range_start = 0;
+    frame->extensions = NULL;
+    frame->fixed_count_field = usr_PB_SIZE_MAX;
+    frame->fixed_count_size = 0;
+    frame->fixed_count_total_size = 0;
+    memset(&frame->fields_seen, 0, sizeof(frame->fields_seen));
+
+#ifdef usr_PB_ENABLE_MALLOC
+    frame->array_alloc.field_index = usr_PB_SIZE_MAX;
+    frame->array_alloc.capacity = 0;
+    frame->array_alloc.needs_trim = false;
+#endif
+
+    if (usr_pb_field_iter_begin(&frame->iter, fields, dest_struct))
+    {
+        if ((flags & usr_PB_DECODE_NOINIT) == 0)
+        {
+            if (!usr_pb_message_set_to_defaults(&frame->iter, mask))
+                usr_PB_RETURN_ERROR(stream, "failed to set defaults");
+        }
+    }
+
+    return true;
+}
+
+/* Check if an unknown field should be passed to the extension handlers */
+static bool is_extension_tag(usr_pb_decoder_frame_t *frame, uint32_t tag)
+{
+    if (frame->extension_range_start == 0)
+    {
+        if (usr_pb_field_iter_find_extension(&frame->iter) &&
+            (!frame->mask || usr_PB_FIELDMASK_HAS(frame->mask, frame->iter.index)))
+        {
+            frame->extensions = *(usr_pb_extension_t* const *)frame->iter.pData;
+            frame->extension_range_start = frame->iter.tag;
+        }
+
+        if (!frame->extensions)
+        {
+            frame->extension_range_start = (uint32_t)-1;
+        }
+    }
+
+    return tag >= frame->extension_range_start;
+}
+
+/* Start or continue counting the entries of the fixed count array at
+ * frame->iter, as there is no counter contained in the struct. */
+static bool checkreturn begin_fixed_count(usr_pb_istream_t *stream, usr_pb_decoder_frame_t *frame)
+{
+    if (frame->fixed_count_field != frame->iter.index) {
+        /* If the new fixed count field does not match the previous one,
+         * check that the previous one is NULL or that it finished
+         * receiving all the expected data.
+         */
+        if (frame->fixed_count_field != usr_PB_SIZE_MAX &&
+            frame->fixed_count_size != frame->fixed_count_total_size)
+        {
+            usr_PB_RETURN_ERROR(stream, "wrong size for fixed count field");
+        }
+
+        frame->fixed_count_field = frame->iter.index;
+        frame->fixed_count_size = 0;
+        frame->fixed_count_total_size = frame->iter.array_size;
+    }
+
+    return true;
+}
+
+/* Update the message state before decoding the field at frame->iter */
+static bool checkreturn begin_field(usr_pb_istream_t *stream, usr_pb_decoder_frame_t *frame, usr_pb_wire_type_t wire_type)
+{
+    usr_pb_field_iter_t *iter = &frame->iter;
+
+    /* If a repeated fixed count field was found, get size from
+     * 'fixed_count_field' as there is no counter contained in the struct.
+     */
+    if (usr_PB_HTYPE(iter->type) == usr_PB_HTYPE_REPEATED && iter->pSize == &iter->array_size)
+    {
+        if (!begin_fixed_count(stream, frame))
+            return false;
+
+        iter->pSize = &frame->fixed_count_size;
+    }
+
+    if (usr_PB_HTYPE(iter->type) == usr_PB_HTYPE_REQUIRED
+        && iter->required_field_index < usr_PB_MAX_REQUIRED_FIELDS)
+    {
+        uint32_t tmp = ((uint32_t)1 << (iter->required_field_index & 31));
+        frame->fields_seen.bitfield[iter->required_field_index >> 5] |= tmp;
+    }
+
+#ifdef usr_PB_ENABLE_MALLOC
+    if (usr_PB_ATYPE(iter->type) == usr_PB_ATYPE_POINTER &&
+        usr_PB_HTYPE(iter->type) == usr_PB_HTYPE_REPEATED)
+    {
+        if (!reserve_array_entry(stream, wire_type, iter, &frame->array_alloc))
+            return false;
+    }
+#else
+    usr_PB_UNUSED(wire_type);
+#endif
+
+    return true;
+}
+
+/* Check the required fields one by one, ignoring those not selected in
+ * the field mask. */
+static bool selected_fields_seen(const usr_pb_decoder_frame_t *frame)
+{
+    usr_pb_field_iter_t iter;
+
+    if (!usr_pb_field_iter_begin(&iter, frame->iter.descriptor, frame->iter.message))
+        return true;
+
+    do
+    {
+        if (usr_PB_HTYPE(iter.type) == usr_PB_HTYPE_REQUIRED &&
+            iter.required_field_index < usr_PB_MAX_REQUIRED_FIELDS &&
+            usr_PB_FIELDMASK_HAS(frame->mask, iter.index) &&
+            !usr_PB_FIELDMASK_HAS(frame->fields_seen.bitfield, iter.required_field_index))
+        {
+            return false;
+        }
+    } while (usr_pb_field_iter_next(&iter));
+
+    return true;
+}
+
+/* Finish the message after all its fields have been decoded */
+static bool checkreturn end_message(usr_pb_istream_t *stream, usr_pb_decoder_frame_t *frame)
+{
+    const uint32_t allbits = ~(uint32_t)0;
+
+#ifdef usr_PB_ENABLE_MALLOC
+    if (frame->array_alloc.needs_trim)
+    {
+        if (!trim_pointer_arrays(stream, &frame->iter))
+            return false;
+    }
+#endif
+
+    /* Check that all elements of the last decoded fixed count field were present. */
+    if (frame->fixed_count_field != usr_PB_SIZE_MAX &&
+        frame->fixed_count_size != frame->fixed_count_total_size)
+    {
+        usr_PB_RETURN_ERROR(stream, "wrong size for fixed count field");
+    }
+
+    /* Check that all required fields were present. */
+    if (frame->mask)
+    {
+        if (!selected_fields_seen(frame))
+            usr_PB_RETURN_ERROR(stream, "missing required field");
+    }
+    else
+    {
+        usr_pb_size_t req_field_count = frame->iter.descriptor->required_field_count;
+
+        if (req_field_count > 0)
+        {
+            usr_pb_size_t i;
+
+            if (req_field_count > usr_PB_MAX_REQUIRED_FIELDS)
+                req_field_count = usr_PB_MAX_REQUIRED_FIELDS;
+
+            /* Check the whole words */
+            for (i = 0; i < (req_field_count >> 5); i++)
+            {
+                if (frame->fields_seen.bitfield[i] != allbits)
+                    usr_PB_RETURN_ERROR(stream, "missing required field");
+            }
+
+            /* Check the remaining bits (if any) */
+            if ((req_field_count & 31) != 0)
+            {
+                if (frame->fields_seen.bitfield[req_field_count >> 5] !=
+                    (allbits >> (uint_least8_t)(32 - (req_field_count & 31))))
+                {
+                    usr_PB_RETURN_ERROR(stream, "missing required field");
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool checkreturn usr_pb_decode_inner(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, void *dest_struct, unsigned int flags, const uint32_t *mask)
+{
+    usr_pb_decoder_frame_t frame;
+
+    if (!begin_message(stream, &frame, fields, dest_struct, flags, mask))
+        return false;
+
+    while (stream->bytes_left)
+    {
+        uint32_t tag;
+        usr_pb_wire_type_t wire_type;
+        bool eof;
+
+        if (!usr_pb_decode_tag(stream, &wire_type, &tag, &eof))
+        {
+            if (eof)
+                break;
+            else
+                return false;
+        }
+
+        if (tag == 0)
+        {
+          if (flags & usr_PB_DECODE_NULLTERMINATED)
+          {
+            break;
+          }
+          else
+          {
+            usr_PB_RETURN_ERROR(stream, "zero tag");
+          }
+        }
+
+        if (!usr_pb_field_iter_find(&frame.iter, tag) || usr_PB_LTYPE(frame.iter.type) == usr_PB_LTYPE_EXTENSION)
+        {
+            /* No match found, check if it matches an extension. */
+            if (is_extension_tag(&frame, tag))
+            {
+                size_t pos = stream->bytes_left;
+
+                if (!decode_extension(stream, tag, wire_type, frame.extensions))
+                    return false;
+
+                if (pos != stream->bytes_left)
+                {
+                    /* The field was handled */
+                    continue;
+                }
+            }
+
+            /* No match found, skip data */
+            if (!usr_pb_skip_field(stream, wire_type))
+                return false;
+            continue;
+        }
+
+        if (mask && !usr_PB_FIELDMASK_HAS(mask, frame.iter.index))
+        {
+            /* Field is not selected, skip data */
+            if (!usr_pb_skip_field(stream, wire_type))
+                return false;
+            continue;
+        }
+
+        if (!begin_field(stream, &frame, wire_type))
+            return false;
+
+        if (!decode_field(stream, wire_type, &frame.iter))
+            return false;
+    }
+
+    return end_message(stream, &frame);
+}
+
+static bool checkreturn usr_pb_decode_flags(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, void *dest_struct, unsigned int flags, const uint32_t *mask)
+{
+    bool status;
+
+    if ((flags & usr_PB_DECODE_DELIMITED) == 0)
+    {
+      status = usr_pb_decode_inner(stream, fields, dest_struct, flags, mask);
+    }
+    else
+    {
+      usr_pb_istream_t substream;
+      if (!usr_pb_make_string_substream(stream, &substream))
+        return false;
+
+      status = usr_pb_decode_inner(&substream, fields, dest_struct, flags, mask);
+
+      if (!usr_pb_close_string_substream(stream, &substream))
+        return false;
+    }
+
+    return status;
+}
+
+bool checkreturn usr_pb_decode_ex(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, void *dest_struct, unsigned int flags)
+{
+    bool status;
+
+#ifdef usr_PB_ENABLE_MALLOC
+    stream->arena = NULL;
+#endif
+
+    status = usr_pb_decode_flags(stream, fields, dest_struct, flags, NULL);
+    
+#ifdef usr_PB_ENABLE_MALLOC
+    if (!status)
+        usr_pb_release(fields, dest_struct);
+#endif
+    
+    return status;
+}
+
+bool checkreturn usr_pb_decode_projected(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, void *dest_struct, unsigned int flags, const uint32_t *mask)
+{
+    bool status;
+
+#ifdef usr_PB_ENABLE_MALLOC
+    stream->arena = NULL;
+#endif
+
+    status = usr_pb_decode_flags(stream, fields, dest_struct, flags, mask);
+
+#ifdef usr_PB_ENABLE_MALLOC
+    if (!status)
+        usr_pb_release(fields, dest_struct);
+#endif
+
+    return status;
+}
+
+bool checkreturn usr_pb_decode(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, void *dest_struct)
+{
+    bool status;
+
+#ifdef usr_PB_ENABLE_MALLOC
+    stream->arena = NULL;
+#endif
+
+    status = usr_pb_decode_inner(stream, fields, dest_struct, 0, NULL);
+
+#ifdef usr_PB_ENABLE_MALLOC
+    if (!status)
+        usr_pb_release(fields, dest_struct);
+#endif
+
+    return status;
+}
+
+/* Prepare a submessage field for decoding in place on the frame stack.
+ * Returns true in *push if the caller should start a new frame for it,
+ * or false if the field is decoded normally with decode_field(). */
+static bool checkreturn prepare_stack_submessage(usr_pb_istream_t *stream, usr_pb_wire_type_t wire_type,
+    usr_pb_field_iter_t *field, bool *push)
+{
+    *push = false;
+
+    if (!usr_PB_LTYPE_IS_SUBMSG(field->type) || wire_type != usr_PB_WT_STRING ||
+        field->submsg_desc == NULL)
+    {
+        return true;
+    }
+
+    /* Message callback needs a substream with the whole submessage */
+    if (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_SUBMSG_W_CB && field->pSize != NULL &&
+        ((usr_pb_callback_t*)field->pSize - 1)->funcs.decode != NULL)
+    {
+        return true;
+    }
+
+    if (usr_PB_ATYPE(field->type) == usr_PB_ATYPE_STATIC)
+    {
+#ifdef usr_PB_ENABLE_MALLOC
+        if (usr_PB_HTYPE(field->type) == usr_PB_HTYPE_ONEOF)
+        {
+            if (!usr_pb_release_union_field(stream, field))
+                return false;
+        }
+#endif
+
+        if (!prepare_static_field(stream, field))
+            return false;
+
+        *push = true;
+    }
+#ifdef usr_PB_ENABLE_MALLOC
+    else if (usr_PB_ATYPE(field->type) == usr_PB_ATYPE_POINTER)
+    {
+        if (usr_PB_HTYPE(field->type) == usr_PB_HTYPE_ONEOF)
+        {
+            if (!usr_pb_release_union_field(stream, field))
+                return false;
+        }
+
+        if (!prepare_pointer_field(stream, field))
+            return false;
+
+        *push = true;
+    }
+#endif
+
+    return true;
+}
+
+/* Decode a message using the caller's frame stack for nested submessages.
+ * All frames read from the same stream: the bytes_left of a submessage
+ * replaces that of its parent, and frame->end holds the bytes left in the
+ * parent after the submessage. */
+static bool checkreturn usr_pb_decode_stack_inner(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, void *dest_struct,
+    unsigned int flags, usr_pb_decoder_frame_t *stack, size_t stack_size)
+{
+    size_t depth = 1;
+
+    if (stack_size == 0)
+        usr_PB_RETURN_ERROR(stream, "decoder stack full");
+
+    if (!begin_message(stream, &stack[0], fields, dest_struct, flags, NULL))
+        return false;
+
+    for (;;)
+    {
+        usr_pb_decoder_frame_t *frame = &stack[depth - 1];
+        uint32_t tag = 0;
+        usr_pb_wire_type_t wire_type = usr_PB_WT_VARINT;
+        bool eof = true;
+        bool push;
+
+        if (stream->bytes_left > 0 && !usr_pb_decode_tag(stream, &wire_type, &tag, &eof))
+        {
+            if (!eof)
+                return false;
+        }
+
+        if (!eof && tag == 0)
+        {
+            if ((flags & usr_PB_DECODE_NULLTERMINATED) && depth == 1)
+                eof = true;
+            else
+                usr_PB_RETURN_ERROR(stream, "zero tag");
+        }
+
+        if (eof)
+        {
+            if (!end_message(stream, frame))
+                return false;
+
+            if (--depth == 0)
+                return true;
+
+            /* Like usr_pb_close_string_substream() */
+            if (stream->bytes_left && !usr_pb_read(stream, NULL, stream->bytes_left))
+                return false;
+
+            stream->bytes_left = frame->end;
+            continue;
+        }
+
+        if (!usr_pb_field_iter_find(&frame->iter, tag) || usr_PB_LTYPE(frame->iter.type) == usr_PB_LTYPE_EXTENSION)
+        {
+            /* No match found, check if it matches an extension. */
+            if (is_extension_tag(frame, tag))
+            {
+                size_t pos = stream->bytes_left;
+
+                if (!decode_extension(stream, tag, wire_type, frame->extensions))
+                    return false;
+
+                if (pos != stream->bytes_left)
+                {
+                    /* The field was handled */
+                    continue;
+                }
+            }
+
+            /* No match found, skip data */
+            if (!usr_pb_skip_field(stream, wire_type))
+                return false;
+            continue;
+        }
+
+        if (!begin_field(stream, frame, wire_type))
+            return false;
+
+        if (!prepare_stack_submessage(stream, wire_type, &frame->iter, &push))
+            return false;
+
+        if (!push)
+        {
+            if (!decode_field(stream, wire_type, &frame->iter))
+                return false;
+        }
+        else
+        {
+            usr_pb_field_iter_t *field = &frame->iter;
+            usr_pb_decoder_frame_t *child;
+            uint32_t size;
+
+            if (depth >= stack_size)
+                usr_PB_RETURN_ERROR(stream, "decoder stack full");
+
+            if (!usr_pb_decode_varint32(stream, &size))
+                return false;
+
+            if (stream->bytes_left < size)
+                usr_PB_RETURN_ERROR(stream, "parent stream too short");
+
+            /* Static required/optional fields are already initialized
+             * with the parent message, no need to initialize them again. */
+            child = &stack[depth];
+            if (!begin_message(stream, child, field->submsg_desc, field->pData,
+                    (usr_PB_ATYPE(field->type) == usr_PB_ATYPE_STATIC &&
+                     usr_PB_HTYPE(field->type) != usr_PB_HTYPE_REPEATED) ? usr_PB_DECODE_NOINIT : 0,
+                    NULL))
+            {
+                return false;
+            }
+
+            child->end = stream->bytes_left - (size_t)size;
+            stream->bytes_left = (size_t)size;
+            depth++;
+        }
+    }
+}
+
+bool checkreturn usr_pb_decode_stack(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, void *dest_struct,
+    unsigned int flags, usr_pb_decoder_frame_t *stack, size_t stack_size)
+{
+    bool status;
+
+#ifdef usr_PB_ENABLE_MALLOC
+    stream->arena = NULL;
+#endif
+
+    if ((flags & usr_PB_DECODE_DELIMITED) == 0)
+    {
+        status = usr_pb_decode_stack_inner(stream, fields, dest_struct, flags, stack, stack_size);
+    }
+    else
+    {
+        usr_pb_istream_t substream;
+        if (!usr_pb_make_string_substream(stream, &substream))
+            return false;
+
+        status = usr_pb_decode_stack_inner(&substream, fields, dest_struct, flags, stack, stack_size);
+
+        if (!usr_pb_close_string_substream(stream, &substream))
+            status = false;
+    }
+
+#ifdef usr_PB_ENABLE_MALLOC
+    if (!status)
+        usr_pb_release(fields, dest_struct);
+#endif
+
+    return status;
+}
+
+/***********************
+ * Validating messages *
+ ***********************/
+
+#ifdef usr_PB_VALIDATE_UTF8
+/* Skip a string of the given size, checking that it is valid UTF-8.
+ * Memory buffers are checked in place. Other streams are read in pieces,
+ * and an incomplete character at the end of a piece is moved to the start
+ * of the next one. */
+static bool checkreturn validate_string_utf8(usr_pb_istream_t *stream, size_t size)
+{
+    usr_pb_byte_t buf[usr_PB_VALIDATE_CHUNK_SIZE + 3];
+    size_t carry = 0;
+
+    if (usr_PB_ISTREAM_IS_BUFFER(stream) && stream->bytes_left >= size)
+    {
+        if (!usr_pb_validate_utf8_len((const char*)stream->state, size))
+            usr_PB_RETURN_ERROR(stream, "invalid utf8");
+
+        return usr_pb_read(stream, NULL, size);
+    }
+
+    while (size > 0)
+    {
+        size_t count = (size < usr_PB_VALIDATE_CHUNK_SIZE) ? size : usr_PB_VALIDATE_CHUNK_SIZE;
+        size_t end, start;
+
+        if (!usr_pb_read(stream, buf + carry, count))
+            return false;
+
+        size -= count;
+        end = carry + count;
+
+        /* Find the lead byte of the last character */
+        start = end;
+        while (start > 0 && end - start < 3 && (buf[start - 1] & 0xC0) == 0x80)
+            start--;
+
+        carry = 0;
+        if (size > 0 && start > 0)
+        {
+            usr_pb_byte_t lead = buf[start - 1];
+            size_t length = 1;
+
+            if ((lead & 0xE0) == 0xC0)
+                length = 2;
+            else if ((lead & 0xF0) == 0xE0)
+                length = 3;
+            else if ((lead & 0xF8) == 0xF0)
+                length = 4;
+
+            if (length > end - start + 1)
+                carry = end - start + 1;
+        }
+
+        if (!usr_pb_validate_utf8_len((const char*)buf, end - carry))
+            usr_PB_RETURN_ERROR(stream, "invalid utf8");
+
+        memmove(buf, buf + end - carry, carry);
+    }
+
+    return true;
+}
+#endif
+
+/* Check one field value against the field descriptor without storing it.
+ * Scalar values are decoded into a scratch variable, so that the same range
+ * checks apply as in decoding. *count is the number of entries seen so far
+ * in a static array field, and NULL for other fields. */
+static bool checkreturn validate_field(usr_pb_istream_t *stream, usr_pb_wire_type_t wire_type,
+                                       const usr_pb_field_iter_t *iter, usr_pb_size_t *count, size_t depth)
+{
+    usr_pb_field_iter_t field = *iter;
+    union {
+        usr_pb_uint64_t u;
+        double d;
+    } scratch;
+    uint32_t size;
+
+    if (usr_PB_ATYPE(field.type) == usr_PB_ATYPE_CALLBACK)
+        return usr_pb_skip_field(stream, wire_type);
+
+    if (usr_PB_LTYPE(field.type) <= usr_PB_LTYPE_LAST_PACKABLE)
+    {
+        field.pData = &scratch;
+
+        if (usr_PB_HTYPE(field.type) == usr_PB_HTYPE_REPEATED && wire_type == usr_PB_WT_STRING)
+        {
+            /* Packed array */
+            bool status = true;
+            usr_pb_istream_t substream;
+
+            if (!usr_pb_make_string_substream(stream, &substream))
+                return false;
+
+            while (substream.bytes_left > 0 && (count == NULL || *count < field.array_size))
+            {
+                if (!decode_basic_field(&substream, usr_PB_WT_PACKED, &field))
+                {
+                    status = false;
+                    break;
+                }
+
+                if (count != NULL)
+                    (*count)++;
+            }
+
+            if (status && substream.bytes_left != 0)
+                usr_PB_RETURN_ERROR(stream, "array overflow");
+            if (!usr_pb_close_string_substream(stream, &substream))
+                return false;
+
+            return status;
+        }
+
+        if (count != NULL && (*count)++ >= field.array_size)
+            usr_PB_RETURN_ERROR(stream, "array overflow");
+
+        return decode_basic_field(stream, wire_type, &field);
+    }
+
+    if (wire_type != usr_PB_WT_STRING)
+        usr_PB_RETURN_ERROR(stream, "wrong wire type");
+
+    if (count != NULL && (*count)++ >= field.array_size)
+        usr_PB_RETURN_ERROR(stream, "array overflow");
+
+    if (usr_PB_LTYPE_IS_SUBMSG(field.type))
+    {
+        bool status;
+        usr_pb_istream_t substream;
+
+        if (field.submsg_desc == NULL)
+            usr_PB_RETURN_ERROR(stream, "invalid field descriptor");
+
+        if (depth >= usr_PB_VALIDATE_MAX_DEPTH)
+            usr_PB_RETURN_ERROR(stream, "max nesting depth exceeded");
+
+        if (!usr_pb_make_string_substream(stream, &substream))
+            return false;
+
+        status = validate_message(&substream, field.submsg_desc, depth + 1);
+
+        if (!usr_pb_close_string_substream(stream, &substream))
+            return false;
+
+        return status;
+    }
+
+    if (!usr_pb_decode_varint32(stream, &size))
+        return false;
+
+    switch (usr_PB_LTYPE(field.type))
+    {
+        case usr_PB_LTYPE_BYTES:
+        {
+            size_t alloc_size;
+
+            if (size > usr_PB_SIZE_MAX)
+                usr_PB_RETURN_ERROR(stream, "bytes overflow");
+
+            alloc_size = usr_PB_BYTES_ARRAY_T_ALLOCSIZE(size);
+            if (size > alloc_size)
+                usr_PB_RETURN_ERROR(stream, "size too large");
+
+            if (usr_PB_ATYPE(field.type) == usr_PB_ATYPE_STATIC && alloc_size > field.data_size)
+                usr_PB_RETURN_ERROR(stream, "bytes overflow");
+            break;
+        }
+
+        case usr_PB_LTYPE_STRING:
+            if (size == (uint32_t)-1)
+                usr_PB_RETURN_ERROR(stream, "size too large");
+
+            if (usr_PB_ATYPE(field.type) == usr_PB_ATYPE_STATIC && (size_t)size + 1 > field.data_size)
+                usr_PB_RETURN_ERROR(stream, "string overflow");
+
+#ifdef usr_PB_VALIDATE_UTF8
+            return validate_string_utf8(stream, (size_t)size);
+#else
+            break;
+#endif
+
+        case usr_PB_LTYPE_FIXED_LENGTH_BYTES:
+            if (size > usr_PB_SIZE_MAX)
+                usr_PB_RETURN_ERROR(stream, "bytes overflow");
+
+            if (size != 0 && size != field.data_size)
+                usr_PB_RETURN_ERROR(stream, "incorrect fixed length bytes size");
+            break;
+
+        case usr_PB_LTYPE_VIEW:
+            if (size > usr_PB_SIZE_MAX)
+                usr_PB_RETURN_ERROR(stream, "bytes overflow");
+            break;
+
+        case usr_PB_LTYPE_STRING_VIEW:
+            if (size > usr_PB_SIZE_MAX)
+                usr_PB_RETURN_ERROR(stream, "bytes overflow");
+
+#ifdef usr_PB_VALIDATE_UTF8
+            return validate_string_utf8(stream, (size_t)size);
+#else
+            break;
+#endif
+
+        default:
+            usr_PB_RETURN_ERROR(stream, "invalid field type");
+    }
+
+    return usr_pb_read(stream, NULL, (size_t)size);
+}
+
+/* Check all fields of a message, following the structure of
+ * usr_pb_decode_inner() but without a destination struct. Entries of static
+ * arrays are counted for the usr_PB_VALIDATE_ARRAY_FIELDS fields starting at
+ * index base, and *more is set if the message has arrays after those. */
+static bool checkreturn validate_fields(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, size_t depth,
+                                        usr_pb_size_t base, bool *more)
+{
+    usr_pb_decoder_frame_t frame;
+    usr_pb_size_t counts[usr_PB_VALIDATE_ARRAY_FIELDS];
+
+    memset(counts, 0, sizeof(counts));
+    *more = false;
+
+    if (!begin_message(stream, &frame, fields, NULL, usr_PB_DECODE_NOINIT, NULL))
+        return false;
+
+    while (stream->bytes_left)
+    {
+        uint32_t tag;
+        usr_pb_wire_type_t wire_type;
+        bool eof;
+        usr_pb_size_t *count = NULL;
+
+        if (!usr_pb_decode_tag(stream, &wire_type, &tag, &eof))
+        {
+            if (eof)
+                break;
+            else
+                return false;
+        }
+
+        if (tag == 0)
+            usr_PB_RETURN_ERROR(stream, "zero tag");
+
+        if (!usr_pb_field_iter_find(&frame.iter, tag) || usr_PB_LTYPE(frame.iter.type) == usr_PB_LTYPE_EXTENSION)
+        {
+            /* Unknown fields and extensions are only checked to be well-formed */
+            if (!usr_pb_skip_field(stream, wire_type))
+                return false;
+            continue;
+        }
+
+        if (usr_PB_HTYPE(frame.iter.type) == usr_PB_HTYPE_REPEATED &&
+            frame.iter.pSize == &frame.iter.array_size)
+        {
+            /* Fixed count array, must have exactly array_size entries */
+            if (!begin_fixed_count(stream, &frame))
+                return false;
+
+            count = &frame.fixed_count_size;
+        }
+        else if (usr_PB_HTYPE(frame.iter.type) == usr_PB_HTYPE_REPEATED &&
+                 usr_PB_ATYPE(frame.iter.type) == usr_PB_ATYPE_STATIC)
+        {
+            /* Fields before base were counted on an earlier pass */
+            if (frame.iter.index >= base && frame.iter.index - base < usr_PB_VALIDATE_ARRAY_FIELDS)
+                count = &counts[frame.iter.index - base];
+            else if (frame.iter.index >= base)
+                *more = true;
+        }
+
+        if (usr_PB_HTYPE(frame.iter.type) == usr_PB_HTYPE_REQUIRED
+            && frame.iter.required_field_index < usr_PB_MAX_REQUIRED_FIELDS)
+        {
+            uint32_t tmp = ((uint32_t)1 << (frame.iter.required_field_index & 31));
+            frame.fields_seen.bitfield[frame.iter.required_field_index >> 5] |= tmp;
+        }
+
+        if (!validate_field(stream, wire_type, &frame.iter, count, depth))
+            return false;
+    }
+
+    return end_message(stream, &frame);
+}
+
+/* Check a message, repeating the check for each following set of
+ * usr_PB_VALIDATE_ARRAY_FIELDS fields that has arrays in it, so that all
+ * array counts are exact. Only memory buffers can be read again. */
+static bool checkreturn validate_message(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, size_t depth)
+{
+    usr_pb_istream_t start = *stream;
+    usr_pb_size_t base = 0;
+    bool more;
+
+    for (;;)
+    {
+        if (!validate_fields(stream, fields, depth, base, &more))
+            return false;
+
+        if (!more)
+            return true;
+
+        if (!usr_PB_ISTREAM_IS_BUFFER(&start))
+            usr_PB_RETURN_ERROR(stream, "too many array fields");
+
+        base = (usr_pb_size_t)(base + usr_PB_VALIDATE_ARRAY_FIELDS);
+        *stream = start;
+    }
+}
+
+bool checkreturn usr_pb_validate(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields)
+{
+    return validate_message(stream, fields, 0);
+}
+
+/****************************
+ * Extracting single fields *
+ ****************************/
+
+/* Find the last occurrence of the field at tag_path in the message that
+ * stream points to. A decoder merges all occurrences of a submessage, so
+ * each of them is searched in turn, and the last match of the field itself
+ * is the value that the decoder ends up with. *pos is set to the start of
+ * its value, after the tag, and is left unchanged if there is no match. */
+static bool checkreturn find_last_field(usr_pb_istream_t *stream, const uint32_t *tag_path, size_t depth,
+                                        const usr_pb_byte_t **pos, usr_pb_wire_type_t *wire_type)
+{
+    usr_pb_wire_type_t type;
+    uint32_t tag;
+    bool eof;
+
+    while (usr_pb_decode_tag(stream, &type, &tag, &eof))
+    {
+        if (tag == *tag_path && depth > 1)
+        {
+            usr_pb_istream_t substream;
+
+            if (type != usr_PB_WT_STRING)
+                usr_PB_RETURN_ERROR(stream, "wrong wire type");
+
+            if (!usr_pb_make_string_substream(stream, &substream))
+                return false;
+
+            if (!find_last_field(&substream, tag_path + 1, depth - 1, pos, wire_type))
+            {
+#ifndef usr_PB_NO_ERRMSG
+                stream->errmsg = substream.errmsg;
+#endif
+                return false;
+            }
+
+            if (!usr_pb_close_string_substream(stream, &substream))
+                return false;
+        }
+        else
+        {
+            if (tag == *tag_path)
+            {
+                *pos = (const usr_pb_byte_t*)stream->state;
+                *wire_type = type;
+            }
+
+            if (!usr_pb_skip_field(stream, type))
+                return false;
+        }
+    }
+
+    return eof;
+}
+
+bool checkreturn usr_pb_peek_field(const usr_pb_byte_t *buf, size_t len, const uint32_t *tag_path, size_t depth, usr_pb_istream_t *out)
+{
+    usr_pb_istream_t stream = usr_pb_istream_from_buffer(buf, len);
+    const usr_pb_byte_t *pos = NULL;
+    usr_pb_wire_type_t wire_type = usr_PB_WT_VARINT;
+
+    *out = usr_pb_istream_from_buffer(buf, 0);
+
+    if (depth == 0)
+        usr_PB_RETURN_ERROR(out, "invalid tag path");
+
+    if (!find_last_field(&stream, tag_path, depth, &pos, &wire_type))
+    {
+#ifndef usr_PB_NO_ERRMSG
+        out->errmsg = stream.errmsg;
+#endif
+        return false;
+    }
+
+    if (pos == NULL)
+        usr_PB_RETURN_ERROR(out, "field not found");
+
+    /* The whole message was checked above, so the value is complete */
+    stream = usr_pb_istream_from_buffer(pos, len - (size_t)(pos - buf));
+
+    if (wire_type == usr_PB_WT_STRING)
+    {
+        return usr_pb_make_string_substream(&stream, out);
+    }
+    else
+    {
+        if (!usr_pb_skip_field(&stream, wire_type))
+            return false;
+
+        *out = usr_pb_istream_from_buffer(pos, (size_t)((const usr_pb_byte_t*)stream.state - pos));
+        return true;
+    }
+}
+
+/***************************
+ * Patching encoded fields *
+ ***************************/
+
+/* Encode a length prefix, returns the number of bytes */
+static size_t encode_length_prefix(usr_pb_byte_t *buf, uint32_t value)
+{
+    size_t i = 0;
+
+    while (value >= 0x80)
+    {
+        buf[i++] = (usr_pb_byte_t)(value | 0x80);
+        value >>= 7;
+    }
+
+    buf[i++] = (usr_pb_byte_t)value;
+    return i;
+}
+
+/* Replace old_size bytes at pos with the new data, moving the rest of the
+ * message. When apply is false, only the new message length is calculated. */
+static void splice_bytes(usr_pb_byte_t *buf, size_t *len, size_t pos, size_t old_size,
+                   const usr_pb_byte_t *data, size_t new_size, bool apply)
+{
+    if (apply)
+    {
+        if (new_size != old_size)
+            memmove(buf + pos + new_size, buf + pos + old_size, *len - pos - old_size);
+
+        memcpy(buf + pos, data, new_size);
+    }
+
+    *len = *len - old_size + new_size;
+}
+
+/* Find the field at tag_path whose value starts at target, as found by
+ * find_last_field(), in the message that stream points to, and replace its
+ * value. Enclosing length prefixes are updated on the way out. */
+static bool checkreturn patch_field(usr_pb_istream_t *stream, usr_pb_byte_t *buf, size_t *len,
+                                    const uint32_t *tag_path, size_t depth, size_t target,
+                                    const usr_pb_byte_t *value, size_t value_len, bool apply)
+{
+    usr_pb_wire_type_t wire_type;
+    uint32_t tag;
+    bool eof;
+    size_t pos;
+
+    /* Skip the fields that end before the target */
+    for (;;)
+    {
+        usr_pb_istream_t start;
+
+        if (!usr_pb_decode_tag(stream, &wire_type, &tag, &eof))
+            return false;
+
+        start = *stream;
+        if (!usr_pb_skip_field(stream, wire_type))
+            return false;
+
+        if ((size_t)((const usr_pb_byte_t*)stream->state - buf) > target)
+        {
+            *stream = start;
+            break;
+        }
+    }
+
+    if (tag != *tag_path)
+        return false;
+
+    pos = (size_t)((const usr_pb_byte_t*)stream->state - buf);
+
+    if (wire_type == usr_PB_WT_STRING)
+    {
+        usr_pb_istream_t substream;
+        usr_pb_byte_t prefix[5];
+        size_t prefix_size;
+        size_t size;
+        size_t old_len = *len;
+
+        if (!usr_pb_make_string_substream(stream, &substream))
+            return false;
+
+        prefix_size = (size_t)((const usr_pb_byte_t*)substream.state - buf) - pos;
+        size = substream.bytes_left;
+
+        if (depth > 1)
+        {
+            if (!patch_field(&substream, buf, len, tag_path + 1, depth - 1, target, value, value_len, apply))
+                return false;
+        }
+        else
+        {
+            splice_bytes(buf, len, pos + prefix_size, size, value, value_len, apply);
+        }
+
+        size = size + *len - old_len;
+        if ((uint32_t)size != size)
+            return false;
+
+        splice_bytes(buf, len, pos, prefix_size, prefix, encode_length_prefix(prefix, (uint32_t)size), apply);
+        return true;
+    }
+    else if (depth > 1)
+    {
+        return false;
+    }
+    else if (wire_type == usr_PB_WT_VARINT)
+    {
+        size_t i;
+
+        /* The new value must be a single varint */
+        if (value_len == 0 || value_len > usr_PB_VARINT_MAX_LENGTH)
+            return false;
+
+        for (i = 0; i < value_len; i++)
+        {
+            if (((value[i] & 0x80) != 0) != (i + 1 < value_len))
+                return false;
+        }
+
+        if (!usr_pb_skip_varint(stream))
+            return false;
+
+        splice_bytes(buf, len, pos, (size_t)((const usr_pb_byte_t*)stream->state - buf) - pos, value, value_len, apply);
+        return true;
+    }
+    else if ((wire_type == usr_PB_WT_32BIT && value_len == 4) ||
+             (wire_type == usr_PB_WT_64BIT && value_len == 8))
+    {
+        if (stream->bytes_left < value_len)
+            return false;
+
+        splice_bytes(buf, len, pos, value_len, value, value_len, apply);
+        return true;
+    }
+    else
+    {
+        return false;
+    }
+}
+
+bool checkreturn usr_pb_patch_field(usr_pb_byte_t *buf, size_t *len, size_t bufsize,
+                                const uint32_t *tag_path, size_t depth,
+                                const usr_pb_byte_t *value, size_t value_len)
+{
+    usr_pb_istream_t stream = usr_pb_istream_from_buffer(buf, *len);
+    const usr_pb_byte_t *pos = NULL;
+    usr_pb_wire_type_t wire_type;
+    size_t new_len = *len;
+    size_t target;
+
+    if (depth == 0)
+        return false;
+
+    /* Patch the same occurrence that usr_pb_peek_field() returns */
+    if (!find_last_field(&stream, tag_path, depth, &pos, &wire_type) || pos == NULL)
+        return false;
+
+    target = (size_t)(pos - buf);
+
+    /* Check that the patch is valid and fits before changing anything */
+    stream = usr_pb_istream_from_buffer(buf, *len);
+    if (!patch_field(&stream, buf, &new_len, tag_path, depth, target, value, value_len, false))
+        return false;
+
+    if (new_len > bufsize)
+        return false;
+
+    stream = usr_pb_istream_from_buffer(buf, *len);
+    return patch_field(&stream, buf, len, tag_path, depth, target, value, value_len, true);
+}
+
+/*********************
+ * Resumable decoder *
+ *********************/
+
+/* States of usr_pb_decoder_t */
+#define usr_PB_DECODER_PREFIX  0 /* Reading the length of a delimited message */
+#define usr_PB_DECODER_TAG     1 /* Reading the tag of the next field */
+#define usr_PB_DECODER_VALUE   2 /* Reading a varint or fixed-size value */
+#define usr_PB_DECODER_LENGTH  3 /* Reading the length of a string, submessage or packed array */
+#define usr_PB_DECODER_STRING  4 /* Copying string or bytes data to the message */
+#define usr_PB_DECODER_PACKED  5 /* Reading the values of a packed array */
+#define usr_PB_DECODER_BUFFER  6 /* Collecting a whole field into the buffer */
+#define usr_PB_DECODER_SKIP    7 /* Skipping the data of an unknown field */
+#define usr_PB_DECODER_FAILED  8
+
+/* Targets of the current field */
+#define usr_PB_DECODER_FIELD     0
+#define usr_PB_DECODER_EXTENSION 1
+#define usr_PB_DECODER_UNKNOWN   2
+
+static bool decoder_failed(usr_pb_decoder_t *dec, const usr_pb_istream_t *stream)
+{
+    dec->state = usr_PB_DECODER_FAILED;
+
+#ifndef usr_PB_NO_ERRMSG
+    dec->errmsg = stream->errmsg;
+#else
+    usr_PB_UNUSED(stream);
+#endif
+
+#ifdef usr_PB_ENABLE_MALLOC
+    usr_pb_release(dec->stack[0].iter.descriptor, dec->stack[0].iter.message);
+#endif
+
+    return false;
+}
+
+/* Pass the error from a memory substream to the decoder */
+static bool substream_failed(usr_pb_istream_t *stream, const usr_pb_istream_t *substream)
+{
+#ifndef usr_PB_NO_ERRMSG
+    stream->errmsg = substream->errmsg;
+#else
+    usr_PB_UNUSED(stream);
+    usr_PB_UNUSED(substream);
+#endif
+    return false;
+}
+
+/* Collect a varint (size 0) or a fixed-size value that may be split between
+ * chunks, consuming at most limit bytes of input. When the value is complete,
+ * *value points to it, either in the input or in dec->partial. Otherwise
+ * *value is set to NULL. */
+static bool checkreturn collect_value(usr_pb_istream_t *stream, usr_pb_decoder_t *dec,
+    const usr_pb_byte_t **buf, size_t limit, size_t size,
+    const usr_pb_byte_t **value, size_t *length)
+{
+    const usr_pb_byte_t *start = *buf;
+    size_t n = 0;
+    bool complete = false;
+
+    if (size == 0)
+    {
+        while (n < limit && !complete)
+        {
+            if (dec->count + n >= usr_PB_VARINT_MAX_LENGTH)
+                usr_PB_RETURN_ERROR(stream, "varint overflow");
+
+            complete = (start[n++] & 0x80) == 0;
+        }
+    }
+    else
+    {
+        n = size - dec->count;
+        if (n > limit)
+            n = limit;
+        else
+            complete = true;
+    }
+
+    *buf += n;
+    dec->position += n;
+
+    if (complete && dec->count == 0)
+    {
+        /* The whole value is in the input */
+        *value = start;
+        *length = n;
+        return true;
+    }
+
+    memcpy(dec->partial + dec->count, start, n);
+    dec->count += n;
+
+    if (complete)
+    {
+        *value = dec->partial;
+        *length = dec->count;
+        dec->count = 0;
+    }
+    else
+    {
+        *value = NULL;
+    }
+
+    return true;
+}
+
+/* Decode a complete value of the current field from memory */
+static bool checkreturn decode_value(usr_pb_istream_t *stream, usr_pb_decoder_t *dec,
+    const usr_pb_byte_t *value, size_t length)
+{
+    usr_pb_decoder_frame_t *frame = &dec->stack[dec->depth - 1];
+    usr_pb_istream_t substream = usr_pb_istream_from_buffer(value, length);
+    bool status = true;
 
-                    if ((size_t)*size + 1 > allocated_size)
-                    {
-                        /* Allocate more storage. This tries to guess the
-                         * number of remaining entries. Round the division
-                         * upwards. */
-                        size_t remain = (substream.bytes_left - 1) / field->data_size + 1;
-                        if (remain < usr_PB_SIZE_MAX - allocated_size)
-                            allocated_size += remain;
-                        else
-                            allocated_size += 1;
-                        
-                        if (!allocate_field(&substream, field->pField, field->data_size, allocated_size))
-                        {
-                            status = false;
-                            break;
-                        }
-                    }
+    if (dec->target == usr_PB_DECODER_FIELD)
+        status = decode_field(&substream, dec->wire_type, &frame->iter);
+    else if (dec->target == usr_PB_DECODER_EXTENSION)
+        status = decode_extension(&substream, dec->tag, dec->wire_type, frame->extensions);
 
-                    /* Decode the array entry */
-                    field->pData = *(char**)field->pField + field->data_size * (*size);
-                    initialize_pointer_field(field->pData, field);
-                    if (!decode_basic_field(&substream, usr_PB_WT_PACKED, field))
-                    {
-                        status = false;
-                        break;
-                    }
-                    
-                    (*size)++;
-                }
-                if (!usr_pb_close_string_substream(stream, &substream))
-                    return false;
-                
-                return status;
-            }
-            else
-            {
-                /* Normal repeated field, i.e. only one item at a time. */
-                usr_pb_size_t *size = (usr_pb_size_t*)field->pSize;
+    if (!status)
+        return substream_failed(stream, &substream);
 
-                if (*size == usr_PB_SIZE_MAX)
-                    usr_PB_RETURN_ERROR(stream, "too many array entries");
-                
-                if (!allocate_field(stream, field->pField, field->data_size, (size_t)(*size + 1)))
-                    return false;
-            
-                field->pData = *(char**)field->pField + field->data_size * (*size);
-                (*size)++;
-                initialize_pointer_field(field->pData, field);
-                return decode_basic_field(stream, wire_type, field);
-            }
+    return true;
+}
 
-        default:
-            usr_PB_RETURN_ERROR(stream, "invalid field type");
-    }
-#endif
+static bool checkreturn decode_length(usr_pb_istream_t *stream, const usr_pb_byte_t *value, size_t length, uint32_t *size)
+{
+    usr_pb_istream_t substream = usr_pb_istream_from_buffer(value, length);
+
+    if (!usr_pb_decode_varint32(&substream, size))
+        return substream_failed(stream, &substream);
+
+    return true;
 }
 
-static bool checkreturn decode_callback_field(usr_pb_istream_t *stream, usr_pb_wire_type_t wire_type, usr_pb_field_iter_t *field)
+/* Start the field after its tag has been read */
+static bool checkreturn decoder_begin_field(usr_pb_istream_t *stream, usr_pb_decoder_t *dec,
+    const usr_pb_byte_t *value, size_t length)
 {
-    if (!field->descriptor->field_callback)
-        return usr_pb_skip_field(stream, wire_type);
+    usr_pb_decoder_frame_t *frame = &dec->stack[dec->depth - 1];
+    usr_pb_istream_t substream = usr_pb_istream_from_buffer(value, length);
+    bool eof;
 
-    if (wire_type == usr_PB_WT_STRING)
+    if (!usr_pb_decode_tag(&substream, &dec->wire_type, &dec->tag, &eof))
+        return substream_failed(stream, &substream);
+
+    if (dec->tag == 0)
     {
-        usr_pb_istream_t substream;
-        size_t prev_bytes_left;
-        
-        if (!usr_pb_make_string_substream(stream, &substream))
-            return false;
-        
-        do
+        if ((dec->flags & usr_PB_DECODE_NULLTERMINATED) && dec->depth == 1)
         {
-            prev_bytes_left = substream.bytes_left;
-            if (!field->descriptor->field_callback(&substream, NULL, field))
-                usr_PB_RETURN_ERROR(stream, "callback failed");
-        } while (substream.bytes_left > 0 && substream.bytes_left < prev_bytes_left);
-        
-        if (!usr_pb_close_string_substream(stream, &substream))
-            return false;
+            if (!end_message(stream, frame))
+                return false;
 
-        return true;
+            dec->depth = 0;
+            dec->done = true;
+            return true;
+        }
+
+        usr_PB_RETURN_ERROR(stream, "zero tag");
     }
-    else
+
+    if (!usr_pb_field_iter_find(&frame->iter, dec->tag) || usr_PB_LTYPE(frame->iter.type) == usr_PB_LTYPE_EXTENSION)
     {
-        /* Copy the single scalar value to stack.
-         * This is required so that we can limit the stream length,
-         * which in turn allows to use same callback for packed and
-         * not-packed fields. */
-        usr_pb_istream_t substream;
-        usr_pb_byte_t buffer[10];
-        size_t size = sizeof(buffer);
-        
-        if (!read_raw_value(stream, wire_type, buffer, &size))
-            return false;
-        substream = usr_pb_istream_from_buffer(buffer, size);
-        
-        return field->descriptor->field_callback(&substream, NULL, field);
+        if (is_extension_tag(frame, dec->tag))
+            dec->target = usr_PB_DECODER_EXTENSION;
+        else
+            dec->target = usr_PB_DECODER_UNKNOWN;
     }
-}
-
-static bool checkreturn decode_field(usr_pb_istream_t *stream, usr_pb_wire_type_t wire_type, usr_pb_field_iter_t *field)
-{
-#ifdef usr_PB_ENABLE_MALLOC
-    /* When decoding an oneof field, check if there is old data that must be
-     * released first. */
-    if (usr_PB_HTYPE(field->type) == usr_PB_HTYPE_ONEOF)
+    else
     {
-        if (!usr_pb_release_union_field(stream, field))
+        dec->target = usr_PB_DECODER_FIELD;
+        if (!begin_field(stream, frame, dec->wire_type))
             return false;
     }
-#endif
 
-    switch (usr_PB_ATYPE(field->type))
+    switch (dec->wire_type)
     {
-        case usr_PB_ATYPE_STATIC:
-            return decode_static_field(stream, wire_type, field);
-        
-        case usr_PB_ATYPE_POINTER:
-            return decode_pointer_field(stream, wire_type, field);
-        
-        case usr_PB_ATYPE_CALLBACK:
-            return decode_callback_field(stream, wire_type, field);
-        
+        case usr_PB_WT_VARINT:
+        case usr_PB_WT_64BIT:
+        case usr_PB_WT_32BIT:
+            dec->state = usr_PB_DECODER_VALUE;
+            return true;
+
+        case usr_PB_WT_STRING:
+            dec->state = usr_PB_DECODER_LENGTH;
+            return true;
+
         default:
-            usr_PB_RETURN_ERROR(stream, "invalid field type");
+            usr_PB_RETURN_ERROR(stream, "invalid wire_type");
     }
 }
 
-/* Default handler for extension fields. Expects to have a usr_pb_msgdesc_t
- * pointer in the extension->type->arg field, pointing to a message with
- * only one field in it.  */
-static bool checkreturn default_extension_decoder(usr_pb_istream_t *stream,
-    usr_pb_extension_t *extension, uint32_t tag, usr_pb_wire_type_t wire_type)
+/* Start decoding a static submessage field of the given size */
+static bool checkreturn decoder_push(usr_pb_istream_t *stream, usr_pb_decoder_t *dec, size_t size)
 {
-    usr_pb_field_iter_t iter;
+    usr_pb_field_iter_t *field = &dec->stack[dec->depth - 1].iter;
+    usr_pb_decoder_frame_t *child;
+    unsigned int flags = 0;
 
-    if (!usr_pb_field_iter_begin_extension(&iter, extension))
-        usr_PB_RETURN_ERROR(stream, "invalid extension");
+    if (field->submsg_desc == NULL)
+        usr_PB_RETURN_ERROR(stream, "invalid field descriptor");
 
-    if (iter.tag != tag || !iter.message)
-        return true;
+    if (dec->depth >= dec->stack_size)
+        usr_PB_RETURN_ERROR(stream, "decoder stack full");
 
-    extension->found = true;
-    return decode_field(stream, wire_type, &iter);
-}
+    /* Static required/optional fields are already initialized by
+     * usr_pb_decoder_start(), no need to initialize them again. */
+    if (usr_PB_HTYPE(field->type) != usr_PB_HTYPE_REPEATED)
+        flags = usr_PB_DECODE_NOINIT;
 
-/* Try to decode an unknown field as an extension field. Tries each extension
- * decoder in turn, until one of them handles the field or loop ends. */
-static bool checkreturn decode_extension(usr_pb_istream_t *stream,
-    uint32_t tag, usr_pb_wire_type_t wire_type, usr_pb_extension_t *extension)
-{
-    size_t pos = stream->bytes_left;
-    
-    while (extension != NULL && pos == stream->bytes_left)
-    {
-        bool status;
-        if (extension->type->decode)
-            status = extension->type->decode(stream, extension, tag, wire_type);
-        else
-            status = default_extension_decoder(stream, extension, tag, wire_type);
+    child = &dec->stack[dec->depth];
+    if (!begin_message(stream, child, field->submsg_desc, field->pData, flags, NULL))
+        return false;
 
-        if (!status)
-            return false;
-        
-        extension = extension->next;
-    }
-    
+    child->end = dec->position + size;
+    dec->depth++;
+    dec->state = usr_PB_DECODER_TAG;
     return true;
 }
 
-/* Initialize message fields to default values, recursively */
-static bool usr_pb_field_set_to_default(usr_pb_field_iter_t *field)
+/* Start copying a static string or bytes field of the given size */
+static bool checkreturn decoder_begin_string(usr_pb_istream_t *stream, usr_pb_decoder_t *dec, size_t size)
 {
-    usr_pb_type_t type;
-    type = field->type;
+    usr_pb_field_iter_t *field = &dec->stack[dec->depth - 1].iter;
 
-    if (usr_PB_LTYPE(type) == usr_PB_LTYPE_EXTENSION)
-    {
-        usr_pb_extension_t *ext = *(usr_pb_extension_t* const *)field->pData;
-        while (ext != NULL)
-        {
-            usr_pb_field_iter_t ext_iter;
-            if (usr_pb_field_iter_begin_extension(&ext_iter, ext))
-            {
-                ext->found = false;
-                if (!usr_pb_message_set_to_defaults(&ext_iter))
-                    return false;
-            }
-            ext = ext->next;
-        }
-    }
-    else if (usr_PB_ATYPE(type) == usr_PB_ATYPE_STATIC)
+    switch (usr_PB_LTYPE(field->type))
     {
-        bool init_data = true;
-        if (usr_PB_HTYPE(type) == usr_PB_HTYPE_OPTIONAL && field->pSize != NULL)
-        {
-            /* Set has_field to false. Still initialize the optional field
-             * itself also. */
-            *(bool*)field->pSize = false;
-        }
-        else if (usr_PB_HTYPE(type) == usr_PB_HTYPE_REPEATED ||
-                 usr_PB_HTYPE(type) == usr_PB_HTYPE_ONEOF)
+        case usr_PB_LTYPE_BYTES:
         {
-            /* REPEATED: Set array count to 0, no need to initialize contents.
-               ONEOF: Set which_field to 0. */
-            *(usr_pb_size_t*)field->pSize = 0;
-            init_data = false;
+            usr_pb_bytes_array_t *dest = (usr_pb_bytes_array_t*)field->pData;
+
+            if (size > usr_PB_SIZE_MAX || usr_PB_BYTES_ARRAY_T_ALLOCSIZE(size) > field->data_size)
+                usr_PB_RETURN_ERROR(stream, "bytes overflow");
+
+            dest->size = (usr_pb_size_t)size;
+            dec->dest = dest->bytes;
+            break;
         }
 
-        if (init_data)
-        {
-            if (usr_PB_LTYPE_IS_SUBMSG(field->type) &&
-                (field->submsg_desc->default_value != NULL ||
-                 field->submsg_desc->field_callback != NULL ||
-                 field->submsg_desc->submsg_info[0] != NULL))
+        case usr_PB_LTYPE_STRING:
+            if (size >= field->data_size)
+                usr_PB_RETURN_ERROR(stream, "string overflow");
+
+            dec->dest = (usr_pb_byte_t*)field->pData;
+            dec->dest[size] = 0;
+            break;
+
+        case usr_PB_LTYPE_FIXED_LENGTH_BYTES:
+            if (size == 0)
             {
-                /* Initialize submessage to defaults.
-                 * Only needed if it has default values
-                 * or callback/submessage fields. */
-                usr_pb_field_iter_t submsg_iter;
-                if (usr_pb_field_iter_begin(&submsg_iter, field->submsg_desc, field->pData))
-                {
-                    if (!usr_pb_message_set_to_defaults(&submsg_iter))
-                        return false;
-                }
+                /* As a special case, treat empty bytes string as all zeros for fixed_length_bytes. */
+                memset(field->pData, 0, (size_t)field->data_size);
             }
-            else
+            else if (size != field->data_size)
             {
-                /* Initialize to zeros */
-                memset(field->pData, 0, (size_t)field->data_size);
+                usr_PB_RETURN_ERROR(stream, "incorrect fixed length bytes size");
             }
-        }
+
+            dec->dest = (usr_pb_byte_t*)field->pData;
+            break;
+
+        default:
+            usr_PB_RETURN_ERROR(stream, "wrong wire type");
     }
-    else if (usr_PB_ATYPE(type) == usr_PB_ATYPE_POINTER)
+
+    dec->state = usr_PB_DECODER_STRING;
+    return true;
+}
+
+static bool checkreturn decoder_end_string(usr_pb_istream_t *stream, usr_pb_decoder_t *dec)
+{
+#ifdef usr_PB_VALIDATE_UTF8
+    usr_pb_field_iter_t *field = &dec->stack[dec->depth - 1].iter;
+
+    if (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_STRING &&
+        !usr_pb_validate_utf8_len((const char*)field->pData, (size_t)(dec->dest - (usr_pb_byte_t*)field->pData)))
     {
-        /* Initialize the pointer to NULL. */
-        *(void**)field->pField = NULL;
+        usr_PB_RETURN_ERROR(stream, "invalid utf8");
+    }
+#else
+    usr_PB_UNUSED(stream);
+#endif
 
-        /* Initialize array count to 0. */
-        if (usr_PB_HTYPE(type) == usr_PB_HTYPE_REPEATED ||
-            usr_PB_HTYPE(type) == usr_PB_HTYPE_ONEOF)
+    dec->state = usr_PB_DECODER_TAG;
+    return true;
+}
+
+/* Choose how to decode a length-delimited field of the given size. Static
+ * fields are decoded as the data arrives, other fields are collected into
+ * the buffer first. */
+static bool checkreturn decoder_begin_delimited(usr_pb_istream_t *stream, usr_pb_decoder_t *dec, size_t size)
+{
+    usr_pb_field_iter_t *field = &dec->stack[dec->depth - 1].iter;
+    usr_pb_type_t type = field->type;
+
+    dec->remaining = size;
+
+    if (dec->target == usr_PB_DECODER_UNKNOWN)
+    {
+        dec->state = usr_PB_DECODER_SKIP;
+    }
+    else if (dec->target == usr_PB_DECODER_EXTENSION || usr_PB_ATYPE(type) != usr_PB_ATYPE_STATIC)
+    {
+        dec->state = usr_PB_DECODER_BUFFER;
+        return true;
+    }
+    else if (usr_PB_LTYPE_IS_VIEW(type))
+    {
+        /* The data would not stay in memory after decoding */
+        usr_PB_RETURN_ERROR(stream, "view needs buffer stream");
+    }
+    else if (usr_PB_LTYPE(type) == usr_PB_LTYPE_SUBMSG_W_CB && field->pSize != NULL &&
+             ((usr_pb_callback_t*)field->pSize - 1)->funcs.decode != NULL)
+    {
+        /* Message callback needs a stream with the whole submessage */
+        dec->state = usr_PB_DECODER_BUFFER;
+        return true;
+    }
+    else if (usr_PB_HTYPE(type) == usr_PB_HTYPE_REPEATED &&
+             usr_PB_LTYPE(type) <= usr_PB_LTYPE_LAST_PACKABLE)
+    {
+        dec->state = usr_PB_DECODER_PACKED;
+    }
+    else
+    {
+#ifdef usr_PB_ENABLE_MALLOC
+        if (usr_PB_HTYPE(type) == usr_PB_HTYPE_ONEOF)
         {
-            *(usr_pb_size_t*)field->pSize = 0;
+            if (!usr_pb_release_union_field(stream, field))
+                return false;
         }
+#endif
+
+        if (!prepare_static_field(stream, field))
+            return false;
+
+        if (usr_PB_LTYPE_IS_SUBMSG(type))
+            return decoder_push(stream, dec, size);
+
+        if (!decoder_begin_string(stream, dec, size))
+            return false;
+
+        if (size == 0)
+            return decoder_end_string(stream, dec);
+
+        return true;
     }
-    else if (usr_PB_ATYPE(type) == usr_PB_ATYPE_CALLBACK)
+
+    if (size == 0)
+        dec->state = usr_PB_DECODER_TAG;
+
+    return true;
+}
+
+/* Finish the messages that end at the current position */
+static bool checkreturn decoder_pop(usr_pb_istream_t *stream, usr_pb_decoder_t *dec)
+{
+    while (dec->depth > 0 && dec->stack[dec->depth - 1].end == dec->position)
     {
-        /* Don't overwrite callback */
+        if (!end_message(stream, &dec->stack[dec->depth - 1]))
+            return false;
+
+        dec->depth--;
     }
 
+    if (dec->depth == 0)
+        dec->done = true;
+
     return true;
 }
 
-static bool usr_pb_message_set_to_defaults(usr_pb_field_iter_t *iter)
+/* Decode as much of the input as possible in the current state */
+static bool checkreturn decoder_step(usr_pb_istream_t *stream, usr_pb_decoder_t *dec,
+    const usr_pb_byte_t **buf, const usr_pb_byte_t *end)
 {
-    usr_pb_istream_t defstream = usr_PB_ISTREAM_EMPTY;
-    uint32_t tag = 0;
-    usr_pb_wire_type_t wire_type = usr_PB_WT_VARINT;
-    bool eof;
+    usr_pb_decoder_frame_t *frame = &dec->stack[dec->depth - 1];
+    size_t available = (size_t)(end - *buf);
+    size_t limit = frame->end - dec->position; /* Bytes left in the message */
+    const usr_pb_byte_t *value;
+    size_t length;
+    size_t n;
 
-    if (iter->descriptor->default_value)
-    {
-        defstream = usr_pb_istream_from_buffer(iter->descriptor->default_value, (size_t)-1);
-        if (!usr_pb_decode_tag(&defstream, &wire_type, &tag, &eof))
-            return false;
-    }
+    if (limit > available)
+        limit = available;
 
-    do
+    switch (dec->state)
     {
-        if (!usr_pb_field_set_to_default(iter))
-            return false;
-
-        if (tag != 0 && iter->tag == tag)
+        case usr_PB_DECODER_PREFIX:
         {
-            /* We have a default value for this field in the defstream */
-            if (!decode_field(&defstream, wire_type, iter))
-                return false;
-            if (!usr_pb_decode_tag(&defstream, &wire_type, &tag, &eof))
+            uint32_t size;
+
+            if (!collect_value(stream, dec, buf, available, 0, &value, &length))
                 return false;
 
-            if (iter->pSize)
-                *(bool*)iter->pSize = false;
-        }
-    } while (usr_pb_field_iter_next(iter));
+            if (value == NULL)
+                return true;
 
-    return true;
-}
+            if (!decode_length(stream, value, length, &size))
+                return false;
 
-/*********************
- * Decode all fields *
- *********************/
+            if ((size_t)size > (size_t)-1 - dec->position)
+                usr_PB_RETURN_ERROR(stream, "message too large");
 
-static bool checkreturn usr_pb_decode_inner(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, void *dest_struct, unsigned int flags)
-{
-    uint32_t extension_range_start = 0;
-    usr_pb_extension_t *extensions = NULL;
+            frame->end = dec->position + size;
+            dec->state = usr_PB_DECODER_TAG;
+            return true;
+        }
 
-    /* 'fixed_count_field' and 'fixed_count_size' track position of a repeated fixed
-     * count field. This can only handle _one_ repeated fixed count field that
-     * is unpacked and unordered among other (non repeated fixed count) fields.
-     */
-    usr_pb_size_t fixed_count_field = usr_PB_SIZE_MAX;
-    usr_pb_size_t fixed_count_size = 0;
-    usr_pb_size_t fixed_count_total_size = 0;
+        case usr_PB_DECODER_TAG:
+        case usr_PB_DECODER_VALUE:
+            if (dec->state == usr_PB_DECODER_TAG || dec->wire_type == usr_PB_WT_VARINT)
+                n = 0;
+            else if (dec->wire_type == usr_PB_WT_32BIT)
+                n = 4;
+            else
+                n = 8;
 
-    usr_pb_fields_seen_t fields_seen = {{0, 0}};
-    const uint32_t allbits = ~(uint32_t)0;
-    usr_pb_field_iter_t iter;
+            if (!collect_value(stream, dec, buf, limit, n, &value, &length))
+                return false;
 
-    if (usr_pb_field_iter_begin(&iter, fields, dest_struct))
-    {
-        if ((flags & usr_PB_DECODE_NOINIT) == 0)
-        {
-            if (!usr_pb_message_set_to_defaults(&iter))
-                usr_PB_RETURN_ERROR(stream, "failed to set defaults");
-        }
-    }
+            if (value == NULL)
+            {
+                if (dec->position == frame->end)
+                    usr_PB_RETURN_ERROR(stream, "end-of-stream");
+                return true;
+            }
 
-    while (stream->bytes_left)
-    {
-        uint32_t tag;
-        usr_pb_wire_type_t wire_type;
-        bool eof;
+            if (dec->state == usr_PB_DECODER_TAG)
+                return decoder_begin_field(stream, dec, value, length);
 
-        if (!usr_pb_decode_tag(stream, &wire_type, &tag, &eof))
-        {
-            if (eof)
-                break;
-            else
+            if (!decode_value(stream, dec, value, length))
                 return false;
-        }
 
-        if (tag == 0)
-        {
-          if (flags & usr_PB_DECODE_NULLTERMINATED)
-          {
-            break;
-          }
-          else
-          {
-            usr_PB_RETURN_ERROR(stream, "zero tag");
-          }
-        }
+            dec->state = usr_PB_DECODER_TAG;
+            return true;
 
-        if (!usr_pb_field_iter_find(&iter, tag) || usr_PB_LTYPE(iter.type) == usr_PB_LTYPE_EXTENSION)
+        case usr_PB_DECODER_LENGTH:
         {
-            /* No match found, check if it matches an extension. */
-            if (extension_range_start == 0)
-            {
-                if (usr_pb_field_iter_find_extension(&iter))
-                {
-                    extensions = *(usr_pb_extension_t* const *)iter.pData;
-                    extension_range_start = iter.tag;
-                }
+            const usr_pb_byte_t *start = *buf;
+            bool in_input = (dec->count == 0);
+            uint32_t size;
 
-                if (!extensions)
-                {
-                    extension_range_start = (uint32_t)-1;
-                }
-            }
+            if (!collect_value(stream, dec, buf, limit, 0, &value, &length))
+                return false;
 
-            if (tag >= extension_range_start)
+            if (value == NULL)
             {
-                size_t pos = stream->bytes_left;
+                if (dec->position == frame->end)
+                    usr_PB_RETURN_ERROR(stream, "end-of-stream");
+                return true;
+            }
 
-                if (!decode_extension(stream, tag, wire_type, extensions))
-                    return false;
+            if (!decode_length(stream, value, length, &size))
+                return false;
 
-                if (pos != stream->bytes_left)
-                {
-                    /* The field was handled */
-                    continue;
-                }
-            }
+            if ((size_t)size > frame->end - dec->position)
+                usr_PB_RETURN_ERROR(stream, "parent stream too short");
 
-            /* No match found, skip data */
-            if (!usr_pb_skip_field(stream, wire_type))
+            if (!decoder_begin_delimited(stream, dec, (size_t)size))
                 return false;
-            continue;
-        }
 
-        /* If a repeated fixed count field was found, get size from
-         * 'fixed_count_field' as there is no counter contained in the struct.
-         */
-        if (usr_PB_HTYPE(iter.type) == usr_PB_HTYPE_REPEATED && iter.pSize == &iter.array_size)
-        {
-            if (fixed_count_field != iter.index) {
-                /* If the new fixed count field does not match the previous one,
-                 * check that the previous one is NULL or that it finished
-                 * receiving all the expected data.
-                 */
-                if (fixed_count_field != usr_PB_SIZE_MAX &&
-                    fixed_count_size != fixed_count_total_size)
-                {
-                    usr_PB_RETURN_ERROR(stream, "wrong size for fixed count field");
-                }
+            if (dec->state != usr_PB_DECODER_BUFFER)
+                return true;
 
-                fixed_count_field = iter.index;
-                fixed_count_size = 0;
-                fixed_count_total_size = iter.array_size;
+            if (in_input && (size_t)size <= (size_t)(end - *buf))
+            {
+                /* The whole field is in the input, decode it from there */
+                *buf += size;
+                dec->position += size;
+                dec->state = usr_PB_DECODER_TAG;
+                return decode_value(stream, dec, start, length + size);
             }
 
-            iter.pSize = &fixed_count_size;
+            if (length + size > dec->buffer_size)
+                usr_PB_RETURN_ERROR(stream, "field too large for buffer");
+
+            memmove(dec->buffer, value, length);
+            dec->count = length;
+            if (size == 0)
+            {
+                dec->count = 0;
+                dec->state = usr_PB_DECODER_TAG;
+                return decode_value(stream, dec, dec->buffer, length);
+            }
+            return true;
         }
 
-        if (usr_PB_HTYPE(iter.type) == usr_PB_HTYPE_REQUIRED
-            && iter.required_field_index < usr_PB_MAX_REQUIRED_FIELDS)
+        case usr_PB_DECODER_PACKED:
         {
-            uint32_t tmp = ((uint32_t)1 << (iter.required_field_index & 31));
-            fields_seen.bitfield[iter.required_field_index >> 5] |= tmp;
-        }
+            usr_pb_field_iter_t *field = &frame->iter;
+            usr_pb_size_t *size = (usr_pb_size_t*)field->pSize;
+            size_t start = dec->position;
+            usr_pb_istream_t substream;
+
+            if (*size >= field->array_size)
+                usr_PB_RETURN_ERROR(stream, "array overflow");
+
+            if (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_FIXED32)
+                n = 4;
+            else if (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_FIXED64)
+                n = 8;
+            else
+                n = 0;
 
-        if (!decode_field(stream, wire_type, &iter))
-            return false;
-    }
+            if (limit > dec->remaining)
+                limit = dec->remaining;
 
-    /* Check that all elements of the last decoded fixed count field were present. */
-    if (fixed_count_field != usr_PB_SIZE_MAX &&
-        fixed_count_size != fixed_count_total_size)
-    {
-        usr_PB_RETURN_ERROR(stream, "wrong size for fixed count field");
-    }
+            if (!collect_value(stream, dec, buf, limit, n, &value, &length))
+                return false;
 
-    /* Check that all required fields were present. */
-    {
-        usr_pb_size_t req_field_count = iter.descriptor->required_field_count;
+            dec->remaining -= dec->position - start;
 
-        if (req_field_count > 0)
-        {
-            usr_pb_size_t i;
+            if (value == NULL)
+            {
+                if (dec->remaining == 0)
+                    usr_PB_RETURN_ERROR(stream, "end-of-stream");
+                return true;
+            }
 
-            if (req_field_count > usr_PB_MAX_REQUIRED_FIELDS)
-                req_field_count = usr_PB_MAX_REQUIRED_FIELDS;
+            field->pData = (char*)field->pField + field->data_size * (*size);
+            substream = usr_pb_istream_from_buffer(value, length);
+            if (!decode_basic_field(&substream, usr_PB_WT_PACKED, field))
+                return substream_failed(stream, &substream);
 
-            /* Check the whole words */
-            for (i = 0; i < (req_field_count >> 5); i++)
+            (*size)++;
+
+            if (dec->remaining == 0)
+                dec->state = usr_PB_DECODER_TAG;
+            return true;
+        }
+
+        default:
+            n = dec->remaining;
+            if (n > available)
+                n = available;
+
+            if (dec->state == usr_PB_DECODER_STRING)
             {
-                if (fields_seen.bitfield[i] != allbits)
-                    usr_PB_RETURN_ERROR(stream, "missing required field");
+                memcpy(dec->dest, *buf, n);
+                dec->dest += n;
+            }
+            else if (dec->state == usr_PB_DECODER_BUFFER)
+            {
+                memcpy(dec->buffer + dec->count, *buf, n);
+                dec->count += n;
             }
 
-            /* Check the remaining bits (if any) */
-            if ((req_field_count & 31) != 0)
+            *buf += n;
+            dec->position += n;
+            dec->remaining -= n;
+
+            if (dec->remaining > 0)
+                return true;
+
+            if (dec->state == usr_PB_DECODER_STRING)
+                return decoder_end_string(stream, dec);
+
+            if (dec->state == usr_PB_DECODER_BUFFER)
             {
-                if (fields_seen.bitfield[req_field_count >> 5] !=
-                    (allbits >> (uint_least8_t)(32 - (req_field_count & 31))))
-                {
-                    usr_PB_RETURN_ERROR(stream, "missing required field");
-                }
+                length = dec->count;
+                dec->count = 0;
+                dec->state = usr_PB_DECODER_TAG;
+                return decode_value(stream, dec, dec->buffer, length);
             }
-        }
+
+            dec->state = usr_PB_DECODER_TAG;
+            return true;
     }
+}
 
-    return true;
+void usr_pb_decoder_init(usr_pb_decoder_t *dec, usr_pb_decoder_frame_t *stack, size_t stack_size,
+                     usr_pb_byte_t *buf, size_t bufsize)
+{
+    dec->stack = stack;
+    dec->stack_size = stack_size;
+    dec->depth = 0;
+    dec->buffer = buf;
+    dec->buffer_size = bufsize;
+    dec->state = usr_PB_DECODER_FAILED;
+    dec->done = false;
+    dec->consumed = 0;
+#ifndef usr_PB_NO_ERRMSG
+    dec->errmsg = NULL;
+#endif
 }
 
-bool checkreturn usr_pb_decode_ex(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, void *dest_struct, unsigned int flags)
+bool checkreturn usr_pb_decoder_start(usr_pb_decoder_t *dec, const usr_pb_msgdesc_t *fields, void *dest_struct, unsigned int flags)
 {
-    bool status;
+    usr_pb_istream_t stream = usr_PB_ISTREAM_EMPTY;
+
+    dec->depth = 0;
+    dec->position = 0;
+    dec->remaining = 0;
+    dec->count = 0;
+    dec->dest = NULL;
+    dec->flags = flags;
+    dec->done = false;
+    dec->consumed = 0;
+#ifndef usr_PB_NO_ERRMSG
+    dec->errmsg = NULL;
+#endif
 
-    if ((flags & usr_PB_DECODE_DELIMITED) == 0)
+    if (dec->stack_size == 0)
     {
-      status = usr_pb_decode_inner(stream, fields, dest_struct, flags);
+        dec->state = usr_PB_DECODER_FAILED;
+        usr_PB_RETURN_ERROR(dec, "decoder stack full");
     }
-    else
+
+    if (!begin_message(&stream, &dec->stack[0], fields, dest_struct, flags, NULL))
+        return decoder_failed(dec, &stream);
+
+    dec->depth = 1;
+    dec->state = (flags & usr_PB_DECODE_DELIMITED) ? usr_PB_DECODER_PREFIX : usr_PB_DECODER_TAG;
+    return true;
+}
+
+bool checkreturn usr_pb_decoder_feed(usr_pb_decoder_t *dec, const usr_pb_byte_t *buf, size_t count)
+{
+    usr_pb_istream_t stream = usr_PB_ISTREAM_EMPTY;
+    const usr_pb_byte_t *pos = buf;
+    const usr_pb_byte_t *end = buf + count;
+    bool status = true;
+
+    dec->consumed = 0;
+
+    if (dec->state == usr_PB_DECODER_FAILED)
+        usr_PB_RETURN_ERROR(dec, "decoder not started");
+
+    while (status && !dec->done)
     {
-      usr_pb_istream_t substream;
-      if (!usr_pb_make_string_substream(stream, &substream))
-        return false;
+        if (dec->state == usr_PB_DECODER_TAG && dec->count == 0)
+        {
+            status = decoder_pop(&stream, dec);
+            if (!status || dec->done)
+                break;
+        }
 
-      status = usr_pb_decode_inner(&substream, fields, dest_struct, flags);
+        if (pos == end)
+            break;
 
-      if (!usr_pb_close_string_substream(stream, &substream))
-        return false;
+        status = decoder_step(&stream, dec, &pos, end);
     }
-    
-#ifdef usr_PB_ENABLE_MALLOC
+
+    dec->consumed = (size_t)(pos - buf);
+
     if (!status)
-        usr_pb_release(fields, dest_struct);
-#endif
-    
-    return status;
+        return decoder_failed(dec, &stream);
+
+    return true;
 }
 
-bool checkreturn usr_pb_decode(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, void *dest_struct)
+bool checkreturn usr_pb_decoder_finish(usr_pb_decoder_t *dec)
 {
-    bool status;
+    usr_pb_istream_t stream = usr_PB_ISTREAM_EMPTY;
 
-    status = usr_pb_decode_inner(stream, fields, dest_struct, 0);
+    if (dec->done)
+        return true;
 
-#ifdef usr_PB_ENABLE_MALLOC
-    if (!status)
-        usr_pb_release(fields, dest_struct);
+    if (dec->state == usr_PB_DECODER_FAILED)
+        usr_PB_RETURN_ERROR(dec, "decoder not started");
+
+    if (dec->state == usr_PB_DECODER_TAG && dec->count == 0 && dec->depth == 1 &&
+        (dec->flags & usr_PB_DECODE_DELIMITED) == 0)
+    {
+        if (end_message(&stream, &dec->stack[0]))
+        {
+            dec->depth = 0;
+            dec->done = true;
+            return true;
+        }
+    }
+    else
+    {
+#ifndef usr_PB_NO_ERRMSG
+        stream.errmsg = "end-of-stream";
 #endif
+    }
 
-    return status;
+    return decoder_failed(dec, &stream);
 }
 
 #ifdef usr_PB_ENABLE_MALLOC
+bool checkreturn usr_pb_decode_arena(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, void *dest_struct, unsigned int flags, usr_pb_arena_t *arena)
+{
+    bool status;
+
+    stream->arena = arena;
+    status = usr_pb_decode_flags(stream, fields, dest_struct, flags, NULL);
+    stream->arena = NULL;
+
+    return status;
+}
+
+void usr_pb_arena_init(usr_pb_arena_t *arena, void *buffer, size_t size)
+{
+    arena->buffer = (usr_pb_byte_t*)buffer;
+    arena->size = size;
+    usr_pb_arena_reset(arena);
+}
+
+void usr_pb_arena_reset(usr_pb_arena_t *arena)
+{
+    arena->used = 0;
+    arena->last = 0;
+}
+
 /* Given an oneof field, if there has already been a field inside this oneof,
  * release it before overwriting with a different one. */
 static bool usr_pb_release_union_field(usr_pb_istream_t *stream, usr_pb_field_iter_t *field)
@@ -1201,7 +3553,8 @@ static bool usr_pb_release_union_field(usr_pb_istream_t *stream, usr_pb_field_it
     if (!usr_pb_field_iter_find(&old_field, old_tag))
         usr_PB_RETURN_ERROR(stream, "invalid union tag");
 
-    usr_pb_release_single_field(&old_field);
+    if (stream->arena == NULL)
+        usr_pb_release_single_field(&old_field);
 
     if (usr_PB_ATYPE(field->type) == usr_PB_ATYPE_POINTER)
     {
@@ -1358,7 +3711,7 @@ bool usr_pb_decode_fixed32(usr_pb_istream_t *stream, void *dest)
     if (!usr_pb_read(stream, u.bytes, 4))
         return false;
 
-#if defined(__BYTE_ORDER) && __BYTE_ORDER == __LITTLE_ENDIAN && CHAR_BIT == 8
+#ifdef usr_PB_LITTLE_ENDIAN_8BIT
     /* fast path - if we know that we're on little endian, assign directly */
     *(uint32_t*)dest = u.fixed32;
 #else
@@ -1381,7 +3734,7 @@ bool usr_pb_decode_fixed64(usr_pb_istream_t *stream, void *dest)
     if (!usr_pb_read(stream, u.bytes, 8))
         return false;
 
-#if defined(__BYTE_ORDER) && __BYTE_ORDER == __LITTLE_ENDIAN && CHAR_BIT == 8
+#ifdef usr_PB_LITTLE_ENDIAN_8BIT
     /* fast path - if we know that we're on little endian, assign directly */
     *(uint64_t*)dest = u.fixed64;
 #else
@@ -1404,22 +3757,32 @@ static bool checkreturn usr_pb_dec_bool(usr_pb_istream_t *stream, const usr_pb_f
 }
 
 static bool checkreturn usr_pb_dec_varint(usr_pb_istream_t *stream, const usr_pb_field_iter_t *field)
+{
+    usr_pb_uint64_t value;
+
+    if (!usr_pb_decode_varint(stream, &value))
+        return false;
+
+    return store_varint(stream, field, field->pData, value);
+}
+
+/* Store a decoded varint value into dest, converting it to the type and
+ * size of the field. */
+static bool checkreturn store_varint(usr_pb_istream_t *stream, const usr_pb_field_iter_t *field, void *dest, usr_pb_uint64_t value)
 {
     if (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_UVARINT)
     {
-        usr_pb_uint64_t value, clamped;
-        if (!usr_pb_decode_varint(stream, &value))
-            return false;
+        usr_pb_uint64_t clamped;
 
         /* Cast to the proper field size, while checking for overflows */
         if (field->data_size == sizeof(usr_pb_uint64_t))
-            clamped = *(usr_pb_uint64_t*)field->pData = value;
+            clamped = *(usr_pb_uint64_t*)dest = value;
         else if (field->data_size == sizeof(uint32_t))
-            clamped = *(uint32_t*)field->pData = (uint32_t)value;
+            clamped = *(uint32_t*)dest = (uint32_t)value;
         else if (field->data_size == sizeof(uint_least16_t))
-            clamped = *(uint_least16_t*)field->pData = (uint_least16_t)value;
+            clamped = *(uint_least16_t*)dest = (uint_least16_t)value;
         else if (field->data_size == sizeof(uint_least8_t))
-            clamped = *(uint_least8_t*)field->pData = (uint_least8_t)value;
+            clamped = *(uint_least8_t*)dest = (uint_least8_t)value;
         else
             usr_PB_RETURN_ERROR(stream, "invalid data_size");
 
@@ -1430,20 +3793,19 @@ static bool checkreturn usr_pb_dec_varint(usr_pb_istream_t *stream, const usr_pb
     }
     else
     {
-        usr_pb_uint64_t value;
         usr_pb_int64_t svalue;
         usr_pb_int64_t clamped;
 
         if (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_SVARINT)
         {
-            if (!usr_pb_decode_svarint(stream, &svalue))
-                return false;
+            /* ZigZag decoding, same as in usr_pb_decode_svarint() */
+            if (value & 1)
+                svalue = (usr_pb_int64_t)(~(value >> 1));
+            else
+                svalue = (usr_pb_int64_t)(value >> 1);
         }
         else
         {
-            if (!usr_pb_decode_varint(stream, &value))
-                return false;
-
             /* See issue 97: Google's C++ protobuf allows negative varint values to
             * be cast as int32_t, instead of the int64_t that should be used when
             * encoding. Nanopb versions before 0.2.5 had a bug in encoding. In order to
@@ -1458,13 +3820,13 @@ static bool checkreturn usr_pb_dec_varint(usr_pb_istream_t *stream, const usr_pb
 
         /* Cast to the proper field size, while checking for overflows */
         if (field->data_size == sizeof(usr_pb_int64_t))
-            clamped = *(usr_pb_int64_t*)field->pData = svalue;
+            clamped = *(usr_pb_int64_t*)dest = svalue;
         else if (field->data_size == sizeof(int32_t))
-            clamped = *(int32_t*)field->pData = (int32_t)svalue;
+            clamped = *(int32_t*)dest = (int32_t)svalue;
         else if (field->data_size == sizeof(int_least16_t))
-            clamped = *(int_least16_t*)field->pData = (int_least16_t)svalue;
+            clamped = *(int_least16_t*)dest = (int_least16_t)svalue;
         else if (field->data_size == sizeof(int_least8_t))
-            clamped = *(int_least8_t*)field->pData = (int_least8_t)svalue;
+            clamped = *(int_least8_t*)dest = (int_least8_t)svalue;
         else
             usr_PB_RETURN_ERROR(stream, "invalid data_size");
 
@@ -1558,13 +3920,42 @@ static bool checkreturn usr_pb_dec_string(usr_pb_istream_t *stream, const usr_pb
         return false;
 
 #ifdef usr_PB_VALIDATE_UTF8
-    if (!usr_pb_validate_utf8((const char*)dest))
+    if (!usr_pb_validate_utf8_len((const char*)dest, (size_t)size))
         usr_PB_RETURN_ERROR(stream, "invalid utf8");
 #endif
 
     return true;
 }
 
+static bool checkreturn usr_pb_dec_view(usr_pb_istream_t *stream, const usr_pb_field_iter_t *field)
+{
+    uint32_t size;
+    usr_pb_view_t *dest = (usr_pb_view_t*)field->pData;
+
+    if (!usr_pb_decode_varint32(stream, &size))
+        return false;
+
+    if (size > usr_PB_SIZE_MAX)
+        usr_PB_RETURN_ERROR(stream, "bytes overflow");
+
+    /* The data is not copied, so it has to stay in memory after decoding */
+    if (!usr_PB_ISTREAM_IS_BUFFER(stream))
+        usr_PB_RETURN_ERROR(stream, "view needs buffer stream");
+
+    if (stream->bytes_left < size)
+        usr_PB_RETURN_ERROR(stream, "end-of-stream");
+
+#ifdef usr_PB_VALIDATE_UTF8
+    if (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_STRING_VIEW &&
+        !usr_pb_validate_utf8_len((const char*)stream->state, (size_t)size))
+        usr_PB_RETURN_ERROR(stream, "invalid utf8");
+#endif
+
+    dest->ptr = (const usr_pb_byte_t*)stream->state;
+    dest->size = (usr_pb_size_t)size;
+    return usr_pb_read(stream, NULL, (size_t)size);
+}
+
 static bool checkreturn usr_pb_dec_submessage(usr_pb_istream_t *stream, const usr_pb_field_iter_t *field)
 {
     bool status = true;
@@ -1608,7 +3999,7 @@ static bool checkreturn usr_pb_dec_submessage(usr_pb_istream_t *stream, const us
             flags = usr_PB_DECODE_NOINIT;
         }
 
-        status = usr_pb_decode_inner(&substream, field->submsg_desc, field->pData, flags);
+        status = usr_pb_decode_inner(&substream, field->submsg_desc, field->pData, flags, NULL);
     }
     
     if (!usr_pb_close_string_substream(stream, &substream))
@@ -1641,17 +4032,14 @@ static bool checkreturn usr_pb_dec_fixed_length_bytes(usr_pb_istream_t *stream,
 }
 
 #ifdef usr_PB_CONVERT_DOUBLE_FLOAT
-bool usr_pb_decode_double_as_float(usr_pb_istream_t *stream, float *dest)
+/* Convert the bits of a double value to the nearest float value */
+static float convert_double_to_float(uint64_t value)
 {
     uint_least8_t sign;
     int exponent;
     uint32_t mantissa;
-    uint64_t value;
     union { float f; uint32_t i; } out;
 
-    if (!usr_pb_decode_fixed64(stream, &value))
-        return false;
-
     /* Decompose input value */
     sign = (uint_least8_t)((value >> 63) & 1);
     exponent = (int)((value >> 52) & 0x7FF) - 1023;
@@ -1703,7 +4091,17 @@ bool usr_pb_decode_double_as_float(usr_pb_istream_t *stream, float *dest)
     out.i |= (uint32_t)(exponent + 127) << 23;
     out.i |= (uint32_t)sign << 31;
 
-    *dest = out.f;
+    return out.f;
+}
+
+bool usr_pb_decode_double_as_float(usr_pb_istream_t *stream, float *dest)
+{
+    uint64_t value;
+
+    if (!usr_pb_decode_fixed64(stream, &value))
+        return false;
+
+    *dest = convert_double_to_float(value);
     return true;
 }
 #endif
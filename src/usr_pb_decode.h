@@ -12,6 +12,21 @@
 extern "C" {
 #endif
 
+#ifdef usr_PB_ENABLE_MALLOC
+/* Memory region for allocating the pointer fields of decoded messages,
+ * see usr_pb_decode_arena(). The buffer must be aligned suitably for any
+ * field type, for example by allocating it with malloc().
+ */
+typedef struct usr_pb_arena_s usr_pb_arena_t;
+struct usr_pb_arena_s
+{
+    usr_pb_byte_t *buffer;
+    size_t size;
+    size_t used;  /* Number of bytes in use from start of buffer */
+    size_t last;  /* Offset of most recent allocation, or 0 if none */
+};
+#endif
+
 /* Structure for defining custom input streams. You will need to provide
  * a callback function to read the bytes from your storage, which can be
  * for example a file or a network socket.
@@ -24,6 +39,10 @@ extern "C" {
  * 3) Your callback may be used with substreams, in which case bytes_left
  *    is different than from the main stream. Don't use bytes_left to compute
  *    any pointers.
+ * 4) Optionally, you can provide a skip callback that advances the input
+ *    by count bytes without reading them, e.g. using fseek() or lseek().
+ *    If it is NULL, skipped data is read into a temporary buffer and
+ *    discarded. usr_pb_read checks bytes_left before calling it.
  */
 struct usr_pb_istream_s
 {
@@ -40,17 +59,139 @@ struct usr_pb_istream_s
     void *state; /* Free field for use by callback implementation */
     size_t bytes_left;
     
+#ifndef usr_PB_NO_ERRMSG
+    const char *errmsg;
+#endif
+
+#ifdef usr_PB_ENABLE_MALLOC
+    /* Arena for pointer fields, set by usr_pb_decode_arena().
+     * Other decoding functions set this to NULL and use usr_pb_realloc(). */
+    usr_pb_arena_t *arena;
+#endif
+
+#ifndef usr_PB_BUFFER_ONLY
+    /* Callback for skipping unknown fields and unused data, or NULL. */
+    bool (*skip)(usr_pb_istream_t *stream, size_t count);
+#endif
+};
+
+#ifndef usr_PB_BUFFER_ONLY
+/* State of a buffered input stream, see usr_pb_istream_from_buffered().
+ * Data is read from the underlying source in large blocks, and the decoder
+ * consumes it directly from the buffer.
+ *
+ * The read function has the same semantics as read() or recv(): it reads
+ * at most count bytes and returns the number of bytes actually read. It
+ * should return 0 only on end of file or error, which ends the stream.
+ */
+typedef struct usr_pb_istream_buffer_s usr_pb_istream_buffer_t;
+struct usr_pb_istream_buffer_s
+{
+    size_t (*read)(void *state, usr_pb_byte_t *buf, size_t count);
+    void *state;           /* Free field for use by read implementation */
+    usr_pb_byte_t *buffer;
+    size_t size;           /* Size of the buffer */
+    size_t pos;            /* Position of next unread byte in buffer */
+    size_t end;            /* Number of valid bytes in buffer */
+};
+#endif
+
+/* Bitmask of the required fields that have been seen in a message */
+typedef struct {
+    uint32_t bitfield[(usr_PB_MAX_REQUIRED_FIELDS + 31) / 32];
+} usr_pb_fields_seen_t;
+
+#ifdef usr_PB_ENABLE_MALLOC
+/* Allocated capacity of the pointer array that was last appended to.
+ * The allocation grows geometrically while decoding and is trimmed to
+ * the final number of entries at the end of the message. */
+typedef struct {
+    usr_pb_size_t field_index; /* Index of the array field, or usr_PB_SIZE_MAX */
+    usr_pb_size_t capacity;    /* Number of entries allocated */
+    bool needs_trim;           /* Some array may be larger than its count */
+} usr_pb_array_alloc_t;
+#endif
+
+/* Decoding state of one message. usr_pb_decode() keeps these on the call
+ * stack, usr_pb_decode_stack() and usr_pb_decoder_t keep them in a
+ * caller-provided array. */
+typedef struct usr_pb_decoder_frame_s usr_pb_decoder_frame_t;
+struct usr_pb_decoder_frame_s
+{
+    usr_pb_field_iter_t iter;     /* Fields of the message, at the current field */
+    size_t end;               /* Input position where the message ends, or in
+                               * usr_pb_decode_stack() the bytes left in the
+                               * parent message after it */
+    uint32_t extension_range_start;
+    usr_pb_extension_t *extensions;
+
+    /* Position of a repeated fixed count field. This can only handle _one_
+     * repeated fixed count field that is unpacked and unordered among other
+     * (non repeated fixed count) fields. */
+    usr_pb_size_t fixed_count_field;
+    usr_pb_size_t fixed_count_size;
+    usr_pb_size_t fixed_count_total_size;
+
+    usr_pb_fields_seen_t fields_seen;
+    const uint32_t *mask;     /* Selected fields, or NULL for all */
+#ifdef usr_PB_ENABLE_MALLOC
+    usr_pb_array_alloc_t array_alloc;
+#endif
+};
+
+/* State of a resumable decoder, see usr_pb_decoder_feed(). The stack
+ * has one frame for each level of nested submessages, and the buffer holds
+ * fields that can only be decoded once they have been received completely.
+ */
+typedef struct usr_pb_decoder_s usr_pb_decoder_t;
+struct usr_pb_decoder_s
+{
+    usr_pb_decoder_frame_t *stack;
+    size_t stack_size;        /* Number of frames in stack */
+    size_t depth;             /* Number of frames in use */
+    usr_pb_byte_t *buffer;
+    size_t buffer_size;       /* Size of the buffer */
+
+    size_t position;          /* Number of bytes decoded since start of message */
+    size_t remaining;         /* Bytes left in the current string, packed array or skipped field */
+    size_t count;             /* Number of bytes collected in partial or buffer */
+    usr_pb_byte_t *dest;          /* Destination of string and bytes data */
+    usr_pb_byte_t partial[10];    /* Value that was split between chunks */
+    usr_pb_wire_type_t wire_type;
+    uint32_t tag;
+    uint_least8_t state;
+    uint_least8_t target;     /* Whether the field is known, an extension or skipped */
+    unsigned int flags;
+
+    bool done;                /* The whole message has been decoded */
+    size_t consumed;          /* Number of bytes used from the last chunk */
+
 #ifndef usr_PB_NO_ERRMSG
     const char *errmsg;
 #endif
 };
 
+/* Initializers for the optional members at the end of usr_pb_istream_t */
 #ifndef usr_PB_NO_ERRMSG
-#define usr_PB_ISTREAM_EMPTY {0,0,0,0}
+#define usr_PB_ISTREAM_EMPTY_ERRMSG ,0
+#else
+#define usr_PB_ISTREAM_EMPTY_ERRMSG
+#endif
+
+#ifdef usr_PB_ENABLE_MALLOC
+#define usr_PB_ISTREAM_EMPTY_ARENA ,0
 #else
-#define usr_PB_ISTREAM_EMPTY {0,0,0}
+#define usr_PB_ISTREAM_EMPTY_ARENA
 #endif
 
+#ifndef usr_PB_BUFFER_ONLY
+#define usr_PB_ISTREAM_EMPTY_SKIP ,0
+#else
+#define usr_PB_ISTREAM_EMPTY_SKIP
+#endif
+
+#define usr_PB_ISTREAM_EMPTY {0,0,0 usr_PB_ISTREAM_EMPTY_ERRMSG usr_PB_ISTREAM_EMPTY_ARENA usr_PB_ISTREAM_EMPTY_SKIP}
+
 /***************************
  * Main decoding functions *
  ***************************/
@@ -101,6 +242,68 @@ bool usr_pb_decode(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, voi
 #define usr_PB_DECODE_NULLTERMINATED  0x04U
 bool usr_pb_decode_ex(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, void *dest_struct, unsigned int flags);
 
+/* Decode only the fields selected by a field mask, which is a bitmap over
+ * the field indexes of the message. Other fields are skipped without being
+ * decoded, initialized or written to, and their submessages are not parsed
+ * at all. The mask applies to the top-level message only. Required fields
+ * that are not selected are not checked. The flags are the same as for
+ * usr_pb_decode_ex().
+ *
+ * The generator defines MyMessage_FIELDMASK_WORDS for the size of the mask,
+ * and MyMessage_myfield_index for the bit of each field.
+ *
+ * With usr_PB_ENABLE_MALLOC, the message is released on failure, so any
+ * pointer fields that are not selected must be valid, e.g. initialized with
+ * MyMessage_init_zero.
+ *
+ * Example usage:
+ *    uint32_t mask[MyMessage_FIELDMASK_WORDS] = {0};
+ *
+ *    usr_PB_FIELDMASK_SET(mask, MyMessage_id_index);
+ *    usr_PB_FIELDMASK_SET(mask, MyMessage_name_index);
+ *    usr_pb_decode_projected(&stream, MyMessage_fields, &msg, 0, mask);
+ */
+#define usr_PB_FIELDMASK_SET(mask, index) ((mask)[(index) >> 5] |= (uint32_t)1 << ((index) & 31))
+#define usr_PB_FIELDMASK_HAS(mask, index) ((((mask)[(index) >> 5] >> ((index) & 31)) & 1) != 0)
+bool usr_pb_decode_projected(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, void *dest_struct, unsigned int flags, const uint32_t *mask);
+
+/* Decode a message like usr_pb_decode_ex(), but without recursion. Static
+ * and pointer submessages are decoded using the caller-provided stack, which
+ * needs one frame for the message and one for each level of nesting. Deeper
+ * messages fail with the error "decoder stack full", so stack usage stays
+ * fixed regardless of the input. Submessages of callback fields, extensions
+ * and submessages with a message-level callback are decoded recursively.
+ *
+ * Example usage:
+ *    usr_pb_decoder_frame_t stack[8];
+ *
+ *    stream = usr_pb_istream_from_buffer(buffer, count);
+ *    usr_pb_decode_stack(&stream, TreeNode_fields, &tree, 0, stack, 8);
+ */
+bool usr_pb_decode_stack(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, void *dest_struct,
+                     unsigned int flags, usr_pb_decoder_frame_t *stack, size_t stack_size);
+
+/* Check that a message would decode successfully, without decoding it.
+ * The same checks are made as in usr_pb_decode(): wire types, integer
+ * ranges, string and bytes lengths and array counts against the maximum
+ * sizes of static fields, required fields and, with usr_PB_VALIDATE_UTF8,
+ * UTF-8 encoding of strings. Submessages are checked recursively, up to
+ * usr_PB_VALIDATE_MAX_DEPTH levels of nesting. Callback fields and unknown
+ * fields are only checked to be well-formed.
+ *
+ * Array entries are counted for usr_PB_VALIDATE_ARRAY_FIELDS fields of a
+ * message at a time. A message with arrays in later fields is read again
+ * from the start for each further set, which only a buffer stream allows;
+ * other streams fail with "too many array fields". Fixed count arrays must
+ * have exactly their declared number of entries, as in usr_pb_decode().
+ *
+ * Example usage:
+ *    stream = usr_pb_istream_from_buffer(buffer, count);
+ *    if (!usr_pb_validate(&stream, MyMessage_fields))
+ *        reject(usr_PB_GET_ERROR(&stream));
+ */
+bool usr_pb_validate(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields);
+
 /* Defines for backwards compatibility with code written before nanopb-0.4.0 */
 #define usr_pb_decode_noinit(s,f,d) usr_pb_decode_ex(s,f,d, usr_PB_DECODE_NOINIT)
 #define usr_pb_decode_delimited(s,f,d) usr_pb_decode_ex(s,f,d, usr_PB_DECODE_DELIMITED)
@@ -113,11 +316,143 @@ bool usr_pb_decode_ex(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields,
  * usr_pb_decode() returns with an error, the message is already released.
  */
 void usr_pb_release(const usr_pb_msgdesc_t *fields, void *dest_struct);
+
+/* Decode a message like usr_pb_decode_ex(), but allocate all pointer fields
+ * from the given arena instead of using usr_pb_realloc(). Growing the most
+ * recent allocation is done in place, so arrays and strings usually do not
+ * need to be copied.
+ *
+ * The decoded messages must not be passed to usr_pb_release(). Instead, all
+ * messages decoded into the arena are freed at once by usr_pb_arena_reset().
+ * This is also the case when decoding fails.
+ *
+ * Example usage:
+ *    usr_pb_arena_t arena;
+ *    MyMessage msg;
+ *
+ *    usr_pb_arena_init(&arena, malloc(4096), 4096);
+ *    while (receive_message(&stream))
+ *    {
+ *        if (usr_pb_decode_arena(&stream, MyMessage_fields, &msg, 0, &arena))
+ *            process_message(&msg);
+ *        usr_pb_arena_reset(&arena);
+ *    }
+ */
+bool usr_pb_decode_arena(usr_pb_istream_t *stream, const usr_pb_msgdesc_t *fields, void *dest_struct, unsigned int flags, usr_pb_arena_t *arena);
+
+/* Initialize an arena to allocate from the given buffer. */
+void usr_pb_arena_init(usr_pb_arena_t *arena, void *buffer, size_t size);
+
+/* Free all allocations from the arena at once. */
+void usr_pb_arena_reset(usr_pb_arena_t *arena);
 #else
 /* Allocation is not supported, so release is no-op */
 #define usr_pb_release(fields, dest_struct) usr_PB_UNUSED(fields); usr_PB_UNUSED(dest_struct);
 #endif
 
+/* Find a single field in an encoded message without decoding the message.
+ * The tag path gives the tag numbers of the enclosing submessages and then
+ * of the field itself, for example {MyMessage_header_tag, Header_key_tag}.
+ * Other fields are skipped at wire level, so no message descriptor is needed.
+ *
+ * On success, out is set to a memory stream that contains the value of the
+ * field: the bytes of a varint or fixed-size value, or the contents of a
+ * string, bytes, submessage or packed array without the length prefix. It
+ * can be read with e.g. usr_pb_decode_varint() or usr_pb_decode().
+ *
+ * The whole message is scanned. Like a decoder merging repeated occurrences
+ * of a submessage, every occurrence of each submessage on the path is
+ * searched, and the last occurrence of the field is returned.
+ *
+ * Returns false if the field is not found or the message is invalid, with
+ * the error message in out->errmsg.
+ *
+ * Example usage:
+ *    const uint32_t path[] = {MyMessage_header_tag, Header_key_tag};
+ *    usr_pb_istream_t value;
+ *    uint64_t key;
+ *
+ *    if (usr_pb_peek_field(buffer, count, path, 2, &value) &&
+ *        usr_pb_decode_varint(&value, &key))
+ *        route(key);
+ */
+bool usr_pb_peek_field(const usr_pb_byte_t *buf, size_t len, const uint32_t *tag_path, size_t depth, usr_pb_istream_t *out);
+
+/* Replace the value of a field in an encoded message, found by tag path as
+ * in usr_pb_peek_field(). If the field occurs more than once, the last
+ * occurrence is changed. The new value is given in the same form that
+ * usr_pb_peek_field() returns: a varint or 4 or 8 bytes of fixed-size value,
+ * or the contents of a length-delimited field. It must not point into buf.
+ *
+ * When the new value has the same encoded size, which is always the case for
+ * fixed32 and fixed64 fields, it is written in place. Otherwise the rest of
+ * the message is moved, and the length prefixes of the field itself and of
+ * the enclosing submessages are updated. *len is the length of the message
+ * and is updated, bufsize is the space available in buf.
+ *
+ * Returns false if the field is not found, the value does not match the
+ * wire type of the field, the message is invalid or the result does not fit
+ * in bufsize. The message is left unchanged in that case.
+ *
+ * Example usage:
+ *    const uint32_t path[] = {MyMessage_hops_tag};
+ *    usr_pb_byte_t value[10];
+ *    usr_pb_ostream_t stream = usr_pb_ostream_from_buffer(value, sizeof(value));
+ *
+ *    usr_pb_encode_varint(&stream, hops + 1);
+ *    usr_pb_patch_field(buffer, &count, sizeof(buffer), path, 1, value, stream.bytes_written);
+ */
+bool usr_pb_patch_field(usr_pb_byte_t *buf, size_t *len, size_t bufsize,
+                    const uint32_t *tag_path, size_t depth,
+                    const usr_pb_byte_t *value, size_t value_len);
+
+/**************************************
+ * Decoding from non-blocking sources *
+ **************************************/
+
+/* Initialize a resumable decoder. The stack needs one frame for the message
+ * and one for each level of nested submessages. The buffer is used for
+ * callback, pointer and extension fields with a length prefix, which are
+ * collected there before decoding. It can be NULL if the message has no
+ * such fields, or if they always arrive within one chunk.
+ */
+void usr_pb_decoder_init(usr_pb_decoder_t *dec, usr_pb_decoder_frame_t *stack, size_t stack_size,
+                     usr_pb_byte_t *buf, size_t bufsize);
+
+/* Start decoding a new message. The flags are the same as for
+ * usr_pb_decode_ex(). The message is initialized right away, and the data
+ * is passed in with usr_pb_decoder_feed().
+ */
+bool usr_pb_decoder_start(usr_pb_decoder_t *dec, const usr_pb_msgdesc_t *fields, void *dest_struct, unsigned int flags);
+
+/* Decode the next chunk of input data. The chunk can be split at any point,
+ * and the decoder keeps any partial values, so it can be fed with data as it
+ * arrives from a non-blocking socket. String and bytes fields are copied
+ * directly from the chunk to the message.
+ *
+ * Returns false on any failure. When a delimited or null-terminated message
+ * ends, dec->done is set and the rest of the chunk is left unused. The number
+ * of bytes used is stored in dec->consumed.
+ *
+ * Example usage:
+ *    usr_pb_decoder_frame_t stack[4];
+ *    usr_pb_decoder_t dec;
+ *
+ *    usr_pb_decoder_init(&dec, stack, 4, NULL, 0);
+ *    usr_pb_decoder_start(&dec, MyMessage_fields, &msg, usr_PB_DECODE_DELIMITED);
+ *    while (!dec.done && (count = recv(fd, chunk, sizeof(chunk), 0)) > 0)
+ *    {
+ *        if (!usr_pb_decoder_feed(&dec, chunk, count))
+ *            return false;
+ *    }
+ */
+bool usr_pb_decoder_feed(usr_pb_decoder_t *dec, const usr_pb_byte_t *buf, size_t count);
+
+/* Signal the end of input. For messages without a length prefix or a null
+ * terminator, this completes the message. Returns false if the message was
+ * incomplete or missing required fields.
+ */
+bool usr_pb_decoder_finish(usr_pb_decoder_t *dec);
 
 /**************************************
  * Functions for manipulating streams *
@@ -133,8 +468,36 @@ void usr_pb_release(const usr_pb_msgdesc_t *fields, void *dest_struct);
  */
 usr_pb_istream_t usr_pb_istream_from_buffer(const usr_pb_byte_t *buf, size_t msglen);
 
+#ifndef usr_PB_BUFFER_ONLY
+/* Initialize the state of a buffered input stream. The read function
+ * is called with the given state pointer to refill buf. */
+void usr_pb_istream_buffer_init(usr_pb_istream_buffer_t *ib,
+                            size_t (*read)(void *state, usr_pb_byte_t *buf, size_t count),
+                            void *state, usr_pb_byte_t *buf, size_t bufsize);
+
+/* Create an input stream that reads through a buffer. This is much faster
+ * than a custom stream callback that reads the data a few bytes at a time.
+ * Data that was read into the buffer but not consumed by the stream is kept
+ * in ib, so that several messages can be read with the same state.
+ *
+ * msglen is the length of the message, or SIZE_MAX to read until the end
+ * of file.
+ *
+ * Example usage:
+ *    usr_pb_byte_t buffer[256];
+ *    usr_pb_istream_buffer_t ib;
+ *    usr_pb_istream_t stream;
+ *
+ *    usr_pb_istream_buffer_init(&ib, &my_recv, &socket, buffer, sizeof(buffer));
+ *    stream = usr_pb_istream_from_buffered(&ib, SIZE_MAX);
+ *    usr_pb_decode_ex(&stream, MyMessage_fields, &msg, usr_PB_DECODE_DELIMITED);
+ */
+usr_pb_istream_t usr_pb_istream_from_buffered(usr_pb_istream_buffer_t *ib, size_t msglen);
+#endif
+
 /* Function to read from a usr_pb_istream_t. You can use this if you need to
  * read some custom header data, or to read data in field callbacks.
+ * If buf is NULL, the bytes are skipped, using the skip callback if set.
  */
 bool usr_pb_read(usr_pb_istream_t *stream, usr_pb_byte_t *buf, size_t count);
 
@@ -21,14 +21,49 @@
  * Declarations internal to this file *
  **************************************/
 static bool checkreturn buf_write(usr_pb_ostream_t *stream, const usr_pb_byte_t *buf, size_t count);
+#ifndef usr_PB_BUFFER_ONLY
+static bool checkreturn buffered_write(usr_pb_ostream_t *stream, const usr_pb_byte_t *buf, size_t count);
+static bool checkreturn write_all(usr_pb_ostream_buffer_t *ob, const usr_pb_byte_t *buf, size_t count);
+static bool checkreturn encode_submessage_buffered(usr_pb_ostream_t *stream, const usr_pb_msgdesc_t *fields, const void *src_struct, size_t size);
+static bool checkreturn window_write(usr_pb_ostream_t *stream, const usr_pb_byte_t *buf, size_t count);
+static usr_pb_size_t encoder_entries(const usr_pb_field_iter_t *field);
+static bool checkreturn encoder_enter_submessage(usr_pb_ostream_t *stream, usr_pb_encoder_t *enc);
+static bool checkreturn encoder_write_unit(usr_pb_ostream_t *stream, usr_pb_encoder_t *enc);
+static bool checkreturn encoder_next_unit(usr_pb_ostream_t *stream, usr_pb_encoder_t *enc);
+#endif
+#ifndef usr_PB_ENCODE_ARRAYS_UNPACKED
+static bool is_raw_fixed_array(const usr_pb_field_iter_t *field);
+static bool checkreturn packed_varint_size(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field, usr_pb_size_t count, size_t *size);
+#endif
 static bool checkreturn encode_array(usr_pb_ostream_t *stream, usr_pb_field_iter_t *field);
+static bool checkreturn encode_array_entry(usr_pb_ostream_t *stream, usr_pb_field_iter_t *field);
 static bool checkreturn usr_pb_check_proto3_default_value(const usr_pb_field_iter_t *field);
 static bool checkreturn encode_basic_field(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field);
 static bool checkreturn encode_callback_field(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field);
 static bool checkreturn encode_field(usr_pb_ostream_t *stream, usr_pb_field_iter_t *field);
 static bool checkreturn encode_extension_field(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field);
 static bool checkreturn default_extension_encoder(usr_pb_ostream_t *stream, const usr_pb_extension_t *extension);
+#if !defined(usr_PB_ENCODE_ARRAYS_UNPACKED) || defined(usr_PB_WITHOUT_64BIT)
+static size_t varint_size32(uint32_t value);
+#endif
+#ifndef usr_PB_WITHOUT_64BIT
+static size_t varint_size64(uint64_t value);
+#endif
+static size_t write_varint_32(usr_pb_byte_t *buffer, uint32_t low, uint32_t high);
 static bool checkreturn usr_pb_encode_varint_32(usr_pb_ostream_t *stream, uint32_t low, uint32_t high);
+static bool checkreturn encode_submessage_in_place(usr_pb_ostream_t *stream, const usr_pb_msgdesc_t *fields, const void *src_struct);
+static bool checkreturn encode_submsg_callback(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field);
+static bool field_has_value(const usr_pb_field_iter_t *field);
+static bool checkreturn rev_write(usr_pb_ostream_t *stream, const usr_pb_byte_t *buf, size_t count);
+static bool checkreturn rev_encode_length(usr_pb_ostream_t *stream, size_t size);
+static bool checkreturn rev_encode_tag(usr_pb_ostream_t *stream, uint32_t field_number);
+static bool checkreturn rev_encode_forward(usr_pb_ostream_t *stream, bool (*encoder)(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field), const usr_pb_field_iter_t *field);
+static bool checkreturn rev_encode_basic_field(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field);
+static bool checkreturn rev_encode_submessage(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field);
+static bool checkreturn rev_encode_array(usr_pb_ostream_t *stream, usr_pb_field_iter_t *field);
+static bool checkreturn rev_encode_field(usr_pb_ostream_t *stream, usr_pb_field_iter_t *field);
+static bool checkreturn rev_encode_fields(usr_pb_ostream_t *stream, usr_pb_field_iter_t *iter, usr_pb_size_t count);
+static bool checkreturn rev_encode_message(usr_pb_ostream_t *stream, const usr_pb_msgdesc_t *fields, const void *src_struct);
 static bool checkreturn usr_pb_enc_bool(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field);
 static bool checkreturn usr_pb_enc_varint(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field);
 static bool checkreturn usr_pb_enc_fixed(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field);
@@ -36,6 +71,7 @@ static bool checkreturn usr_pb_enc_bytes(usr_pb_ostream_t *stream, const usr_pb_
 static bool checkreturn usr_pb_enc_string(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field);
 static bool checkreturn usr_pb_enc_submessage(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field);
 static bool checkreturn usr_pb_enc_fixed_length_bytes(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field);
+static bool checkreturn usr_pb_enc_view(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field);
 
 #ifdef usr_PB_WITHOUT_64BIT
 #define usr_pb_int64_t int32_t
@@ -45,6 +81,17 @@ static bool checkreturn usr_pb_enc_fixed_length_bytes(usr_pb_ostream_t *stream,
 #define usr_pb_uint64_t uint64_t
 #endif
 
+/* Memory buffer streams are recognized by their callback, which allows
+ * writing submessages in a single pass (see encode_submessage_in_place()).
+ * Buffered streams can do the same when the submessage fits in the buffer. */
+#ifdef usr_PB_BUFFER_ONLY
+#define usr_PB_OSTREAM_IS_BUFFER(stream) ((stream)->callback != NULL)
+#define usr_PB_OSTREAM_IS_BUFFERED(stream) false
+#else
+#define usr_PB_OSTREAM_IS_BUFFER(stream) ((stream)->callback == &buf_write)
+#define usr_PB_OSTREAM_IS_BUFFERED(stream) ((stream)->callback == &buffered_write)
+#endif
+
 /*******************************
  * usr_pb_ostream_t implementation *
  *******************************/
@@ -78,6 +125,82 @@ usr_pb_ostream_t usr_pb_ostream_from_buffer(usr_pb_byte_t *buf, size_t bufsize)
     return stream;
 }
 
+#ifndef usr_PB_BUFFER_ONLY
+/* Pass data to the write function of a buffered stream, which may
+ * write less than requested at a time. */
+static bool checkreturn write_all(usr_pb_ostream_buffer_t *ob, const usr_pb_byte_t *buf, size_t count)
+{
+    while (count > 0)
+    {
+        size_t n = ob->write(ob->state, buf, count);
+        if (n == 0 || n > count)
+            return false;
+
+        buf += n;
+        count -= n;
+    }
+
+    return true;
+}
+
+static bool checkreturn buffered_write(usr_pb_ostream_t *stream, const usr_pb_byte_t *buf, size_t count)
+{
+    usr_pb_ostream_buffer_t *ob = (usr_pb_ostream_buffer_t*)stream->state;
+
+    if (count > ob->size - ob->used)
+    {
+        if (!write_all(ob, ob->buffer, ob->used))
+            return false;
+
+        ob->used = 0;
+
+        if (count >= ob->size)
+        {
+            /* Large writes go directly to the destination */
+            return write_all(ob, buf, count);
+        }
+    }
+
+    memcpy(ob->buffer + ob->used, buf, count);
+    ob->used += count;
+    return true;
+}
+
+void usr_pb_ostream_buffer_init(usr_pb_ostream_buffer_t *ob,
+                            size_t (*write)(void *state, const usr_pb_byte_t *buf, size_t count),
+                            void *state, usr_pb_byte_t *buf, size_t bufsize)
+{
+    ob->write = write;
+    ob->state = state;
+    ob->buffer = buf;
+    ob->size = bufsize;
+    ob->used = 0;
+}
+
+usr_pb_ostream_t usr_pb_ostream_from_buffered(usr_pb_ostream_buffer_t *ob, size_t max_size)
+{
+    usr_pb_ostream_t stream = usr_pb_ostream_from_buffer(NULL, max_size);
+    stream.callback = &buffered_write;
+    stream.state = ob;
+    return stream;
+}
+
+bool checkreturn usr_pb_ostream_flush(usr_pb_ostream_t *stream)
+{
+    if (usr_PB_OSTREAM_IS_BUFFERED(stream))
+    {
+        usr_pb_ostream_buffer_t *ob = (usr_pb_ostream_buffer_t*)stream->state;
+
+        if (!write_all(ob, ob->buffer, ob->used))
+            usr_PB_RETURN_ERROR(stream, "io error");
+
+        ob->used = 0;
+    }
+
+    return true;
+}
+#endif
+
 bool checkreturn usr_pb_write(usr_pb_ostream_t *stream, const usr_pb_byte_t *buf, size_t count)
 {
     if (count > 0 && stream->callback != NULL)
@@ -121,6 +244,97 @@ static bool safe_read_bool(const void *pSize)
     return false;
 }
 
+#ifndef usr_PB_ENCODE_ARRAYS_UNPACKED
+/* Check if the entries of a packed fixed32 or fixed64 array have the same
+ * layout in memory as on the wire, so that the array can be written as is.
+ * This is not the case on big-endian platforms, or for floats that are
+ * converted to doubles. */
+static bool is_raw_fixed_array(const usr_pb_field_iter_t *field)
+{
+#ifdef usr_PB_LITTLE_ENDIAN_8BIT
+    return (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_FIXED32 && field->data_size == 4) ||
+           (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_FIXED64 && field->data_size == 8);
+#else
+    usr_PB_UNUSED(field);
+    return false;
+#endif
+}
+
+/* Sum the encoded sizes of the entries of an array of the given type,
+ * computing the size of each value v with expr. */
+#define usr_PB_SUM_VARINT_SIZES(type, expr) \
+    { \
+        const type *values = (const type*)field->pData; \
+        for (i = 0; i < count; i++) \
+        { \
+            type v = values[i]; \
+            total += (expr); \
+        } \
+    }
+
+/* Compute the size of a packed varint array, in the same way as the
+ * values would be encoded by usr_pb_enc_varint(), but without encoding
+ * them to a sizing stream. */
+static bool checkreturn packed_varint_size(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field, usr_pb_size_t count, size_t *size)
+{
+    size_t total = 0;
+    usr_pb_size_t i;
+
+    if (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_UVARINT)
+    {
+        if (field->data_size == sizeof(uint_least8_t))
+            usr_PB_SUM_VARINT_SIZES(uint_least8_t, varint_size32(v))
+        else if (field->data_size == sizeof(uint_least16_t))
+            usr_PB_SUM_VARINT_SIZES(uint_least16_t, varint_size32(v))
+        else if (field->data_size == sizeof(uint32_t))
+            usr_PB_SUM_VARINT_SIZES(uint32_t, varint_size32(v))
+#ifndef usr_PB_WITHOUT_64BIT
+        else if (field->data_size == sizeof(uint64_t))
+            usr_PB_SUM_VARINT_SIZES(uint64_t, varint_size64(v))
+#endif
+        else
+            usr_PB_RETURN_ERROR(stream, "invalid data_size");
+    }
+    else if (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_SVARINT)
+    {
+        /* ZigZag encoding, same as in usr_pb_encode_svarint() */
+        if (field->data_size == sizeof(int_least8_t))
+            usr_PB_SUM_VARINT_SIZES(int_least8_t, varint_size32(v < 0 ? ~((uint32_t)v << 1) : (uint32_t)v << 1))
+        else if (field->data_size == sizeof(int_least16_t))
+            usr_PB_SUM_VARINT_SIZES(int_least16_t, varint_size32(v < 0 ? ~((uint32_t)v << 1) : (uint32_t)v << 1))
+        else if (field->data_size == sizeof(int32_t))
+            usr_PB_SUM_VARINT_SIZES(int32_t, varint_size32(v < 0 ? ~((uint32_t)v << 1) : (uint32_t)v << 1))
+#ifndef usr_PB_WITHOUT_64BIT
+        else if (field->data_size == sizeof(int64_t))
+            usr_PB_SUM_VARINT_SIZES(int64_t, varint_size64(v < 0 ? ~((uint64_t)v << 1) : (uint64_t)v << 1))
+#endif
+        else
+            usr_PB_RETURN_ERROR(stream, "invalid data_size");
+    }
+    else
+    {
+        /* Negative values are sign extended to 64 bits, which takes 10 bytes */
+        if (field->data_size == sizeof(int_least8_t))
+            usr_PB_SUM_VARINT_SIZES(int_least8_t, v < 0 ? 10 : varint_size32((uint32_t)v))
+        else if (field->data_size == sizeof(int_least16_t))
+            usr_PB_SUM_VARINT_SIZES(int_least16_t, v < 0 ? 10 : varint_size32((uint32_t)v))
+        else if (field->data_size == sizeof(int32_t))
+            usr_PB_SUM_VARINT_SIZES(int32_t, v < 0 ? 10 : varint_size32((uint32_t)v))
+#ifndef usr_PB_WITHOUT_64BIT
+        else if (field->data_size == sizeof(int64_t))
+            usr_PB_SUM_VARINT_SIZES(int64_t, v < 0 ? 10 : varint_size64((uint64_t)v))
+#endif
+        else
+            usr_PB_RETURN_ERROR(stream, "invalid data_size");
+    }
+
+    *size = total;
+    return true;
+}
+
+#undef usr_PB_SUM_VARINT_SIZES
+#endif
+
 /* Encode a static array. Handles the size calculations and possible packing. */
 static bool checkreturn encode_array(usr_pb_ostream_t *stream, usr_pb_field_iter_t *field)
 {
@@ -154,18 +368,14 @@ static bool checkreturn encode_array(usr_pb_ostream_t *stream, usr_pb_field_iter
         {
             size = 8 * (size_t)count;
         }
+        else if (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_BOOL)
+        {
+            size = (size_t)count;
+        }
         else
         { 
-            usr_pb_ostream_t sizestream = usr_PB_OSTREAM_SIZING;
-            void *pData_orig = field->pData;
-            for (i = 0; i < count; i++)
-            {
-                if (!usr_pb_enc_varint(&sizestream, field))
-                    usr_PB_RETURN_ERROR(stream, usr_PB_GET_ERROR(&sizestream));
-                field->pData = (char*)field->pData + field->data_size;
-            }
-            field->pData = pData_orig;
-            size = sizestream.bytes_written;
+            if (!packed_varint_size(stream, field, count, &size))
+                return false;
         }
         
         if (!usr_pb_encode_varint(stream, (usr_pb_uint64_t)size))
@@ -174,6 +384,9 @@ static bool checkreturn encode_array(usr_pb_ostream_t *stream, usr_pb_field_iter
         if (stream->callback == NULL)
             return usr_pb_write(stream, NULL, size); /* Just sizing.. */
         
+        if (is_raw_fixed_array(field))
+            return usr_pb_write(stream, (const usr_pb_byte_t*)field->pData, size);
+
         /* Write the data */
         for (i = 0; i < count; i++)
         {
@@ -196,39 +409,9 @@ static bool checkreturn encode_array(usr_pb_ostream_t *stream, usr_pb_field_iter
     {
         for (i = 0; i < count; i++)
         {
-            /* Normally the data is stored directly in the array entries, but
-             * for pointer-type string and bytes fields, the array entries are
-             * actually pointers themselves also. So we have to dereference once
-             * more to get to the actual data. */
-            if (usr_PB_ATYPE(field->type) == usr_PB_ATYPE_POINTER &&
-                (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_STRING ||
-                 usr_PB_LTYPE(field->type) == usr_PB_LTYPE_BYTES))
-            {
-                bool status;
-                void *pData_orig = field->pData;
-                field->pData = *(void* const*)field->pData;
-
-                if (!field->pData)
-                {
-                    /* Null pointer in array is treated as empty string / bytes */
-                    status = usr_pb_encode_tag_for_field(stream, field) &&
-                             usr_pb_encode_varint(stream, 0);
-                }
-                else
-                {
-                    status = encode_basic_field(stream, field);
-                }
-
-                field->pData = pData_orig;
+            if (!encode_array_entry(stream, field))
+                return false;
 
-                if (!status)
-                    return false;
-            }
-            else
-            {
-                if (!encode_basic_field(stream, field))
-                    return false;
-            }
             field->pData = (char*)field->pData + field->data_size;
         }
     }
@@ -236,6 +419,41 @@ static bool checkreturn encode_array(usr_pb_ostream_t *stream, usr_pb_field_iter
     return true;
 }
 
+/* Encode one entry of an unpacked array, pointed to by field->pData. */
+static bool checkreturn encode_array_entry(usr_pb_ostream_t *stream, usr_pb_field_iter_t *field)
+{
+    /* Normally the data is stored directly in the array entries, but
+     * for pointer-type string and bytes fields, the array entries are
+     * actually pointers themselves also. So we have to dereference once
+     * more to get to the actual data. */
+    if (usr_PB_ATYPE(field->type) == usr_PB_ATYPE_POINTER &&
+        (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_STRING ||
+         usr_PB_LTYPE(field->type) == usr_PB_LTYPE_BYTES))
+    {
+        bool status;
+        void *pData_orig = field->pData;
+        field->pData = *(void* const*)field->pData;
+
+        if (!field->pData)
+        {
+            /* Null pointer in array is treated as empty string / bytes */
+            status = usr_pb_encode_tag_for_field(stream, field) &&
+                     usr_pb_encode_varint(stream, 0);
+        }
+        else
+        {
+            status = encode_basic_field(stream, field);
+        }
+
+        field->pData = pData_orig;
+        return status;
+    }
+    else
+    {
+        return encode_basic_field(stream, field);
+    }
+}
+
 /* In proto3, all fields are optional and are only encoded if their value is "non-zero".
  * This function implements the check for the zero value. */
 static bool checkreturn usr_pb_check_proto3_default_value(const usr_pb_field_iter_t *field)
@@ -307,6 +525,11 @@ static bool checkreturn usr_pb_check_proto3_default_value(const usr_pb_field_ite
              * it anyway. */
             return field->data_size == 0;
         }
+        else if (usr_PB_LTYPE_IS_VIEW(type))
+        {
+            const usr_pb_view_t *view = (const usr_pb_view_t*)field->pData;
+            return view->size == 0;
+        }
         else if (usr_PB_LTYPE_IS_SUBMSG(type))
         {
             /* Check all fields in the submessage to find if any of them
@@ -394,6 +617,10 @@ static bool checkreturn encode_basic_field(usr_pb_ostream_t *stream, const usr_p
         case usr_PB_LTYPE_FIXED_LENGTH_BYTES:
             return usr_pb_enc_fixed_length_bytes(stream, field);
 
+        case usr_PB_LTYPE_VIEW:
+        case usr_PB_LTYPE_STRING_VIEW:
+            return usr_pb_enc_view(stream, field);
+
         default:
             usr_PB_RETURN_ERROR(stream, "invalid field type");
     }
@@ -411,16 +638,15 @@ static bool checkreturn encode_callback_field(usr_pb_ostream_t *stream, const us
     return true;
 }
 
-/* Encode a single field of any callback, pointer or static type. */
-static bool checkreturn encode_field(usr_pb_ostream_t *stream, usr_pb_field_iter_t *field)
+/* Check field presence of oneof and optional fields. */
+static bool field_has_value(const usr_pb_field_iter_t *field)
 {
-    /* Check field presence */
     if (usr_PB_HTYPE(field->type) == usr_PB_HTYPE_ONEOF)
     {
         if (*(const usr_pb_size_t*)field->pSize != field->tag)
         {
             /* Different type oneof field */
-            return true;
+            return false;
         }
     }
     else if (usr_PB_HTYPE(field->type) == usr_PB_HTYPE_OPTIONAL)
@@ -430,17 +656,26 @@ static bool checkreturn encode_field(usr_pb_ostream_t *stream, usr_pb_field_iter
             if (safe_read_bool(field->pSize) == false)
             {
                 /* Missing optional field */
-                return true;
+                return false;
             }
         }
         else if (usr_PB_ATYPE(field->type) == usr_PB_ATYPE_STATIC)
         {
             /* Proto3 singular field */
             if (usr_pb_check_proto3_default_value(field))
-                return true;
+                return false;
         }
     }
 
+    return true;
+}
+
+/* Encode a single field of any callback, pointer or static type. */
+static bool checkreturn encode_field(usr_pb_ostream_t *stream, usr_pb_field_iter_t *field)
+{
+    if (!field_has_value(field))
+        return true;
+
     if (!field->pData)
     {
         if (usr_PB_HTYPE(field->type) == usr_PB_HTYPE_REQUIRED)
@@ -562,79 +797,850 @@ bool usr_pb_get_encoded_size(size_t *size, const usr_pb_msgdesc_t *fields, const
     return true;
 }
 
-/********************
- * Helper functions *
- ********************/
+/********************************************
+ * Encode all fields in back-to-front order *
+ ********************************************/
 
-/* This function avoids 64-bit shifts as they are quite slow on many platforms. */
-static bool checkreturn usr_pb_encode_varint_32(usr_pb_ostream_t *stream, uint32_t low, uint32_t high)
+/* In reverse encoding, the stream state points to the first byte written so
+ * far, and new data is prepended in front of it. max_size is the amount of
+ * free space in the buffer when encoding started. */
+static bool checkreturn rev_write(usr_pb_ostream_t *stream, const usr_pb_byte_t *buf, size_t count)
+{
+    size_t i;
+    usr_pb_byte_t *dest;
+
+    if (stream->max_size - stream->bytes_written < count)
+        usr_PB_RETURN_ERROR(stream, "stream full");
+
+    dest = (usr_pb_byte_t*)stream->state - count;
+    for (i = 0; i < count; i++)
+        dest[i] = buf[i];
+
+    stream->state = dest;
+    stream->bytes_written += count;
+    return true;
+}
+
+static bool checkreturn rev_encode_length(usr_pb_ostream_t *stream, size_t size)
 {
-    size_t i = 0;
     usr_pb_byte_t buffer[10];
-    usr_pb_byte_t byte = (usr_pb_byte_t)(low & 0x7F);
-    low >>= 7;
+    usr_pb_ostream_t tmpstream = usr_pb_ostream_from_buffer(buffer, sizeof(buffer));
 
-    while (i < 4 && (low != 0 || high != 0))
-    {
-        byte |= 0x80;
-        buffer[i++] = byte;
-        byte = (usr_pb_byte_t)(low & 0x7F);
-        low >>= 7;
-    }
+    if (!usr_pb_encode_varint(&tmpstream, (usr_pb_uint64_t)size))
+        usr_PB_RETURN_ERROR(stream, usr_PB_GET_ERROR(&tmpstream));
 
-    if (high)
-    {
-        byte = (usr_pb_byte_t)(byte | ((high & 0x07) << 4));
-        high >>= 3;
+    return rev_write(stream, buffer, tmpstream.bytes_written);
+}
 
-        while (high)
-        {
-            byte |= 0x80;
-            buffer[i++] = byte;
-            byte = (usr_pb_byte_t)(high & 0x7F);
-            high >>= 7;
-        }
-    }
+/* Tag of a length-delimited field */
+static bool checkreturn rev_encode_tag(usr_pb_ostream_t *stream, uint32_t field_number)
+{
+    usr_pb_byte_t buffer[5];
+    usr_pb_ostream_t tmpstream = usr_pb_ostream_from_buffer(buffer, sizeof(buffer));
 
-    buffer[i++] = byte;
+    if (!usr_pb_encode_tag(&tmpstream, usr_PB_WT_STRING, field_number))
+        usr_PB_RETURN_ERROR(stream, usr_PB_GET_ERROR(&tmpstream));
 
-    return usr_pb_write(stream, buffer, i);
+    return rev_write(stream, buffer, tmpstream.bytes_written);
 }
 
-bool checkreturn usr_pb_encode_varint(usr_pb_ostream_t *stream, usr_pb_uint64_t value)
+/* Prepend a field that can only be written front-to-back, such as callback
+ * fields and strings. The size is determined first using a sizing stream,
+ * and then the field is encoded normally into the reserved space. */
+static bool checkreturn rev_encode_forward(usr_pb_ostream_t *stream,
+    bool (*encoder)(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field),
+    const usr_pb_field_iter_t *field)
 {
-    if (value <= 0x7F)
+    usr_pb_ostream_t substream = usr_PB_OSTREAM_SIZING;
+    size_t size;
+
+    if (!encoder(&substream, field))
+        usr_PB_RETURN_ERROR(stream, usr_PB_GET_ERROR(&substream));
+
+    size = substream.bytes_written;
+    if (stream->max_size - stream->bytes_written < size)
+        usr_PB_RETURN_ERROR(stream, "stream full");
+
+    substream = usr_pb_ostream_from_buffer((usr_pb_byte_t*)stream->state - size, size);
+    if (!encoder(&substream, field))
+        usr_PB_RETURN_ERROR(stream, usr_PB_GET_ERROR(&substream));
+
+    if (substream.bytes_written != size)
+        usr_PB_RETURN_ERROR(stream, "submsg size changed");
+
+    stream->state = (usr_pb_byte_t*)stream->state - size;
+    stream->bytes_written += size;
+    return true;
+}
+
+static bool checkreturn rev_encode_basic_field(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field)
+{
+    if (!field->pData)
     {
-        /* Fast path: single byte */
-        usr_pb_byte_t byte = (usr_pb_byte_t)value;
-        return usr_pb_write(stream, &byte, 1);
+        /* Missing pointer field */
+        return true;
     }
-    else
+
+    switch (usr_PB_LTYPE(field->type))
     {
-#ifdef usr_PB_WITHOUT_64BIT
-        return usr_pb_encode_varint_32(stream, value, 0);
-#else
-        return usr_pb_encode_varint_32(stream, (uint32_t)value, (uint32_t)(value >> 32));
-#endif
+        case usr_PB_LTYPE_BYTES:
+        case usr_PB_LTYPE_STRING:
+        case usr_PB_LTYPE_FIXED_LENGTH_BYTES:
+        case usr_PB_LTYPE_VIEW:
+        case usr_PB_LTYPE_STRING_VIEW:
+            return rev_encode_forward(stream, &encode_basic_field, field);
+
+        case usr_PB_LTYPE_SUBMESSAGE:
+        case usr_PB_LTYPE_SUBMSG_W_CB:
+            return rev_encode_submessage(stream, field);
+
+        default:
+        {
+            /* Scalar fields are encoded into a temporary buffer, which
+             * has space for the largest possible tag and value. */
+            usr_pb_byte_t buffer[16];
+            usr_pb_ostream_t tmpstream = usr_pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+            if (!encode_basic_field(&tmpstream, field))
+                usr_PB_RETURN_ERROR(stream, usr_PB_GET_ERROR(&tmpstream));
+
+            return rev_write(stream, buffer, tmpstream.bytes_written);
+        }
     }
 }
 
-bool checkreturn usr_pb_encode_svarint(usr_pb_ostream_t *stream, usr_pb_int64_t value)
+static bool checkreturn rev_encode_submessage(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field)
 {
-    usr_pb_uint64_t zigzagged;
-    if (value < 0)
-        zigzagged = ~((usr_pb_uint64_t)value << 1);
-    else
-        zigzagged = (usr_pb_uint64_t)value << 1;
-    
-    return usr_pb_encode_varint(stream, zigzagged);
-}
+    size_t end = stream->bytes_written;
 
-bool checkreturn usr_pb_encode_fixed32(usr_pb_ostream_t *stream, const void *value)
-{
-    uint32_t val = *(const uint32_t*)value;
-    usr_pb_byte_t bytes[4];
-    bytes[0] = (usr_pb_byte_t)(val & 0xFF);
+    if (field->submsg_desc == NULL)
+        usr_PB_RETURN_ERROR(stream, "invalid field descriptor");
+
+    if (!rev_encode_message(stream, field->submsg_desc, field->pData))
+        return false;
+
+    /* The submessage is complete, so its length is now known. */
+    if (!rev_encode_length(stream, stream->bytes_written - end))
+        return false;
+
+    if (!rev_encode_forward(stream, &encode_submsg_callback, field))
+        return false;
+
+    return rev_encode_tag(stream, field->tag);
+}
+
+static bool checkreturn rev_encode_array(usr_pb_ostream_t *stream, usr_pb_field_iter_t *field)
+{
+    usr_pb_size_t i;
+    usr_pb_size_t count;
+    void *pData_orig = field->pData;
+
+    count = *(usr_pb_size_t*)field->pSize;
+
+    if (count == 0)
+        return true;
+
+    if (usr_PB_ATYPE(field->type) != usr_PB_ATYPE_POINTER && count > field->array_size)
+        usr_PB_RETURN_ERROR(stream, "array max size exceeded");
+
+#ifndef usr_PB_ENCODE_ARRAYS_UNPACKED
+    if (usr_PB_LTYPE(field->type) <= usr_PB_LTYPE_LAST_PACKABLE)
+    {
+        /* Packed array: write the values starting from the last one,
+         * after which the total size is known. */
+        size_t end = stream->bytes_written;
+
+        if (is_raw_fixed_array(field))
+        {
+            if (!rev_write(stream, (const usr_pb_byte_t*)pData_orig, field->data_size * (size_t)count))
+                return false;
+        }
+        else
+        {
+            for (i = count; i > 0; i--)
+            {
+                usr_pb_byte_t buffer[10];
+                usr_pb_ostream_t tmpstream = usr_pb_ostream_from_buffer(buffer, sizeof(buffer));
+                bool status;
+
+                field->pData = (char*)pData_orig + field->data_size * (i - 1);
+
+                if (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_FIXED32 || usr_PB_LTYPE(field->type) == usr_PB_LTYPE_FIXED64)
+                    status = usr_pb_enc_fixed(&tmpstream, field);
+                else
+                    status = usr_pb_enc_varint(&tmpstream, field);
+
+                field->pData = pData_orig;
+
+                if (!status)
+                    usr_PB_RETURN_ERROR(stream, usr_PB_GET_ERROR(&tmpstream));
+
+                if (!rev_write(stream, buffer, tmpstream.bytes_written))
+                    return false;
+            }
+        }
+
+        if (!rev_encode_length(stream, stream->bytes_written - end))
+            return false;
+
+        return rev_encode_tag(stream, field->tag);
+    }
+#endif
+
+    /* Unpacked array: each entry is written as a separate field */
+    for (i = count; i > 0; i--)
+    {
+        bool status;
+        field->pData = (char*)pData_orig + field->data_size * (i - 1);
+
+        if (usr_PB_ATYPE(field->type) == usr_PB_ATYPE_POINTER &&
+            (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_STRING ||
+             usr_PB_LTYPE(field->type) == usr_PB_LTYPE_BYTES))
+        {
+            /* Pointer-type string and bytes arrays contain pointers to the data */
+            field->pData = *(void* const*)field->pData;
+
+            if (!field->pData)
+            {
+                /* Null pointer in array is treated as empty string / bytes */
+                status = rev_encode_length(stream, 0) &&
+                         rev_encode_tag(stream, field->tag);
+            }
+            else
+            {
+                status = rev_encode_basic_field(stream, field);
+            }
+        }
+        else
+        {
+            status = rev_encode_basic_field(stream, field);
+        }
+
+        field->pData = pData_orig;
+
+        if (!status)
+            return false;
+    }
+
+    return true;
+}
+
+static bool checkreturn rev_encode_field(usr_pb_ostream_t *stream, usr_pb_field_iter_t *field)
+{
+    if (!field_has_value(field))
+        return true;
+
+    if (!field->pData)
+    {
+        if (usr_PB_HTYPE(field->type) == usr_PB_HTYPE_REQUIRED)
+            usr_PB_RETURN_ERROR(stream, "missing required field");
+
+        /* Pointer field set to NULL */
+        return true;
+    }
+
+    if (usr_PB_ATYPE(field->type) == usr_PB_ATYPE_CALLBACK)
+    {
+        return rev_encode_forward(stream, &encode_callback_field, field);
+    }
+    else if (usr_PB_HTYPE(field->type) == usr_PB_HTYPE_REPEATED)
+    {
+        return rev_encode_array(stream, field);
+    }
+    else
+    {
+        return rev_encode_basic_field(stream, field);
+    }
+}
+
+/* The field iterator can only move forward, so the fields are processed in
+ * batches starting from the end of the message. Longer ranges of fields are
+ * split into parts by walking through them once and saving the start position
+ * of each part, and the parts are then encoded last one first. Each field is
+ * visited once per level of splitting, and a single level is enough for
+ * messages with up to REVERSE_BATCH_SIZE * REVERSE_SPLIT_COUNT fields. */
+#define REVERSE_BATCH_SIZE 8
+#define REVERSE_SPLIT_COUNT 16
+
+/* Encode count fields starting from the iterator position, last one first. */
+static bool checkreturn rev_encode_fields(usr_pb_ostream_t *stream, usr_pb_field_iter_t *iter, usr_pb_size_t count)
+{
+    usr_pb_size_t i;
+
+    if (count <= REVERSE_BATCH_SIZE)
+    {
+        usr_pb_field_iter_t batch[REVERSE_BATCH_SIZE];
+
+        for (i = 0; i < count; i++)
+        {
+            batch[i] = *iter;
+
+            /* Count of fixed size arrays is stored in the iterator itself */
+            if (iter->pSize == &iter->array_size)
+                batch[i].pSize = &batch[i].array_size;
+
+            (void)usr_pb_field_iter_next(iter);
+        }
+
+        for (i = count; i > 0; i--)
+        {
+            usr_pb_field_iter_t *field = &batch[i - 1];
+
+            if (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_EXTENSION)
+            {
+                /* Extensions are encoded front-to-back into reserved space */
+                if (!rev_encode_forward(stream, &encode_extension_field, field))
+                    return false;
+            }
+            else
+            {
+                if (!rev_encode_field(stream, field))
+                    return false;
+            }
+        }
+    }
+    else
+    {
+        usr_pb_field_lookup_t starts[REVERSE_SPLIT_COUNT];
+        usr_pb_size_t part = (usr_pb_size_t)((count + REVERSE_SPLIT_COUNT - 1) / REVERSE_SPLIT_COUNT);
+        usr_pb_size_t parts = 0;
+
+        if (part < REVERSE_BATCH_SIZE)
+            part = REVERSE_BATCH_SIZE;
+
+        for (i = 0; i < count; i++)
+        {
+            if (i % part == 0)
+                usr_pb_field_iter_save(iter, &starts[parts++]);
+
+            (void)usr_pb_field_iter_next(iter);
+        }
+
+        while (parts > 0)
+        {
+            usr_pb_size_t first = (usr_pb_size_t)(--parts * part);
+            usr_pb_size_t n = (usr_pb_size_t)(count - first);
+
+            if (n > part)
+                n = part;
+
+            (void)usr_pb_field_iter_restore(iter, &starts[parts]);
+
+            if (!rev_encode_fields(stream, iter, n))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+static bool checkreturn rev_encode_message(usr_pb_ostream_t *stream, const usr_pb_msgdesc_t *fields, const void *src_struct)
+{
+    usr_pb_field_iter_t iter;
+
+    if (!usr_pb_field_iter_begin_const(&iter, fields, src_struct))
+        return true; /* Empty message type */
+
+    return rev_encode_fields(stream, &iter, fields->field_count);
+}
+
+bool checkreturn usr_pb_encode_reverse(usr_pb_ostream_t *stream, const usr_pb_msgdesc_t *fields, const void *src_struct, size_t *start)
+{
+    usr_pb_ostream_t revstream;
+    size_t free_space;
+    bool status;
+
+    if (!usr_PB_OSTREAM_IS_BUFFER(stream))
+        usr_PB_RETURN_ERROR(stream, "not a buffer stream");
+
+    free_space = stream->max_size - stream->bytes_written;
+
+    revstream = *stream;
+    revstream.state = (usr_pb_byte_t*)stream->state + free_space;
+    revstream.max_size = free_space;
+    revstream.bytes_written = 0;
+
+    status = rev_encode_message(&revstream, fields, src_struct);
+
+#ifndef usr_PB_NO_ERRMSG
+    stream->errmsg = revstream.errmsg;
+#endif
+
+    if (!status)
+        return false;
+
+    *start = stream->bytes_written + free_space - revstream.bytes_written;
+    stream->bytes_written += revstream.bytes_written;
+    return true;
+}
+
+#ifndef usr_PB_BUFFER_ONLY
+/*********************
+ * Resumable encoder *
+ *********************/
+
+/* States of usr_pb_encoder_t */
+#define usr_PB_ENCODER_PREFIX     0 /* Writing the length of a delimited message */
+#define usr_PB_ENCODER_FIELDS     1 /* Writing the field enc->level[enc->depth].iter */
+#define usr_PB_ENCODER_TERMINATOR 2 /* Writing the null terminator */
+#define usr_PB_ENCODER_FAILED     3
+#define usr_PB_ENCODER_HEADER     4 /* Writing the tag and length of a submessage */
+
+/* Output window for one field of a resumable encoder. The field is encoded
+ * from its start every time, and the bytes that were already written out
+ * by an earlier call are dropped. */
+typedef struct {
+    usr_pb_ostream_t *out;
+    size_t skip;            /* Bytes left to drop */
+    size_t written;         /* Bytes passed to the output stream */
+    bool full;              /* Output stream ran out of space */
+} encoder_window_t;
+
+static bool checkreturn window_write(usr_pb_ostream_t *stream, const usr_pb_byte_t *buf, size_t count)
+{
+    encoder_window_t *window = (encoder_window_t*)stream->state;
+    usr_pb_ostream_t *out = window->out;
+    size_t space;
+
+    if (window->skip >= count)
+    {
+        window->skip -= count;
+        return true;
+    }
+
+    buf += window->skip;
+    count -= window->skip;
+    window->skip = 0;
+
+    space = out->max_size - out->bytes_written;
+    if (count > space)
+    {
+        /* Write what fits and stop encoding the field */
+        if (space > 0 && !usr_pb_write(out, buf, space))
+            return false;
+
+        window->written += space;
+        window->full = true;
+        return false;
+    }
+
+    if (!usr_pb_write(out, buf, count))
+        return false;
+
+    window->written += count;
+    return true;
+}
+
+/* Unpacked arrays are written one entry at a time, so that the entries
+ * before the current one need not be encoded again on every call.
+ * Returns 0 for fields that are written as a whole. */
+static usr_pb_size_t encoder_entries(const usr_pb_field_iter_t *field)
+{
+    if (usr_PB_HTYPE(field->type) != usr_PB_HTYPE_REPEATED ||
+        usr_PB_ATYPE(field->type) == usr_PB_ATYPE_CALLBACK ||
+        !field->pData)
+    {
+        return 0;
+    }
+
+#ifndef usr_PB_ENCODE_ARRAYS_UNPACKED
+    if (usr_PB_LTYPE(field->type) <= usr_PB_LTYPE_LAST_PACKABLE)
+        return 0;
+#endif
+
+    return *(const usr_pb_size_t*)field->pSize;
+}
+
+/* If the current field or entry is a submessage, start writing it one field
+ * at a time on a new level. Its size is calculated here, and the tag and
+ * length are written next as a unit of their own. Other fields, and
+ * submessages past usr_PB_ENCODER_MAX_DEPTH, are left to encoder_write_unit(). */
+static bool checkreturn encoder_enter_submessage(usr_pb_ostream_t *stream, usr_pb_encoder_t *enc)
+{
+    usr_pb_encoder_level_t *level = &enc->level[enc->depth];
+    usr_pb_field_iter_t *field = &level->iter;
+    const void *pData = field->pData;
+    usr_pb_ostream_t sizestream = usr_PB_OSTREAM_SIZING;
+    usr_pb_size_t entries;
+
+    if (enc->depth >= usr_PB_ENCODER_MAX_DEPTH ||
+        usr_PB_LTYPE(field->type) != usr_PB_LTYPE_SUBMESSAGE ||
+        usr_PB_ATYPE(field->type) == usr_PB_ATYPE_CALLBACK ||
+        field->submsg_desc == NULL || pData == NULL)
+    {
+        return true;
+    }
+
+    entries = encoder_entries(field);
+    if (entries > 0)
+    {
+        /* Too many entries is reported by encoder_write_unit() */
+        if (usr_PB_ATYPE(field->type) != usr_PB_ATYPE_POINTER && entries > field->array_size)
+            return true;
+
+        pData = (const char*)pData + field->data_size * level->index;
+    }
+    else if (!field_has_value(field))
+    {
+        return true;
+    }
+
+    if (!usr_pb_field_iter_begin_const(&level[1].iter, field->submsg_desc, pData))
+    {
+        /* Message type without fields */
+        return true;
+    }
+
+    if (!usr_pb_encode(&sizestream, field->submsg_desc, pData))
+        usr_PB_RETURN_ERROR(stream, usr_PB_GET_ERROR(&sizestream));
+
+    level[1].index = 0;
+    level[1].size = sizestream.bytes_written;
+    enc->depth++;
+    enc->state = usr_PB_ENCODER_HEADER;
+    return true;
+}
+
+static bool checkreturn encoder_write_unit(usr_pb_ostream_t *stream, usr_pb_encoder_t *enc)
+{
+    usr_pb_encoder_level_t *level = &enc->level[enc->depth];
+    usr_pb_field_iter_t *field = &level->iter;
+    void *pData_orig = field->pData;
+    usr_pb_size_t entries;
+    bool status;
+
+    if (enc->state == usr_PB_ENCODER_PREFIX)
+    {
+        return usr_pb_encode_varint(stream, (usr_pb_uint64_t)enc->size);
+    }
+    else if (enc->state == usr_PB_ENCODER_TERMINATOR)
+    {
+        const usr_pb_byte_t zero = 0;
+        return usr_pb_write(stream, &zero, 1);
+    }
+    else if (enc->state == usr_PB_ENCODER_HEADER)
+    {
+        /* The submessage field is on the level above */
+        return usr_pb_encode_tag(stream, usr_PB_WT_STRING, level[-1].iter.tag) &&
+               usr_pb_encode_varint(stream, (usr_pb_uint64_t)level->size);
+    }
+
+    entries = encoder_entries(field);
+    if (entries > 0 && usr_PB_ATYPE(field->type) != usr_PB_ATYPE_POINTER && entries > field->array_size)
+        usr_PB_RETURN_ERROR(stream, "array max size exceeded");
+
+    if (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_EXTENSION)
+    {
+        status = encode_extension_field(stream, field);
+    }
+    else if (entries > 0)
+    {
+        field->pData = (char*)field->pData + field->data_size * level->index;
+        status = encode_array_entry(stream, field);
+    }
+    else
+    {
+        status = encode_field(stream, field);
+    }
+
+    /* The array encoder moves pData, and stops where the window fills up */
+    field->pData = pData_orig;
+    return status;
+}
+
+static bool checkreturn encoder_next_unit(usr_pb_ostream_t *stream, usr_pb_encoder_t *enc)
+{
+    usr_pb_encoder_level_t *level = &enc->level[enc->depth];
+
+    enc->offset = 0;
+
+    if (enc->state == usr_PB_ENCODER_HEADER)
+    {
+        /* Continue with the first field of the submessage */
+        enc->state = usr_PB_ENCODER_FIELDS;
+        level->start = enc->position;
+        return true;
+    }
+    else if (enc->state == usr_PB_ENCODER_FIELDS)
+    {
+        for (;;)
+        {
+            level->index++;
+            if (level->index < encoder_entries(&level->iter))
+                return true;
+
+            level->index = 0;
+            if (usr_pb_field_iter_next(&level->iter))
+                return true;
+
+            if (enc->depth == 0)
+                break;
+
+            /* End of a submessage, the length written before it must match */
+            if (enc->position - level->start != level->size)
+                usr_PB_RETURN_ERROR(stream, "submsg size changed");
+
+            enc->depth--;
+            level--;
+        }
+    }
+    else if (enc->state == usr_PB_ENCODER_PREFIX)
+    {
+        if (level->iter.descriptor->field_count > 0)
+        {
+            enc->state = usr_PB_ENCODER_FIELDS;
+            return true;
+        }
+    }
+    else
+    {
+        enc->done = true;
+        return true;
+    }
+
+    if ((enc->flags & usr_PB_ENCODE_NULLTERMINATED) != 0)
+        enc->state = usr_PB_ENCODER_TERMINATOR;
+    else
+        enc->done = true;
+
+    return true;
+}
+
+bool checkreturn usr_pb_encoder_start(usr_pb_encoder_t *enc, const usr_pb_msgdesc_t *fields, const void *src_struct, unsigned int flags)
+{
+    enc->level[0].index = 0;
+    enc->depth = 0;
+    enc->offset = 0;
+    enc->position = 0;
+    enc->size = 0;
+    enc->flags = flags;
+    enc->done = false;
+    enc->state = usr_PB_ENCODER_FIELDS;
+#ifndef usr_PB_NO_ERRMSG
+    enc->errmsg = NULL;
+#endif
+
+    if ((flags & usr_PB_ENCODE_DELIMITED) != 0)
+    {
+        usr_pb_ostream_t sizestream = usr_PB_OSTREAM_SIZING;
+
+        if (!usr_pb_encode(&sizestream, fields, src_struct))
+        {
+            enc->state = usr_PB_ENCODER_FAILED;
+            usr_PB_RETURN_ERROR(enc, usr_PB_GET_ERROR(&sizestream));
+        }
+
+        enc->size = sizestream.bytes_written;
+        enc->state = usr_PB_ENCODER_PREFIX;
+        (void)usr_pb_field_iter_begin_const(&enc->level[0].iter, fields, src_struct);
+    }
+    else if (!usr_pb_field_iter_begin_const(&enc->level[0].iter, fields, src_struct))
+    {
+        /* Empty message type */
+        if ((flags & usr_PB_ENCODE_NULLTERMINATED) != 0)
+            enc->state = usr_PB_ENCODER_TERMINATOR;
+        else
+            enc->done = true;
+    }
+
+    return true;
+}
+
+bool checkreturn usr_pb_encoder_write(usr_pb_encoder_t *enc, usr_pb_ostream_t *stream)
+{
+    if (enc->state == usr_PB_ENCODER_FAILED)
+        usr_PB_RETURN_ERROR(stream, "encoder not started");
+
+    while (!enc->done && stream->bytes_written < stream->max_size)
+    {
+        encoder_window_t window;
+        usr_pb_ostream_t substream;
+        bool status;
+
+        window.out = stream;
+        window.skip = enc->offset;
+        window.written = 0;
+        window.full = false;
+
+        substream.callback = &window_write;
+        substream.state = &window;
+        substream.max_size = (size_t)-1;
+        substream.bytes_written = 0;
+#ifndef usr_PB_NO_ERRMSG
+        substream.errmsg = NULL;
+#endif
+
+        if (enc->state == usr_PB_ENCODER_FIELDS && enc->offset == 0)
+            status = encoder_enter_submessage(&substream, enc) && encoder_write_unit(&substream, enc);
+        else
+            status = encoder_write_unit(&substream, enc);
+
+        enc->position += window.written;
+
+        if (status)
+            status = encoder_next_unit(&substream, enc);
+
+        if (!status)
+        {
+            if (window.full)
+            {
+                enc->offset += window.written;
+                return true;
+            }
+
+            enc->state = usr_PB_ENCODER_FAILED;
+#ifndef usr_PB_NO_ERRMSG
+            if (stream->errmsg == NULL)
+                stream->errmsg = substream.errmsg;
+            enc->errmsg = stream->errmsg;
+#endif
+            return false;
+        }
+    }
+
+    return true;
+}
+#endif
+
+/********************
+ * Helper functions *
+ ********************/
+
+/* Encoded size of a varint. The comparisons have no branches, so that
+ * compilers can vectorize the loops in packed_varint_size(). */
+#if !defined(usr_PB_ENCODE_ARRAYS_UNPACKED) || defined(usr_PB_WITHOUT_64BIT)
+static size_t varint_size32(uint32_t value)
+{
+    return 1 + (size_t)(value >= 0x80) + (size_t)(value >= 0x4000) +
+           (size_t)(value >= 0x200000) + (size_t)(value >= 0x10000000);
+}
+#endif
+
+#ifndef usr_PB_WITHOUT_64BIT
+static size_t varint_size64(uint64_t value)
+{
+#ifdef __GNUC__
+    /* Each byte holds 7 bits: (bits * 9 + 64) / 64 rounds bits / 7 up
+     * for all bit counts from 1 to 64. Compiles to lzcnt where available. */
+    return (size_t)(((63 - __builtin_clzll(value | 1)) * 9 + 73) / 64);
+#else
+    return 1 + (size_t)(value >= 0x80) + (size_t)(value >= 0x4000) +
+           (size_t)(value >= 0x200000) + (size_t)(value >= 0x10000000) +
+           (size_t)(value >= ((uint64_t)1 << 35)) + (size_t)(value >= ((uint64_t)1 << 42)) +
+           (size_t)(value >= ((uint64_t)1 << 49)) + (size_t)(value >= ((uint64_t)1 << 56)) +
+           (size_t)(value >= ((uint64_t)1 << 63));
+#endif
+}
+#endif
+
+/* Write a varint to buffer, which must have space for 10 bytes.
+ * Returns the number of bytes written.
+ * This function avoids 64-bit shifts as they are quite slow on many platforms. */
+static size_t write_varint_32(usr_pb_byte_t *buffer, uint32_t low, uint32_t high)
+{
+    size_t i = 0;
+    usr_pb_byte_t byte = (usr_pb_byte_t)(low & 0x7F);
+    low >>= 7;
+
+    while (i < 4 && (low != 0 || high != 0))
+    {
+        byte |= 0x80;
+        buffer[i++] = byte;
+        byte = (usr_pb_byte_t)(low & 0x7F);
+        low >>= 7;
+    }
+
+    if (high)
+    {
+        byte = (usr_pb_byte_t)(byte | ((high & 0x07) << 4));
+        high >>= 3;
+
+        while (high)
+        {
+            byte |= 0x80;
+            buffer[i++] = byte;
+            byte = (usr_pb_byte_t)(high & 0x7F);
+            high >>= 7;
+        }
+    }
+
+    buffer[i++] = byte;
+    return i;
+}
+
+static bool checkreturn usr_pb_encode_varint_32(usr_pb_ostream_t *stream, uint32_t low, uint32_t high)
+{
+    usr_pb_byte_t buffer[10];
+    return usr_pb_write(stream, buffer, write_varint_32(buffer, low, high));
+}
+
+bool checkreturn usr_pb_encode_varint(usr_pb_ostream_t *stream, usr_pb_uint64_t value)
+{
+    if (stream->callback == NULL || usr_PB_OSTREAM_IS_BUFFER(stream))
+    {
+#ifdef usr_PB_WITHOUT_64BIT
+        size_t size = varint_size32(value);
+#else
+        size_t size = varint_size64(value);
+#endif
+
+        if (stream->callback == NULL)
+        {
+            /* Sizing stream */
+            stream->bytes_written += size;
+            return true;
+        }
+
+        if (size <= stream->max_size - stream->bytes_written)
+        {
+            /* Write directly to the memory buffer, without going
+             * through a temporary buffer and the stream callback. */
+            usr_pb_byte_t *dest = (usr_pb_byte_t*)stream->state;
+#ifdef usr_PB_WITHOUT_64BIT
+            (void)write_varint_32(dest, value, 0);
+#else
+            (void)write_varint_32(dest, (uint32_t)value, (uint32_t)(value >> 32));
+#endif
+            stream->state = dest + size;
+            stream->bytes_written += size;
+            return true;
+        }
+
+        /* Fall through to report the error from usr_pb_write() */
+    }
+
+    if (value <= 0x7F)
+    {
+        /* Fast path: single byte */
+        usr_pb_byte_t byte = (usr_pb_byte_t)value;
+        return usr_pb_write(stream, &byte, 1);
+    }
+    else
+    {
+#ifdef usr_PB_WITHOUT_64BIT
+        return usr_pb_encode_varint_32(stream, value, 0);
+#else
+        return usr_pb_encode_varint_32(stream, (uint32_t)value, (uint32_t)(value >> 32));
+#endif
+    }
+}
+
+bool checkreturn usr_pb_encode_svarint(usr_pb_ostream_t *stream, usr_pb_int64_t value)
+{
+    usr_pb_uint64_t zigzagged;
+    if (value < 0)
+        zigzagged = ~((usr_pb_uint64_t)value << 1);
+    else
+        zigzagged = (usr_pb_uint64_t)value << 1;
+    
+    return usr_pb_encode_varint(stream, zigzagged);
+}
+
+bool checkreturn usr_pb_encode_fixed32(usr_pb_ostream_t *stream, const void *value)
+{
+    uint32_t val = *(const uint32_t*)value;
+    usr_pb_byte_t bytes[4];
+    bytes[0] = (usr_pb_byte_t)(val & 0xFF);
     bytes[1] = (usr_pb_byte_t)((val >> 8) & 0xFF);
     bytes[2] = (usr_pb_byte_t)((val >> 16) & 0xFF);
     bytes[3] = (usr_pb_byte_t)((val >> 24) & 0xFF);
@@ -689,6 +1695,8 @@ bool usr_pb_encode_tag_for_field ( usr_pb_ostream_t* stream, const usr_pb_field_
         case usr_PB_LTYPE_SUBMESSAGE:
         case usr_PB_LTYPE_SUBMSG_W_CB:
         case usr_PB_LTYPE_FIXED_LENGTH_BYTES:
+        case usr_PB_LTYPE_VIEW:
+        case usr_PB_LTYPE_STRING_VIEW:
             wiretype = usr_PB_WT_STRING;
             break;
         
@@ -707,13 +1715,114 @@ bool checkreturn usr_pb_encode_string(usr_pb_ostream_t *stream, const usr_pb_byt
     return usr_pb_write(stream, buffer, size);
 }
 
+/* Encode a submessage directly into a memory buffer stream. One byte is
+ * reserved for the length prefix, which is enough for submessages shorter
+ * than 128 bytes. For longer submessages, the already written contents are
+ * moved forward to make room for the full length prefix. Either way, the
+ * submessage is encoded only once. */
+static bool checkreturn encode_submessage_in_place(usr_pb_ostream_t *stream, const usr_pb_msgdesc_t *fields, const void *src_struct)
+{
+    usr_pb_byte_t *start = (usr_pb_byte_t*)stream->state;
+    size_t start_pos = stream->bytes_written;
+    size_t size;
+    size_t prefix_len;
+    
+    if (stream->bytes_written >= stream->max_size)
+        usr_PB_RETURN_ERROR(stream, "stream full");
+    
+    stream->state = start + 1;
+    stream->bytes_written += 1;
+    
+    if (!usr_pb_encode(stream, fields, src_struct))
+        return false;
+    
+    size = stream->bytes_written - start_pos - 1;
+    
+    if (size <= 0x7F)
+    {
+        /* Fast path: the reserved byte fits the length prefix */
+        *start = (usr_pb_byte_t)size;
+        return true;
+    }
+    
+    prefix_len = 1;
+    {
+        usr_pb_uint64_t value = (usr_pb_uint64_t)size;
+        while (value > 0x7F)
+        {
+            value >>= 7;
+            prefix_len++;
+        }
+    }
+    
+    if (stream->max_size - stream->bytes_written < prefix_len - 1)
+        usr_PB_RETURN_ERROR(stream, "stream full");
+    
+    /* Move the contents forward, starting from the end as the areas overlap. */
+    {
+        usr_pb_byte_t *src = start + 1 + size;
+        usr_pb_byte_t *dest = start + prefix_len + size;
+        while (src != start + 1)
+            *--dest = *--src;
+    }
+    
+    /* Write the length prefix in front of the contents */
+    stream->state = start;
+    stream->bytes_written = start_pos;
+    if (!usr_pb_encode_varint(stream, (usr_pb_uint64_t)size))
+        return false;
+    
+    stream->state = (usr_pb_byte_t*)stream->state + size;
+    stream->bytes_written += size;
+    return true;
+}
+
+#ifndef usr_PB_BUFFER_ONLY
+/* Encode a submessage of known size into the buffer of a buffered stream.
+ * The buffer is flushed first if needed. Because the data is written to
+ * memory, any nested submessages are encoded in a single pass.
+ */
+static bool checkreturn encode_submessage_buffered(usr_pb_ostream_t *stream, const usr_pb_msgdesc_t *fields, const void *src_struct, size_t size)
+{
+    usr_pb_ostream_buffer_t *ob = (usr_pb_ostream_buffer_t*)stream->state;
+    usr_pb_ostream_t substream;
+    bool status;
+
+    if (size > ob->size - ob->used)
+    {
+        if (!usr_pb_ostream_flush(stream))
+            return false;
+    }
+
+    substream = usr_pb_ostream_from_buffer(ob->buffer + ob->used, size);
+    status = usr_pb_encode(&substream, fields, src_struct);
+
+    ob->used += substream.bytes_written;
+    stream->bytes_written += substream.bytes_written;
+#ifndef usr_PB_NO_ERRMSG
+    stream->errmsg = substream.errmsg;
+#endif
+
+    if (substream.bytes_written != size)
+        usr_PB_RETURN_ERROR(stream, "submsg size changed");
+
+    return status;
+}
+#endif
+
 bool checkreturn usr_pb_encode_submessage(usr_pb_ostream_t *stream, const usr_pb_msgdesc_t *fields, const void *src_struct)
 {
-    /* First calculate the message size using a non-writing substream. */
     usr_pb_ostream_t substream = usr_PB_OSTREAM_SIZING;
     size_t size;
     bool status;
     
+    if (usr_PB_OSTREAM_IS_BUFFER(stream))
+    {
+        /* Memory buffers can be written in a single pass */
+        return encode_submessage_in_place(stream, fields, src_struct);
+    }
+    
+    /* First calculate the message size using a non-writing substream. */
     if (!usr_pb_encode(&substream, fields, src_struct))
     {
 #ifndef usr_PB_NO_ERRMSG
@@ -732,6 +1841,14 @@ bool checkreturn usr_pb_encode_submessage(usr_pb_ostream_t *stream, const usr_pb
     
     if (stream->bytes_written + size > stream->max_size)
         usr_PB_RETURN_ERROR(stream, "stream full");
+
+#ifndef usr_PB_BUFFER_ONLY
+    if (usr_PB_OSTREAM_IS_BUFFERED(stream) &&
+        size <= ((usr_pb_ostream_buffer_t*)stream->state)->size)
+    {
+        return encode_submessage_buffered(stream, fields, src_struct, size);
+    }
+#endif
         
     /* Use a substream to verify that a callback doesn't write more than
      * what it did the first time. */
@@ -906,28 +2023,36 @@ static bool checkreturn usr_pb_enc_string(usr_pb_ostream_t *stream, const usr_pb
     }
 
 #ifdef usr_PB_VALIDATE_UTF8
-    if (!usr_pb_validate_utf8(str))
+    if (!usr_pb_validate_utf8_len(str, size))
         usr_PB_RETURN_ERROR(stream, "invalid utf8");
 #endif
 
     return usr_pb_encode_string(stream, (const usr_pb_byte_t*)str, size);
 }
 
-static bool checkreturn usr_pb_enc_submessage(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field)
+/* Call the message-level callback of a usr_PB_LTYPE_SUBMSG_W_CB field. */
+static bool checkreturn encode_submsg_callback(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field)
 {
-    if (field->submsg_desc == NULL)
-        usr_PB_RETURN_ERROR(stream, "invalid field descriptor");
-
     if (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_SUBMSG_W_CB && field->pSize != NULL)
     {
         /* Message callback is stored right before pSize. */
         usr_pb_callback_t *callback = (usr_pb_callback_t*)field->pSize - 1;
         if (callback->funcs.encode)
         {
-            if (!callback->funcs.encode(stream, field, &callback->arg))
-                return false;
+            return callback->funcs.encode(stream, field, &callback->arg);
         }
     }
+
+    return true;
+}
+
+static bool checkreturn usr_pb_enc_submessage(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field)
+{
+    if (field->submsg_desc == NULL)
+        usr_PB_RETURN_ERROR(stream, "invalid field descriptor");
+
+    if (!encode_submsg_callback(stream, field))
+        return false;
     
     return usr_pb_encode_submessage(stream, field->submsg_desc, field->pData);
 }
@@ -937,6 +2062,23 @@ static bool checkreturn usr_pb_enc_fixed_length_bytes(usr_pb_ostream_t *stream,
     return usr_pb_encode_string(stream, (const usr_pb_byte_t*)field->pData, (size_t)field->data_size);
 }
 
+static bool checkreturn usr_pb_enc_view(usr_pb_ostream_t *stream, const usr_pb_field_iter_t *field)
+{
+    const usr_pb_view_t *view = (const usr_pb_view_t*)field->pData;
+
+    if (view->ptr == NULL && view->size > 0)
+        usr_PB_RETURN_ERROR(stream, "missing view data");
+
+#ifdef usr_PB_VALIDATE_UTF8
+    if (usr_PB_LTYPE(field->type) == usr_PB_LTYPE_STRING_VIEW &&
+        !usr_pb_validate_utf8_len((const char*)view->ptr, (size_t)view->size))
+        usr_PB_RETURN_ERROR(stream, "invalid utf8");
+#endif
+
+    /* The data is written directly from where the view points to */
+    return usr_pb_encode_string(stream, view->ptr, (size_t)view->size);
+}
+
 #ifdef usr_PB_CONVERT_DOUBLE_FLOAT
 bool usr_pb_encode_float_as_double(usr_pb_ostream_t *stream, float value)
 {
@@ -46,6 +46,59 @@ struct usr_pb_ostream_s
 #endif
 };
 
+#ifndef usr_PB_BUFFER_ONLY
+/* State of a buffered output stream, see usr_pb_ostream_from_buffered().
+ * Small writes are collected in the buffer, and passed to the write
+ * function when the buffer is full or when usr_pb_ostream_flush() is called.
+ *
+ * The write function has the same semantics as write() or send(): it
+ * writes at most count bytes and returns the number of bytes actually
+ * written. It should return 0 only on error.
+ */
+typedef struct usr_pb_ostream_buffer_s usr_pb_ostream_buffer_t;
+struct usr_pb_ostream_buffer_s
+{
+    size_t (*write)(void *state, const usr_pb_byte_t *buf, size_t count);
+    void *state;           /* Free field for use by write implementation */
+    usr_pb_byte_t *buffer;
+    size_t size;           /* Size of the buffer */
+    size_t used;           /* Number of bytes waiting in buffer */
+};
+
+/* Position of a resumable encoder in one message level: the field being
+ * written, and for unpacked arrays the entry. For submessages, also the
+ * payload size from the sizing pass, which is checked when leaving them. */
+typedef struct {
+    usr_pb_field_iter_t iter;     /* Field that is being written */
+    usr_pb_size_t index;          /* Entry of an unpacked array */
+    size_t size;              /* Payload size of a submessage */
+    size_t start;             /* Encoder position where the payload begins */
+} usr_pb_encoder_level_t;
+
+/* State of a resumable encoder, see usr_pb_encoder_write(). The encoder
+ * records its position in the top-level message and in each submessage it
+ * has entered, along with the number of bytes of the current field or
+ * unpacked array entry that have already been written out.
+ */
+typedef struct usr_pb_encoder_s usr_pb_encoder_t;
+struct usr_pb_encoder_s
+{
+    usr_pb_encoder_level_t level[usr_PB_ENCODER_MAX_DEPTH + 1]; /* [0] is the top-level message */
+    uint_least8_t depth;          /* Current level */
+    size_t offset;            /* Bytes of the current field or entry already written */
+    size_t position;          /* Bytes written in total */
+    size_t size;              /* Message size for the length prefix */
+    uint_least8_t state;
+    unsigned int flags;
+
+    bool done;                /* The whole message has been written */
+
+#ifndef usr_PB_NO_ERRMSG
+    const char *errmsg;
+#endif
+};
+#endif
+
 /***************************
  * Main encoding functions *
  ***************************/
@@ -90,6 +143,72 @@ bool usr_pb_encode_ex(usr_pb_ostream_t *stream, const usr_pb_msgdesc_t *fields,
  * the data. */
 bool usr_pb_get_encoded_size(size_t *size, const usr_pb_msgdesc_t *fields, const void *src_struct);
 
+/* Encode the message back-to-front into a memory buffer stream created with
+ * usr_pb_ostream_from_buffer(). The message is placed at the end of the buffer
+ * and *start is set to the offset of its first byte within the buffer.
+ * stream->bytes_written is increased by the message length, but the stream
+ * cannot be written to afterwards.
+ *
+ * Because the fields are written in reverse order, the length of every
+ * submessage and packed array is known before its length prefix is written,
+ * so no sizing pass is needed at any nesting depth. Callback and extension
+ * fields are still encoded twice, first to find their size. The output is
+ * identical to usr_pb_encode().
+ *
+ * Example usage:
+ *    MyMessage msg = {};
+ *    uint8_t buffer[64];
+ *    size_t start;
+ *    usr_pb_ostream_t stream = usr_pb_ostream_from_buffer(buffer, sizeof(buffer));
+ *
+ *    usr_pb_encode_reverse(&stream, MyMessage_fields, &msg, &start);
+ *    fwrite(buffer + start, 1, stream.bytes_written, stdout);
+ */
+bool usr_pb_encode_reverse(usr_pb_ostream_t *stream, const usr_pb_msgdesc_t *fields, const void *src_struct, size_t *start);
+
+#ifndef usr_PB_BUFFER_ONLY
+/*****************************************
+ * Encoding to non-blocking destinations *
+ *****************************************/
+
+/* Start encoding a message with a resumable encoder. The flags are the same
+ * as for usr_pb_encode_ex(). For usr_PB_ENCODE_DELIMITED, the message size is
+ * calculated here. The message must not be modified until the encoder is
+ * done, and callback fields must give the same output every time they are
+ * called.
+ */
+bool usr_pb_encoder_start(usr_pb_encoder_t *enc, const usr_pb_msgdesc_t *fields, const void *src_struct, unsigned int flags);
+
+/* Write as much of the message as fits in the stream, up to its max_size.
+ * A full stream is not an error: the encoder stops where the space ran out
+ * and continues from there on the next call. enc->done is set when the
+ * whole message has been written. Returns false on any failure.
+ *
+ * Each call starts from the beginning of the field or unpacked array entry
+ * where the previous call stopped, and skips over the bytes already written.
+ * Submessages are written field by field, so a call that stops inside one
+ * continues from the same submessage field, up to usr_PB_ENCODER_MAX_DEPTH
+ * levels of nesting. String and bytes data is copied straight from the
+ * message, so large payloads are cheap to resume. Packed arrays, submessages
+ * with callbacks and deeper nested submessages are encoded again from their
+ * start.
+ *
+ * Example usage:
+ *    usr_pb_byte_t buffer[4096];
+ *    usr_pb_encoder_t enc;
+ *
+ *    usr_pb_encoder_start(&enc, MyMessage_fields, &msg, usr_PB_ENCODE_DELIMITED);
+ *    while (!enc.done && wait_writable(fd))
+ *    {
+ *        usr_pb_ostream_t stream = usr_pb_ostream_from_buffer(buffer, sizeof(buffer));
+ *        if (!usr_pb_encoder_write(&enc, &stream))
+ *            return false;
+ *        send(fd, buffer, stream.bytes_written, 0);
+ *    }
+ */
+bool usr_pb_encoder_write(usr_pb_encoder_t *enc, usr_pb_ostream_t *stream);
+#endif
+
 /**************************************
  * Functions for manipulating streams *
  **************************************/
@@ -103,6 +222,38 @@ bool usr_pb_get_encoded_size(size_t *size, const usr_pb_msgdesc_t *fields, const
  */
 usr_pb_ostream_t usr_pb_ostream_from_buffer(usr_pb_byte_t *buf, size_t bufsize);
 
+#ifndef usr_PB_BUFFER_ONLY
+/* Initialize the state of a buffered output stream. The write function
+ * is called with the given state pointer to write out the buffer. */
+void usr_pb_ostream_buffer_init(usr_pb_ostream_buffer_t *ob,
+                            size_t (*write)(void *state, const usr_pb_byte_t *buf, size_t count),
+                            void *state, usr_pb_byte_t *buf, size_t bufsize);
+
+/* Create an output stream that writes to a file, socket or other
+ * destination through a buffer. This is much faster than a custom stream
+ * callback when the destination has a high cost per call. Submessages that
+ * fit in the buffer are encoded directly into it, so that their nested
+ * submessages do not need to be sized again.
+ *
+ * The data is not written out until the buffer is full, so remember to call
+ * usr_pb_ostream_flush() after encoding.
+ *
+ * Example usage:
+ *    usr_pb_byte_t buffer[256];
+ *    usr_pb_ostream_buffer_t ob;
+ *    usr_pb_ostream_t stream;
+ *
+ *    usr_pb_ostream_buffer_init(&ob, &my_send, &socket, buffer, sizeof(buffer));
+ *    stream = usr_pb_ostream_from_buffered(&ob, SIZE_MAX);
+ *    usr_pb_encode(&stream, MyMessage_fields, &msg) && usr_pb_ostream_flush(&stream);
+ */
+usr_pb_ostream_t usr_pb_ostream_from_buffered(usr_pb_ostream_buffer_t *ob, size_t max_size);
+
+/* Write out any data waiting in the buffer of a stream created with
+ * usr_pb_ostream_from_buffered(). For other streams this does nothing. */
+bool usr_pb_ostream_flush(usr_pb_ostream_t *stream);
+#endif
+
 /* Pseudo-stream for measuring the size of a message without actually storing
  * the encoded data.
  * 
@@ -173,8 +324,10 @@ bool usr_pb_encode_float_as_double(usr_pb_ostream_t *stream, float value);
 
 /* Encode a submessage field.
  * You need to pass the usr_pb_field_t array and pointer to struct, just like
- * with usr_pb_encode(). This internally encodes the submessage twice, first to
- * calculate message size and then to actually write it out.
+ * with usr_pb_encode(). For memory buffer streams, the submessage is written
+ * once and the length prefix is filled in afterwards. For other streams, this
+ * internally encodes the submessage twice, first to calculate message size
+ * and then to actually write it out.
  */
 bool usr_pb_encode_submessage(usr_pb_ostream_t *stream, const usr_pb_msgdesc_t *fields, const void *src_struct);
 
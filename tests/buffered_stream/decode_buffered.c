@@ -0,0 +1,147 @@
+/* Decode messages through a buffered input stream, with a read function
+ * that returns only part of the requested data like recv() does. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_decode.h>
+#include <pb_encode.h>
+#include "alltypes.pb.h"
+#include "test_helpers.h"
+#include "unittests.h"
+
+typedef struct {
+    const uint8_t *data;
+    size_t length;
+    size_t pos;
+    size_t chunk;   /* Maximum number of bytes returned per call */
+    int calls;
+} reader_t;
+
+static size_t read_chunk(void *state, pb_byte_t *buf, size_t count)
+{
+    reader_t *reader = (reader_t*)state;
+    size_t n = reader->length - reader->pos;
+
+    if (n > count)
+        n = count;
+    if (n > reader->chunk)
+        n = reader->chunk;
+
+    memcpy(buf, reader->data + reader->pos, n);
+    reader->pos += n;
+    reader->calls++;
+    return n;
+}
+
+static void reader_init(reader_t *reader, const uint8_t *data, size_t length, size_t chunk)
+{
+    reader->data = data;
+    reader->length = length;
+    reader->pos = 0;
+    reader->chunk = chunk;
+    reader->calls = 0;
+}
+
+/* Decode the message and check that it encodes back to the same data */
+static bool decode_and_compare(pb_istream_t *stream, const uint8_t *data, size_t count)
+{
+    AllTypes alltypes;
+    uint8_t buffer[1024];
+    pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+    memset(&alltypes, 0xAA, sizeof(alltypes));
+    alltypes.extensions = 0;
+
+    if (!pb_decode(stream, AllTypes_fields, &alltypes))
+    {
+        fprintf(stderr, "Decode failed: %s\n", PB_GET_ERROR(stream));
+        return false;
+    }
+
+    return pb_encode(&ostream, AllTypes_fields, &alltypes) &&
+           ostream.bytes_written == count &&
+           memcmp(buffer, data, count) == 0;
+}
+
+int main()
+{
+    int status = 0;
+    uint8_t input[1024];
+    size_t count;
+    reader_t reader;
+    pb_byte_t buffer[1024];
+    pb_istream_buffer_t ib;
+    pb_istream_t stream;
+
+    SET_BINARY_MODE(stdin);
+    count = fread(input, 1, sizeof(input), stdin);
+
+    {
+        const size_t bufsizes[] = {1, 7, 64, sizeof(buffer)};
+        const size_t chunks[] = {1, 3, 100, sizeof(input)};
+        size_t i, j;
+
+        COMMENT("Decode with different buffer sizes and read lengths");
+        for (i = 0; i < sizeof(bufsizes) / sizeof(bufsizes[0]); i++)
+        {
+            for (j = 0; j < sizeof(chunks) / sizeof(chunks[0]); j++)
+            {
+                reader_init(&reader, input, count, chunks[j]);
+                pb_istream_buffer_init(&ib, &read_chunk, &reader, buffer, bufsizes[i]);
+                stream = pb_istream_from_buffered(&ib, count);
+
+                if (!decode_and_compare(&stream, input, count) || stream.bytes_left != 0)
+                {
+                    fprintf(stderr, "Failed with bufsize %d, chunk %d\n",
+                            (int)bufsizes[i], (int)chunks[j]);
+                    status = 1;
+                }
+            }
+        }
+
+        /* With a large buffer, the whole message is read at once */
+        TEST(reader.calls == 1);
+    }
+
+    {
+        uint8_t data[2048];
+        pb_ostream_t ostream = pb_ostream_from_buffer(data, sizeof(data));
+        AllTypes alltypes = AllTypes_init_zero;
+        pb_istream_t msgstream = pb_istream_from_buffer(input, count);
+
+        COMMENT("Decode multiple delimited messages from the same buffer");
+        TEST(pb_decode(&msgstream, AllTypes_fields, &alltypes));
+        TEST(pb_encode_ex(&ostream, AllTypes_fields, &alltypes, PB_ENCODE_DELIMITED));
+        TEST(pb_encode_ex(&ostream, AllTypes_fields, &alltypes, PB_ENCODE_DELIMITED));
+
+        reader_init(&reader, data, ostream.bytes_written, 100);
+        pb_istream_buffer_init(&ib, &read_chunk, &reader, buffer, 64);
+        stream = pb_istream_from_buffered(&ib, SIZE_MAX);
+
+        TEST(pb_decode_ex(&stream, AllTypes_fields, &alltypes, PB_DECODE_DELIMITED));
+        TEST(pb_decode_ex(&stream, AllTypes_fields, &alltypes, PB_DECODE_DELIMITED));
+        TEST(!pb_decode_ex(&stream, AllTypes_fields, &alltypes, PB_DECODE_DELIMITED));
+        TEST(stream.bytes_left == 0);
+    }
+
+    {
+        pb_byte_t byte;
+
+        COMMENT("Skip data across buffer refills");
+        reader_init(&reader, input, count, 5);
+        pb_istream_buffer_init(&ib, &read_chunk, &reader, buffer, 16);
+        stream = pb_istream_from_buffered(&ib, count);
+
+        TEST(pb_read(&stream, NULL, 3));
+        TEST(pb_read(&stream, &byte, 1) && byte == input[3]);
+        TEST(pb_read(&stream, NULL, 100));
+        TEST(pb_read(&stream, &byte, 1) && byte == input[104]);
+        TEST(stream.bytes_left == count - 105);
+        TEST(!pb_read(&stream, NULL, count));
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
@@ -0,0 +1,126 @@
+/* Encode messages through a buffered output stream, with a write function
+ * that accepts only part of the data like send() does. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_decode.h>
+#include <pb_encode.h>
+#include "alltypes.pb.h"
+#include "test_helpers.h"
+#include "unittests.h"
+
+typedef struct {
+    uint8_t data[2048];
+    size_t pos;
+    size_t chunk;   /* Maximum number of bytes accepted per call */
+    int calls;
+} writer_t;
+
+static size_t write_chunk(void *state, const pb_byte_t *buf, size_t count)
+{
+    writer_t *writer = (writer_t*)state;
+    size_t n = count;
+
+    if (n > writer->chunk)
+        n = writer->chunk;
+    if (n > sizeof(writer->data) - writer->pos)
+        n = sizeof(writer->data) - writer->pos;
+
+    memcpy(writer->data + writer->pos, buf, n);
+    writer->pos += n;
+    writer->calls++;
+    return n;
+}
+
+static void writer_init(writer_t *writer, size_t chunk)
+{
+    writer->pos = 0;
+    writer->chunk = chunk;
+    writer->calls = 0;
+}
+
+int main()
+{
+    int status = 0;
+    uint8_t input[1024];
+    size_t count;
+    AllTypes alltypes = AllTypes_init_zero;
+    writer_t writer;
+    pb_byte_t buffer[1024];
+    pb_ostream_buffer_t ob;
+    pb_ostream_t stream;
+
+    SET_BINARY_MODE(stdin);
+    count = fread(input, 1, sizeof(input), stdin);
+
+    {
+        pb_istream_t istream = pb_istream_from_buffer(input, count);
+        if (!pb_decode(&istream, AllTypes_fields, &alltypes))
+        {
+            fprintf(stderr, "Decode failed: %s\n", PB_GET_ERROR(&istream));
+            return 1;
+        }
+    }
+
+    {
+        const size_t bufsizes[] = {1, 7, 64, sizeof(buffer)};
+        const size_t chunks[] = {1, 3, 100, sizeof(writer.data)};
+        size_t i, j;
+
+        COMMENT("Encode with different buffer sizes and write lengths");
+        for (i = 0; i < sizeof(bufsizes) / sizeof(bufsizes[0]); i++)
+        {
+            for (j = 0; j < sizeof(chunks) / sizeof(chunks[0]); j++)
+            {
+                writer_init(&writer, chunks[j]);
+                pb_ostream_buffer_init(&ob, &write_chunk, &writer, buffer, bufsizes[i]);
+                stream = pb_ostream_from_buffered(&ob, SIZE_MAX);
+
+                if (!pb_encode(&stream, AllTypes_fields, &alltypes) ||
+                    !pb_ostream_flush(&stream) ||
+                    stream.bytes_written != count ||
+                    writer.pos != count ||
+                    memcmp(writer.data, input, count) != 0)
+                {
+                    fprintf(stderr, "Failed with bufsize %d, chunk %d\n",
+                            (int)bufsizes[i], (int)chunks[j]);
+                    status = 1;
+                }
+            }
+        }
+    }
+
+    {
+        COMMENT("Data is written only when flushed");
+        writer_init(&writer, sizeof(writer.data));
+        pb_ostream_buffer_init(&ob, &write_chunk, &writer, buffer, sizeof(buffer));
+        stream = pb_ostream_from_buffered(&ob, SIZE_MAX);
+
+        TEST(pb_encode_ex(&stream, AllTypes_fields, &alltypes, PB_ENCODE_DELIMITED));
+        TEST(pb_encode_ex(&stream, AllTypes_fields, &alltypes, PB_ENCODE_DELIMITED));
+        TEST(writer.calls == 1 && writer.pos > 0 && writer.pos < stream.bytes_written);
+        TEST(pb_ostream_flush(&stream));
+        TEST(writer.calls == 2 && writer.pos == stream.bytes_written);
+        TEST(pb_ostream_flush(&stream));
+        TEST(writer.calls == 2);
+    }
+
+    {
+        COMMENT("Stream size limit and write errors");
+        writer_init(&writer, sizeof(writer.data));
+        pb_ostream_buffer_init(&ob, &write_chunk, &writer, buffer, sizeof(buffer));
+        stream = pb_ostream_from_buffered(&ob, count - 1);
+        TEST(!pb_encode(&stream, AllTypes_fields, &alltypes));
+
+        writer_init(&writer, 0);
+        pb_ostream_buffer_init(&ob, &write_chunk, &writer, buffer, 16);
+        stream = pb_ostream_from_buffered(&ob, SIZE_MAX);
+        TEST(!pb_encode(&stream, AllTypes_fields, &alltypes));
+        TEST(strcmp(PB_GET_ERROR(&stream), "io error") == 0);
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
@@ -142,6 +142,38 @@ int main()
         TEST(!pb_validate_utf8("a\xef\xbf\xbez"));
     }
 
+    {
+        char buf[100];
+        size_t i;
+        bool all_ok = true;
+
+        COMMENT("Test pb_validate_utf8_len()");
+
+        TEST(pb_validate_utf8_len("abc\xc3\xa4", 5));
+        TEST(!pb_validate_utf8_len("abc\xc3\xa4", 4));
+        TEST(pb_validate_utf8_len("abc\xc3\xa4", 0));
+        TEST(pb_validate_utf8_len("a\0b", 3));
+        TEST(!pb_validate_utf8_len("a\0\xff", 3));
+        TEST(!pb_validate_utf8_len("a\xef\xbf\xbez", 5));
+
+        /* Non-ASCII character at every position of a long string */
+        memset(buf, 'a', sizeof(buf));
+        for (i = 0; i + 1 < sizeof(buf); i++)
+        {
+            buf[i] = '\xc3';
+            buf[i + 1] = '\xa4';
+            if (!pb_validate_utf8_len(buf, sizeof(buf)) || pb_validate_utf8_len(buf, i + 1))
+                all_ok = false;
+
+            buf[i + 1] = 'a';
+            if (pb_validate_utf8_len(buf, sizeof(buf)))
+                all_ok = false;
+
+            buf[i] = 'a';
+        }
+        TEST(all_ok);
+    }
+
     if (status != 0)
         fprintf(stdout, "\n\nSome tests FAILED!\n");
 
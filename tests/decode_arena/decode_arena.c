@@ -0,0 +1,91 @@
+/* Decode pointer fields into an arena, without using the heap. */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pb_decode.h>
+#include <pb_encode.h>
+#include <malloc_wrappers.h>
+#include "alltypes.pb.h"
+#include "test_helpers.h"
+#include "unittests.h"
+
+/* Decode the message into arena and check that it encodes back to the same bytes */
+static bool decode_and_compare(const uint8_t *data, size_t count, pb_arena_t *arena)
+{
+    int status = 0;
+    AllTypes alltypes;
+    uint8_t buffer2[1024];
+    pb_istream_t stream = pb_istream_from_buffer(data, count);
+    pb_ostream_t ostream = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+
+    memset(&alltypes, 0xAA, sizeof(alltypes));
+    alltypes.extensions = 0;
+
+    if (!pb_decode_arena(&stream, AllTypes_fields, &alltypes, 0, arena))
+    {
+        fprintf(stderr, "Decode failed: %s\n", PB_GET_ERROR(&stream));
+        return false;
+    }
+
+    TEST(stream.arena == NULL);
+    TEST(alltypes.req_int32 && *alltypes.req_int32 == -1001);
+    TEST(alltypes.req_string && strcmp(alltypes.req_string, "1014") == 0);
+    TEST(alltypes.rep_int32_count == 5 && alltypes.rep_int32[4] == -2001);
+    TEST(alltypes.rep_submsg_count == 5 && strcmp(alltypes.rep_submsg[4].substuff1, "2016") == 0);
+
+    TEST(pb_encode(&ostream, AllTypes_fields, &alltypes));
+    TEST(ostream.bytes_written == count);
+    TEST(memcmp(data, buffer2, count) == 0);
+
+    return status == 0;
+}
+
+int main(int argc, char **argv)
+{
+    int status = 0;
+    uint8_t buffer[1024];
+    size_t count;
+    void *memory;
+    pb_arena_t arena;
+
+    SET_BINARY_MODE(stdin);
+    count = fread(buffer, 1, sizeof(buffer), stdin);
+
+    memory = malloc(16384);
+    pb_arena_init(&arena, memory, 16384);
+
+    COMMENT("Decode into arena");
+    {
+        size_t used;
+        TEST(decode_and_compare(buffer, count, &arena));
+        TEST(arena.used > 0);
+        used = arena.used;
+
+        /* All allocations were done from the arena */
+        TEST(get_alloc_count() == 0);
+
+        /* After reset, the same memory is used again */
+        pb_arena_reset(&arena);
+        TEST(decode_and_compare(buffer, count, &arena));
+        TEST(arena.used == used);
+    }
+
+    COMMENT("Arena too small");
+    {
+        AllTypes alltypes;
+        pb_istream_t stream = pb_istream_from_buffer(buffer, count);
+        memset(&alltypes, 0, sizeof(alltypes));
+        pb_arena_init(&arena, memory, 64);
+        TEST(!pb_decode_arena(&stream, AllTypes_fields, &alltypes, 0, &arena));
+        TEST(arena.used <= 64);
+        TEST(get_alloc_count() == 0);
+    }
+
+    free(memory);
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
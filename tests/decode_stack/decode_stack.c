@@ -0,0 +1,75 @@
+/* Decode messages with pb_decode_stack(), which keeps the state of
+ * nested submessages in a caller-provided array instead of recursing. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_decode.h>
+#include <pb_encode.h>
+#include "alltypes.pb.h"
+#include "test_helpers.h"
+#include "unittests.h"
+
+/* Check that the message encodes back to the same data */
+static bool compare(const AllTypes *alltypes, const uint8_t *data, size_t count)
+{
+    uint8_t buffer[1024];
+    pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+    return pb_encode(&ostream, AllTypes_fields, alltypes) &&
+           ostream.bytes_written == count &&
+           memcmp(buffer, data, count) == 0;
+}
+
+int main()
+{
+    int status = 0;
+    uint8_t input[1024];
+    size_t count;
+    pb_decoder_frame_t stack[3];
+    pb_istream_t stream;
+    AllTypes alltypes;
+
+    SET_BINARY_MODE(stdin);
+    count = fread(input, 1, sizeof(input), stdin);
+
+    {
+        COMMENT("Decode with frame stack");
+        memset(&alltypes, 0xAA, sizeof(alltypes));
+        alltypes.extensions = 0;
+        stream = pb_istream_from_buffer(input, count);
+
+        if (!pb_decode_stack(&stream, AllTypes_fields, &alltypes, 0, stack, 3))
+        {
+            fprintf(stderr, "Decode failed: %s\n", PB_GET_ERROR(&stream));
+            status = 1;
+        }
+
+        TEST(stream.bytes_left == 0);
+        TEST(compare(&alltypes, input, count));
+    }
+
+    {
+        uint8_t data[2048];
+        pb_ostream_t ostream = pb_ostream_from_buffer(data, sizeof(data));
+
+        COMMENT("Decode multiple delimited messages");
+        TEST(pb_encode_ex(&ostream, AllTypes_fields, &alltypes, PB_ENCODE_DELIMITED));
+        TEST(pb_encode_ex(&ostream, AllTypes_fields, &alltypes, PB_ENCODE_DELIMITED));
+
+        stream = pb_istream_from_buffer(data, ostream.bytes_written);
+        TEST(pb_decode_stack(&stream, AllTypes_fields, &alltypes, PB_DECODE_DELIMITED, stack, 3));
+        TEST(compare(&alltypes, input, count));
+        TEST(pb_decode_stack(&stream, AllTypes_fields, &alltypes, PB_DECODE_DELIMITED, stack, 3));
+        TEST(compare(&alltypes, input, count));
+        TEST(stream.bytes_left == 0);
+    }
+
+    {
+        COMMENT("Submessages need stack frames");
+        stream = pb_istream_from_buffer(input, count);
+        TEST(!pb_decode_stack(&stream, AllTypes_fields, &alltypes, 0, stack, 1));
+        TEST(strcmp(PB_GET_ERROR(&stream), "decoder stack full") == 0);
+    }
+
+    return status;
+}
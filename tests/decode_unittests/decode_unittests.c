@@ -20,6 +20,62 @@ bool stream_callback(pb_istream_t *stream, uint8_t *buf, size_t count)
     return true;
 }
 
+/* Reads from a memory buffer through the callback interface and counts
+ * the calls to the skip callback. */
+typedef struct {
+    const uint8_t *data;
+    int skips;
+} seekable_t;
+
+bool seekable_read(pb_istream_t *stream, uint8_t *buf, size_t count)
+{
+    seekable_t *source = (seekable_t*)stream->state;
+    memcpy(buf, source->data, count);
+    source->data += count;
+    return true;
+}
+
+bool seekable_skip(pb_istream_t *stream, size_t count)
+{
+    seekable_t *source = (seekable_t*)stream->state;
+    if (count > 100)
+        return false; /* Simulate error */
+
+    source->data += count;
+    source->skips++;
+    return true;
+}
+
+/* Validates a message that is read through the stream callback */
+bool validate_callback(const uint8_t *data, size_t len, const pb_msgdesc_t *fields)
+{
+    seekable_t source;
+    pb_istream_t stream = {&seekable_read, NULL, 0};
+
+    source.data = data;
+    source.skips = 0;
+    stream.state = &source;
+    stream.bytes_left = len;
+    return pb_validate(&stream, fields);
+}
+
+/* Passes the data to a resumable decoder in chunks of the given size */
+bool feed_chunks(pb_decoder_t *dec, const uint8_t *data, size_t len, size_t chunk)
+{
+    while (len > 0)
+    {
+        size_t n = (len < chunk) ? len : chunk;
+        if (!pb_decoder_feed(dec, data, n))
+            return false;
+        data += n;
+        len -= n;
+    }
+
+    return pb_decoder_finish(dec);
+}
+
+#define FEED(dec, x, chunk) feed_chunks(dec, (const uint8_t*)x, sizeof(x) - 1, chunk)
+
 /* Verifies that the stream passed to callback matches the byte array pointed to by arg. */
 bool callback_check(pb_istream_t *stream, const pb_field_t *field, void **arg)
 {
@@ -39,6 +95,21 @@ bool callback_check(pb_istream_t *stream, const pb_field_t *field, void **arg)
     return true;
 }
 
+/* Append a varint to the buffer, for building test data */
+static size_t put_varint(uint8_t *buf, size_t pos, uint64_t value)
+{
+    do
+    {
+        buf[pos] = (uint8_t)(value & 0x7F);
+        value >>= 7;
+        if (value)
+            buf[pos] |= 0x80;
+        pos++;
+    } while (value);
+
+    return pos;
+}
+
 int main()
 {
     int status = 0;
@@ -72,6 +143,43 @@ int main()
         TEST(pb_read(&stream, buffer, 15))
     }
 
+    {
+        uint8_t buffer[] = "foobartest1234";
+        uint8_t byte;
+        seekable_t source;
+        pb_istream_t stream = {&seekable_read, NULL, 14};
+        stream.state = &source;
+        stream.skip = &seekable_skip;
+        source.data = buffer;
+        source.skips = 0;
+
+        COMMENT("Test pb_read with skip callback");
+        TEST(pb_read(&stream, NULL, 6))
+        TEST(source.skips == 1 && stream.bytes_left == 8)
+        TEST(pb_read(&stream, &byte, 1) && byte == 't')
+        TEST(!pb_read(&stream, NULL, 8))
+        TEST(source.skips == 1 && stream.bytes_left == 7)
+        TEST(pb_read(&stream, NULL, 7) && stream.bytes_left == 0)
+        stream.bytes_left = 1000;
+        TEST(!pb_read(&stream, NULL, 500)) /* Simulated error return from skip */
+    }
+
+    {
+        uint8_t buffer[] = "\x1A\x04test\x19\x00\x00\x00\x00\x00\x00\x00\x00\x08\x01\x18\x0F";
+        seekable_t source;
+        IntegerArray dest;
+        pb_istream_t stream = {&seekable_read, NULL, sizeof(buffer) - 1};
+        stream.state = &source;
+        stream.skip = &seekable_skip;
+        source.data = buffer;
+        source.skips = 0;
+
+        COMMENT("Test skipping unknown fields with skip callback");
+        TEST(pb_decode(&stream, IntegerArray_fields, &dest))
+        TEST(dest.data_count == 1 && dest.data[0] == 1)
+        TEST(source.skips == 2 && stream.bytes_left == 0)
+    }
+
     {
         pb_istream_t s;
         uint64_t u;
@@ -107,6 +215,30 @@ int main()
         TEST((s = S("\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x80\x00"), !pb_decode_varint32(&s, &u)));
     }
 
+    {
+        pb_istream_t s;
+        uint64_t u;
+        uint32_t u32;
+
+        /* At least 10 bytes in buffer uses the direct pointer access */
+        COMMENT("Test varint decoding from long buffer");
+        TEST((s = S("\x01""123456789"), pb_decode_varint(&s, &u) && u == 1 && s.bytes_left == 9));
+        TEST((s = S("\xAC\x02""123456789"), pb_decode_varint(&s, &u) && u == 300 && s.bytes_left == 9));
+        TEST((s = S("\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x01""1"),
+              pb_decode_varint(&s, &u) && u == UINT64_MAX && s.bytes_left == 1));
+        TEST((s = S("\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x01"), !pb_decode_varint(&s, &u)));
+
+        TEST((s = S("\x01""123456789"), pb_decode_varint32(&s, &u32) && u32 == 1 && s.bytes_left == 9));
+        TEST((s = S("\xAC\x02""123456789"), pb_decode_varint32(&s, &u32) && u32 == 300 && s.bytes_left == 9));
+        TEST((s = S("\xFF\xFF\xFF\xFF\x0F""12345"), pb_decode_varint32(&s, &u32) && u32 == UINT32_MAX && s.bytes_left == 5));
+        TEST((s = S("\xFF\xFF\xFF\xFF\x8F\x00""1234"), pb_decode_varint32(&s, &u32) && u32 == UINT32_MAX && s.bytes_left == 4));
+        TEST((s = S("\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x01"), pb_decode_varint32(&s, &u32) && u32 == UINT32_MAX && s.bytes_left == 0));
+        TEST((s = S("\xFF\xFF\xFF\xFF\x10""12345"), !pb_decode_varint32(&s, &u32)));
+        TEST((s = S("\xFF\xFF\xFF\xFF\xFF\x01""1234"), !pb_decode_varint32(&s, &u32)));
+        TEST((s = S("\xFF\xFF\xFF\xFF\x87\xFF\xFF\xFF\xFF\x01"), !pb_decode_varint32(&s, &u32)));
+        TEST((s = S("\x80\x80\x80\x80\x80\x80\x80\x80\x80\x80\x00"), !pb_decode_varint32(&s, &u32)));
+    }
+
     {
         pb_istream_t s;
         COMMENT("Test pb_skip_varint");
@@ -331,6 +463,87 @@ int main()
         TEST((s = S("\x0A\x01"), !pb_decode(&s, IntegerArray_fields, &dest)))
     }
 
+    {
+        pb_istream_t s;
+        FloatArray dest;
+
+        COMMENT("Testing pb_decode with packed float field")
+        TEST((s = S("\x0A\x08\x00\x00\x80\x3F\x00\x00\x00\xC0"), pb_decode(&s, FloatArray_fields, &dest)
+            && dest.data_count == 2 && dest.data[0] == 1.0f && dest.data[1] == -2.0f))
+        TEST((s = S("\x0D\x00\x00\x80\x3F\x0A\x04\x00\x00\x00\xC0"), pb_decode(&s, FloatArray_fields, &dest)
+            && dest.data_count == 2 && dest.data[0] == 1.0f && dest.data[1] == -2.0f))
+        TEST((s = S("\x0A\x28"
+                    "\x00\x00\x80\x3F\x00\x00\x80\x3F\x00\x00\x80\x3F\x00\x00\x80\x3F\x00\x00\x80\x3F"
+                    "\x00\x00\x80\x3F\x00\x00\x80\x3F\x00\x00\x80\x3F\x00\x00\x80\x3F\x00\x00\x00\xC0"),
+              pb_decode(&s, FloatArray_fields, &dest) && dest.data_count == 10 && dest.data[9] == -2.0f))
+        TEST((s = S("\x0D\x00\x00\x80\x3F\x0A\x28"
+                    "\x00\x00\x80\x3F\x00\x00\x80\x3F\x00\x00\x80\x3F\x00\x00\x80\x3F\x00\x00\x80\x3F"
+                    "\x00\x00\x80\x3F\x00\x00\x80\x3F\x00\x00\x80\x3F\x00\x00\x80\x3F\x00\x00\x00\xC0"),
+              !pb_decode(&s, FloatArray_fields, &dest) && strcmp(s.errmsg, "array overflow") == 0))
+
+        /* Test invalid wire data */
+        TEST((s = S("\x0A\x06\x00\x00\x80\x3F\x00\x00"), !pb_decode(&s, FloatArray_fields, &dest)))
+        TEST((s = S("\x0A\x08\x00\x00\x80\x3F"), !pb_decode(&s, FloatArray_fields, &dest)))
+    }
+
+    {
+        pb_istream_t s;
+        PackedVarints dest;
+        uint8_t buf[512];
+        size_t len, i;
+        bool ok;
+
+        COMMENT("Testing pb_decode with long packed varint arrays")
+
+        /* Single-byte values first, then a mix of lengths */
+        len = 3;
+        for (i = 0; i < 64; i++)
+            len = put_varint(buf, len, (uint64_t)(int64_t)(i < 40 ? (int)i : (int)(i * 1000) - 50000));
+        buf[0] = 0x0A;
+        buf[1] = (uint8_t)((len - 3) | 0x80);
+        buf[2] = (uint8_t)((len - 3) >> 7);
+        s = pb_istream_from_buffer(buf, len);
+        ok = pb_decode(&s, PackedVarints_fields, &dest) && dest.i32_count == 64;
+        for (i = 0; ok && i < 64; i++)
+            ok = (dest.i32[i] == (i < 40 ? (int)i : (int)(i * 1000) - 50000));
+        TEST(ok)
+
+        /* ZigZag encoded values, alternating in sign */
+        len = 3;
+        for (i = 0; i < 64; i++)
+        {
+            int64_t value = (i & 1) ? -(int64_t)i : ((int64_t)i << (i & 31));
+            len = put_varint(buf, len, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+        }
+        buf[0] = 0x12;
+        buf[1] = (uint8_t)((len - 3) | 0x80);
+        buf[2] = (uint8_t)((len - 3) >> 7);
+        s = pb_istream_from_buffer(buf, len);
+        ok = pb_decode(&s, PackedVarints_fields, &dest) && dest.s64_count == 64;
+        for (i = 0; ok && i < 64; i++)
+            ok = (dest.s64[i] == ((i & 1) ? -(int64_t)i : ((int64_t)i << (i & 31))));
+        TEST(ok)
+
+        /* Range checks for 8-bit fields */
+        len = 2;
+        for (i = 0; i < 40; i++)
+            len = put_varint(buf, len, i * 6);
+        buf[0] = 0x1A;
+        buf[1] = (uint8_t)(len - 2);
+        TEST((s = pb_istream_from_buffer(buf, len), pb_decode(&s, PackedVarints_fields, &dest))
+             && dest.u8_count == 40 && dest.u8[39] == 234)
+        len = put_varint(buf, 2 + 20, 300);
+        buf[1] = (uint8_t)(len - 2);
+        TEST((s = pb_istream_from_buffer(buf, len), !pb_decode(&s, PackedVarints_fields, &dest)))
+
+        /* Varint longer than 10 bytes */
+        memset(buf + 2, 0x80, 11);
+        memset(buf + 13, 0x01, 20);
+        buf[0] = 0x0A;
+        buf[1] = 31;
+        TEST((s = pb_istream_from_buffer(buf, 33), !pb_decode(&s, PackedVarints_fields, &dest)))
+    }
+
     {
         pb_istream_t s;
         IntegerArray dest;
@@ -417,6 +630,389 @@ int main()
               dest.submsg.data_count == 5)
     }
 
+    {
+        pb_decoder_frame_t stack[2];
+        pb_decoder_t dec;
+        IntegerArray dest;
+        StringMessage str;
+        BytesMessage bytes;
+
+        pb_decoder_init(&dec, stack, 2, NULL, 0);
+
+        COMMENT("Testing pb_decoder_feed with values split between chunks")
+        TEST(pb_decoder_start(&dec, IntegerArray_fields, &dest, 0) &&
+             FEED(&dec, "\x08\xAC\x02\x08\x01", 1) && dest.data_count == 2 && dest.data[0] == 300)
+        TEST(pb_decoder_start(&dec, IntegerArray_fields, &dest, 0) &&
+             FEED(&dec, "\x0A\x0A\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0A", 1)
+             && dest.data_count == 10 && dest.data[0] == 1 && dest.data[9] == 10)
+        TEST(pb_decoder_start(&dec, IntegerArray_fields, &dest, 0) &&
+             FEED(&dec, "\x0A\x04\xAC\x02\xAC\x02\x18\x0F\x1A\x02xx", 3)
+             && dest.data_count == 2 && dest.data[1] == 300)
+        TEST(pb_decoder_start(&dec, StringMessage_fields, &str, 0) &&
+             FEED(&dec, "\x0A\x04test", 2) && strcmp(str.data, "test") == 0)
+        TEST(pb_decoder_start(&dec, BytesMessage_fields, &bytes, 0) &&
+             FEED(&dec, "\x0A\x03\x01\x02\x03", 1) && bytes.data.size == 3 && bytes.data.bytes[2] == 3)
+
+        /* Invalid or incomplete data */
+        TEST(pb_decoder_start(&dec, IntegerArray_fields, &dest, 0) && !FEED(&dec, "\x08", 1))
+        TEST(pb_decoder_start(&dec, IntegerArray_fields, &dest, 0) && !FEED(&dec, "\x0A\x02\x01", 1))
+        TEST(pb_decoder_start(&dec, IntegerArray_fields, &dest, 0) &&
+             !FEED(&dec, "\x0A\x0B\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0A\x0B", 5))
+        TEST(pb_decoder_start(&dec, StringMessage_fields, &str, 0) && !FEED(&dec, "", 1))
+        TEST(pb_decoder_start(&dec, StringMessage_fields, &str, 0) &&
+             !FEED(&dec, "\x0A\x0Btesttesttes", 4) && strcmp(dec.errmsg, "string overflow") == 0)
+        TEST(!pb_decoder_feed(&dec, (const uint8_t*)"\x08\x01", 2))
+    }
+
+    {
+        pb_decoder_frame_t stack[2];
+        pb_decoder_t dec;
+        IntegerContainer dest;
+        IntegerArray array;
+
+        COMMENT("Testing pb_decoder_feed with delimited messages")
+        pb_decoder_init(&dec, stack, 2, NULL, 0);
+        TEST(pb_decoder_start(&dec, IntegerContainer_fields, &dest, PB_DECODE_DELIMITED) &&
+             pb_decoder_feed(&dec, (const uint8_t*)"\x09\x0A\x07\x0A\x05\x01\x02\x03\x04\x05\x02\x08\x01", 13)
+             && dec.done && dec.consumed == 10 && dest.submsg.data_count == 5)
+        TEST(pb_decoder_start(&dec, IntegerArray_fields, &array, PB_DECODE_DELIMITED) &&
+             pb_decoder_feed(&dec, (const uint8_t*)"\x02\x08", 2) && !dec.done &&
+             pb_decoder_feed(&dec, (const uint8_t*)"\x01\x02", 2) && dec.done && dec.consumed == 1 &&
+             pb_decoder_finish(&dec) && array.data_count == 1)
+        TEST(pb_decoder_start(&dec, IntegerArray_fields, &array, PB_DECODE_NULLTERMINATED) &&
+             pb_decoder_feed(&dec, (const uint8_t*)"\x08\x01\x00\x08", 4) && dec.done && dec.consumed == 3)
+
+        /* Submessage longer than its parent */
+        TEST(pb_decoder_start(&dec, IntegerContainer_fields, &dest, PB_DECODE_DELIMITED) &&
+             !FEED(&dec, "\x03\x0A\x07\x0A\x05\x01\x02\x03\x04\x05", 1))
+
+        /* Not enough stack frames for the submessage */
+        pb_decoder_init(&dec, stack, 1, NULL, 0);
+        TEST(pb_decoder_start(&dec, IntegerContainer_fields, &dest, 0) &&
+             !FEED(&dec, "\x0A\x07\x0A\x05\x01\x02\x03\x04\x05", 100)
+             && strcmp(dec.errmsg, "decoder stack full") == 0)
+    }
+
+    {
+        pb_decoder_frame_t stack[1];
+        pb_decoder_t dec;
+        uint8_t buffer[8];
+        CallbackArray dest;
+        struct { pb_size_t size; uint8_t bytes[10]; } ref;
+        dest.data.funcs.decode = &callback_check;
+        dest.data.arg = &ref;
+        ref.size = 3; ref.bytes[0] = ref.bytes[1] = ref.bytes[2] = 0x55;
+
+        COMMENT("Testing pb_decoder_feed with callbacks")
+        /* Field within one chunk is decoded without the buffer */
+        pb_decoder_init(&dec, stack, 1, NULL, 0);
+        TEST(pb_decoder_start(&dec, CallbackArray_fields, &dest, PB_DECODE_NOINIT) &&
+             FEED(&dec, "\x0A\x03\x55\x55\x55", 5))
+        TEST(pb_decoder_start(&dec, CallbackArray_fields, &dest, PB_DECODE_NOINIT) &&
+             !FEED(&dec, "\x0A\x03\x55\x55\x55", 2) && strcmp(dec.errmsg, "field too large for buffer") == 0)
+
+        /* Split field is collected into the buffer */
+        pb_decoder_init(&dec, stack, 1, buffer, sizeof(buffer));
+        TEST(pb_decoder_start(&dec, CallbackArray_fields, &dest, PB_DECODE_NOINIT) &&
+             FEED(&dec, "\x0A\x03\x55\x55\x55", 1))
+        ref.size = 1; ref.bytes[0] = 0x55;
+        TEST(pb_decoder_start(&dec, CallbackArray_fields, &dest, PB_DECODE_NOINIT) &&
+             FEED(&dec, "\x08\x55", 1))
+        TEST(pb_decoder_start(&dec, CallbackArray_fields, &dest, PB_DECODE_NOINIT) &&
+             !FEED(&dec, "\x08\x56", 1))
+    }
+
+    {
+        pb_istream_t s;
+        pb_decoder_frame_t stack[4];
+        IntegerContainer dest;
+        RecursiveMessage rec;
+        uint8_t buf[16];
+        size_t i;
+
+        COMMENT("Testing pb_decode_stack")
+        TEST((s = S("\x0A\x07\x0A\x05\x01\x02\x03\x04\x05"),
+              pb_decode_stack(&s, IntegerContainer_fields, &dest, 0, stack, 2)) &&
+              dest.submsg.data_count == 5 && dest.submsg.data[4] == 5)
+        TEST((s = S("\x09\x0A\x07\x0A\x05\x01\x02\x03\x04\x05"),
+              pb_decode_stack(&s, IntegerContainer_fields, &dest, PB_DECODE_DELIMITED, stack, 2)) &&
+              dest.submsg.data_count == 5)
+        TEST((s = S("\x0A\x07\x0A\x05\x01\x02\x03\x04\x05"),
+              !pb_decode_stack(&s, IntegerContainer_fields, &dest, 0, stack, 1) &&
+              strcmp(s.errmsg, "decoder stack full") == 0))
+        TEST((s = S("\x0A\x07\x0A\x05\x01\x02\x03\x04\x05"),
+              !pb_decode_stack(&s, IntegerContainer_fields, &dest, 0, stack, 0)))
+        TEST((s = S("\x0A\x0A\x0A\x05\x01\x02\x03\x04\x05"),
+              !pb_decode_stack(&s, IntegerContainer_fields, &dest, 0, stack, 2) &&
+              strcmp(s.errmsg, "parent stream too short") == 0))
+        TEST((s = S(""), !pb_decode_stack(&s, IntegerContainer_fields, &dest, 0, stack, 2) &&
+              strcmp(s.errmsg, "missing required field") == 0))
+
+        /* Pointer submessages nested three levels deep */
+        for (i = 0; i < 6; i += 2)
+        {
+            buf[i] = 0x0A;
+            buf[i + 1] = (uint8_t)(4 - i);
+        }
+        memset(&rec, 0, sizeof(rec));
+        TEST((s = pb_istream_from_buffer(buf, 6), pb_decode_stack(&s, RecursiveMessage_fields, &rec, 0, stack, 4)) &&
+             rec.child && rec.child->child && rec.child->child->child && !rec.child->child->child->child)
+        pb_release(RecursiveMessage_fields, &rec);
+        TEST((s = pb_istream_from_buffer(buf, 6), !pb_decode_stack(&s, RecursiveMessage_fields, &rec, 0, stack, 3)) &&
+             rec.child == NULL)
+    }
+
+    {
+        /* Field 1 varint, field 2 submessage {1: fixed32, 3: {2: "ab"}}, field 4 varint */
+        const uint8_t msg[] = "\x08\x96\x01\x12\x0B\x0D\x01\x02\x03\x04\x1A\x04\x12\x02\x61\x62\x20\x05";
+        const uint32_t path[] = {2, 3, 2};
+        const uint32_t badpath[] = {1, 3};
+        const uint32_t nopath[] = {3};
+        pb_istream_t value;
+        uint32_t u;
+
+        COMMENT("Testing pb_peek_field")
+        TEST(pb_peek_field(msg, sizeof(msg) - 1, path, 1, &value) && value.bytes_left == 11)
+        TEST(pb_peek_field(msg, sizeof(msg) - 1, path, 2, &value) && value.bytes_left == 4)
+        TEST(pb_peek_field(msg, sizeof(msg) - 1, path, 3, &value) && value.bytes_left == 2 &&
+             memcmp(value.state, "ab", 2) == 0)
+        TEST(pb_peek_field(msg, sizeof(msg) - 1, badpath, 1, &value) && value.bytes_left == 2 &&
+             pb_decode_varint32(&value, &u) && u == 150)
+
+        {
+            const uint32_t fixedpath[] = {2, 1};
+            const uint32_t lastpath[] = {4};
+            TEST(pb_peek_field(msg, sizeof(msg) - 1, fixedpath, 2, &value) &&
+                 pb_decode_fixed32(&value, &u) && u == 0x04030201)
+            TEST(pb_peek_field(msg, sizeof(msg) - 1, lastpath, 1, &value) &&
+                 pb_decode_varint32(&value, &u) && u == 5)
+        }
+
+        TEST(!pb_peek_field(msg, sizeof(msg) - 1, badpath, 2, &value) &&
+             strcmp(value.errmsg, "wrong wire type") == 0)
+        TEST(!pb_peek_field(msg, sizeof(msg) - 1, nopath, 1, &value) &&
+             strcmp(value.errmsg, "field not found") == 0)
+        TEST(!pb_peek_field(msg, 6, path, 2, &value) &&
+             strcmp(value.errmsg, "parent stream too short") == 0)
+    }
+
+    {
+        /* Field 2 three times: {1: fixed32}, {3: {2: "ab"}}, {1: fixed32},
+         * with field 4 varint between and after them */
+        const uint8_t msg[] = "\x12\x05\x0D\x01\x02\x03\x04\x12\x06\x1A\x04\x12\x02\x61\x62"
+                              "\x20\x05\x12\x05\x0D\x05\x06\x07\x08\x20\x06";
+        const uint32_t path[] = {2, 3, 2};
+        const uint32_t fixedpath[] = {2, 1};
+        const uint32_t varintpath[] = {4};
+        pb_istream_t value;
+        uint32_t u;
+
+        COMMENT("Testing pb_peek_field with repeated occurrences")
+        TEST(pb_peek_field(msg, sizeof(msg) - 1, fixedpath, 2, &value) &&
+             pb_decode_fixed32(&value, &u) && u == 0x08070605)
+        TEST(pb_peek_field(msg, sizeof(msg) - 1, path, 3, &value) && value.bytes_left == 2 &&
+             memcmp(value.state, "ab", 2) == 0)
+        TEST(pb_peek_field(msg, sizeof(msg) - 1, varintpath, 1, &value) &&
+             pb_decode_varint32(&value, &u) && u == 6)
+        TEST(!pb_peek_field(msg, sizeof(msg) - 2, varintpath, 1, &value) &&
+             strcmp(value.errmsg, "end-of-stream") == 0)
+    }
+
+    {
+        /* Field 1 varint, field 2 submessage {1: fixed32, 3: {2: "ab"}}, field 4 varint */
+        const uint8_t msg[] = "\x08\x96\x01\x12\x0B\x0D\x01\x02\x03\x04\x1A\x04\x12\x02\x61\x62\x20\x05";
+        const uint32_t path[] = {2, 3, 2};
+        const uint32_t fixedpath[] = {2, 1};
+        const uint32_t varintpath[] = {1};
+        uint8_t buf[256];
+        uint8_t longstr[200];
+        size_t len = sizeof(msg) - 1;
+        pb_istream_t value;
+        uint32_t u;
+
+        memcpy(buf, msg, len);
+        memset(longstr, 'x', sizeof(longstr));
+
+        COMMENT("Testing pb_patch_field")
+        TEST(pb_patch_field(buf, &len, sizeof(buf), fixedpath, 2, (const uint8_t*)"\x05\x06\x07\x08", 4) &&
+             len == sizeof(msg) - 1 && memcmp(buf + 6, "\x05\x06\x07\x08", 4) == 0)
+        TEST(!pb_patch_field(buf, &len, sizeof(buf), fixedpath, 2, (const uint8_t*)"\x05\x06", 2))
+        TEST(!pb_patch_field(buf, &len, sizeof(buf), varintpath, 1, (const uint8_t*)"\x80", 1))
+
+        /* Shorter varint moves the rest of the message */
+        TEST(pb_patch_field(buf, &len, sizeof(buf), varintpath, 1, (const uint8_t*)"\x07", 1) &&
+             len == sizeof(msg) - 2 && memcmp(buf, "\x08\x07\x12\x0B", 4) == 0)
+
+        /* Longer string grows all the enclosing length prefixes */
+        TEST(pb_patch_field(buf, &len, sizeof(buf), path, 3, longstr, sizeof(longstr)) &&
+             len == sizeof(msg) - 2 + 198 + 3)
+        TEST(pb_peek_field(buf, len, path, 3, &value) && value.bytes_left == sizeof(longstr) &&
+             memcmp(value.state, longstr, sizeof(longstr)) == 0)
+        TEST(pb_peek_field(buf, len, fixedpath, 2, &value) &&
+             pb_decode_fixed32(&value, &u) && u == 0x08070605)
+        TEST(pb_peek_field(buf, len, fixedpath + 1, 1, &value) && pb_decode_varint32(&value, &u) && u == 7)
+
+        /* And shrinking it restores the original message */
+        TEST(pb_patch_field(buf, &len, sizeof(buf), path, 3, (const uint8_t*)"ab", 2) &&
+             len == sizeof(msg) - 2)
+        TEST(pb_patch_field(buf, &len, sizeof(buf), varintpath, 1, (const uint8_t*)"\x96\x01", 2) &&
+             pb_patch_field(buf, &len, sizeof(buf), fixedpath, 2, (const uint8_t*)"\x01\x02\x03\x04", 4) &&
+             len == sizeof(msg) - 1 && memcmp(buf, msg, len) == 0)
+
+        /* Message is left unchanged if the result does not fit */
+        TEST(!pb_patch_field(buf, &len, len + 197, path, 3, longstr, sizeof(longstr)) &&
+             len == sizeof(msg) - 1 && memcmp(buf, msg, len) == 0)
+    }
+
+    {
+        /* Field 2 three times: {1: fixed32}, {3: {2: "ab"}}, {1: fixed32},
+         * with field 4 varint between and after them */
+        const uint8_t msg[] = "\x12\x05\x0D\x01\x02\x03\x04\x12\x06\x1A\x04\x12\x02\x61\x62"
+                              "\x20\x05\x12\x05\x0D\x05\x06\x07\x08\x20\x06";
+        const uint32_t path[] = {2, 3, 2};
+        const uint32_t fixedpath[] = {2, 1};
+        const uint32_t varintpath[] = {4};
+        uint8_t buf[64];
+        size_t len = sizeof(msg) - 1;
+        pb_istream_t value;
+        uint32_t u;
+
+        memcpy(buf, msg, len);
+
+        COMMENT("Testing pb_patch_field with repeated occurrences")
+        TEST(pb_patch_field(buf, &len, sizeof(buf), fixedpath, 2, (const uint8_t*)"\x09\x09\x09\x09", 4) &&
+             memcmp(buf, msg, 20) == 0 && memcmp(buf + 20, "\x09\x09\x09\x09\x20\x06", 6) == 0)
+        TEST(pb_patch_field(buf, &len, sizeof(buf), varintpath, 1, (const uint8_t*)"\x96\x01", 2) &&
+             len == sizeof(msg) && memcmp(buf + 15, "\x20\x05", 2) == 0 &&
+             memcmp(buf + 24, "\x20\x96\x01", 3) == 0)
+
+        /* The middle occurrence of field 2 is the one that contains field 3 */
+        TEST(pb_patch_field(buf, &len, sizeof(buf), path, 3, (const uint8_t*)"xyz", 3) &&
+             len == sizeof(msg) + 1 && memcmp(buf + 7, "\x12\x07\x1A\x05\x12\x03xyz", 9) == 0)
+        TEST(pb_peek_field(buf, len, fixedpath, 2, &value) &&
+             pb_decode_fixed32(&value, &u) && u == 0x09090909)
+    }
+
+    {
+        pb_istream_t s;
+        uint8_t buf[128];
+        size_t i;
+
+        COMMENT("Testing pb_validate")
+        TEST((s = S("\x08\x01\x08\x02"), pb_validate(&s, IntegerArray_fields)))
+        TEST((s = S("\x0A\x03\x01\x02\x03"), pb_validate(&s, IntegerArray_fields)))
+        TEST((s = S("\x0D\x01\x02\x03\x04"), !pb_validate(&s, IntegerArray_fields) &&
+              strcmp(s.errmsg, "wrong wire type") == 0))
+        TEST((s = S("\x08\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x01"), !pb_validate(&s, IntegerArray_fields)))
+        TEST((s = S("\x0A\x0A\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0A"), pb_validate(&s, IntegerArray_fields)))
+        TEST((s = S("\x0A\x0B\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0A\x0B"), !pb_validate(&s, IntegerArray_fields) &&
+              strcmp(s.errmsg, "array overflow") == 0))
+
+        /* Entries are counted over all runs of the field */
+        TEST((s = S("\x0A\x05\x01\x02\x03\x04\x05\x08\x06\x0A\x04\x07\x08\x09\x0A"), pb_validate(&s, IntegerArray_fields)))
+        TEST((s = S("\x0A\x05\x01\x02\x03\x04\x05\x08\x06\x0A\x05\x07\x08\x09\x0A\x0B"), !pb_validate(&s, IntegerArray_fields) &&
+              strcmp(s.errmsg, "array overflow") == 0))
+
+        TEST((s = S("\x0A\x02\x61\x62"), pb_validate(&s, StringMessage_fields)))
+        TEST((s = S("\x0A\x0A\x61\x62\x63\x64\x65\x66\x67\x68\x69\x6A"), pb_validate(&s, StringMessage_fields)))
+        TEST((s = S("\x0A\x0B\x61\x62\x63\x64\x65\x66\x67\x68\x69\x6A\x6B"), !pb_validate(&s, StringMessage_fields) &&
+              strcmp(s.errmsg, "string overflow") == 0))
+        TEST((s = S("\x0A\x01\x61\x10\x05"), pb_validate(&s, StringMessage_fields)))
+        TEST((s = S(""), !pb_validate(&s, StringMessage_fields) &&
+              strcmp(s.errmsg, "missing required field") == 0))
+        TEST((s = S("\x0A\x05\x61\x62"), !pb_validate(&s, StringMessage_fields) &&
+              strcmp(s.errmsg, "end-of-stream") == 0))
+
+        memset(buf, 0, sizeof(buf));
+        buf[0] = 0x0A;
+        buf[1] = 16;
+        TEST((s = pb_istream_from_buffer(buf, 18), pb_validate(&s, BytesMessage_fields)))
+        buf[1] = 17;
+        TEST((s = pb_istream_from_buffer(buf, 19), !pb_validate(&s, BytesMessage_fields) &&
+              strcmp(s.errmsg, "bytes overflow") == 0))
+
+        TEST((s = S("\x0A\x02\x08\x05"), pb_validate(&s, IntegerContainer_fields)))
+        TEST((s = S("\x0A\x02\x08"), !pb_validate(&s, IntegerContainer_fields) &&
+              strcmp(s.errmsg, "parent stream too short") == 0))
+        TEST((s = S("\x0A\x05\x0D\x01\x02\x03\x04"), !pb_validate(&s, IntegerContainer_fields) &&
+              strcmp(s.errmsg, "wrong wire type") == 0))
+        TEST((s = S("\x0A\x03\x0A\x01\x01"), pb_validate(&s, IntegerContainer_fields)))
+        TEST((s = S("\x0A\x04\x0A\x02\x01\x80"), !pb_validate(&s, IntegerContainer_fields)))
+
+        /* Callback fields are skipped */
+        TEST((s = S("\x0A\x03\x0A\x01\x01"), pb_validate(&s, CallbackContainer_fields)))
+
+        /* Build nested messages from the inside out */
+        i = sizeof(buf);
+        while (sizeof(buf) - i < 2 * PB_VALIDATE_MAX_DEPTH)
+        {
+            buf[i - 1] = (uint8_t)(sizeof(buf) - i);
+            buf[i - 2] = 0x0A;
+            i -= 2;
+        }
+        TEST((s = pb_istream_from_buffer(buf + i, sizeof(buf) - i), pb_validate(&s, RecursiveMessage_fields)))
+        buf[i - 1] = (uint8_t)(sizeof(buf) - i);
+        buf[i - 2] = 0x0A;
+        i -= 2;
+        TEST((s = pb_istream_from_buffer(buf + i, sizeof(buf) - i), !pb_validate(&s, RecursiveMessage_fields) &&
+              strcmp(s.errmsg, "max nesting depth exceeded") == 0))
+    }
+
+#ifdef PB_VALIDATE_UTF8
+    {
+        pb_istream_t s;
+        uint8_t buf[128];
+        size_t i;
+
+        COMMENT("Testing pb_validate with long UTF-8 strings")
+
+        /* Two-byte and three-byte characters that cross the 64-byte pieces */
+        buf[0] = 0x0A;
+        buf[1] = 122;
+        buf[2] = 'a';
+        buf[3] = 'b';
+        for (i = 4; i < 124; i += 3)
+        {
+            buf[i] = 0xE2;
+            buf[i + 1] = 0x82;
+            buf[i + 2] = 0xAC;
+        }
+        TEST((s = pb_istream_from_buffer(buf, 124), pb_validate(&s, StringPointerContainer_fields)))
+        TEST(validate_callback(buf, 124, StringPointerContainer_fields))
+
+        buf[1] = 120;
+        for (i = 2; i < 122; i += 2)
+        {
+            buf[i] = 0xC3;
+            buf[i + 1] = 0xA9;
+        }
+        TEST((s = pb_istream_from_buffer(buf, 122), pb_validate(&s, StringPointerContainer_fields)))
+        TEST(validate_callback(buf, 122, StringPointerContainer_fields))
+
+        buf[100] = 0xFF;
+        TEST((s = pb_istream_from_buffer(buf, 122), !pb_validate(&s, StringPointerContainer_fields) &&
+              strcmp(s.errmsg, "invalid utf8") == 0))
+        TEST(!validate_callback(buf, 122, StringPointerContainer_fields))
+
+        /* Incomplete character at the end of the string */
+        buf[100] = 0xC3;
+        buf[1] = 119;
+        TEST((s = pb_istream_from_buffer(buf, 121), !pb_validate(&s, StringPointerContainer_fields) &&
+              strcmp(s.errmsg, "invalid utf8") == 0))
+        TEST(!validate_callback(buf, 121, StringPointerContainer_fields))
+
+        /* Null characters are allowed, but the rest of the string is checked */
+        buf[50] = 0x00;
+        buf[51] = 0x00;
+        TEST((s = pb_istream_from_buffer(buf, 121), !pb_validate(&s, StringPointerContainer_fields)))
+        TEST(!validate_callback(buf, 121, StringPointerContainer_fields))
+        buf[1] = 120;
+        buf[121] = 0xA9;
+        TEST((s = pb_istream_from_buffer(buf, 122), pb_validate(&s, StringPointerContainer_fields)))
+        TEST(validate_callback(buf, 122, StringPointerContainer_fields))
+    }
+#endif
+
     {
         pb_istream_t s = {0};
         void *data = NULL;
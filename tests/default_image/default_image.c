@@ -0,0 +1,98 @@
+/* Check the default values set by pb_decode(), and that the generator has
+ * chosen the expected way of initializing each message. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_decode.h>
+#include "defaults.pb.h"
+#include "unittests.h"
+
+/* Decode an empty message into a structure filled with garbage */
+static bool decode_empty(const pb_msgdesc_t *fields, void *dest, size_t size)
+{
+    pb_istream_t stream = pb_istream_from_buffer(NULL, 0);
+    memset(dest, 0x55, size);
+    return pb_decode(&stream, fields, dest);
+}
+
+int main()
+{
+    int status = 0;
+
+    COMMENT("Check initialization method selected by generator");
+    {
+        TEST(ZeroDefaults_msg.default_size == sizeof(ZeroDefaults));
+        TEST(ZeroDefaults_msg.default_image == NULL);
+        TEST(Inner_msg.default_size == sizeof(Inner));
+        TEST(Inner_msg.default_image != NULL);
+        TEST(WithDefaults_msg.default_size == sizeof(WithDefaults));
+        TEST(WithDefaults_msg.default_image != NULL);
+        TEST(FirstEnumValue_msg.default_size == 0);
+        TEST(InfinityDefault_msg.default_size == 0);
+        TEST(HasCallback_msg.default_size == 0);
+        TEST(OuterWithCallback_msg.default_size == 0);
+    }
+
+    COMMENT("Zero defaults");
+    {
+        ZeroDefaults msg;
+        TEST(decode_empty(ZeroDefaults_fields, &msg, sizeof(msg)));
+        TEST(!msg.has_a && msg.a == 0);
+        TEST(!msg.has_b && msg.b[0] == '\0');
+        TEST(msg.c_count == 0);
+    }
+
+    COMMENT("Nonzero defaults from struct image");
+    {
+        WithDefaults msg;
+        TEST(decode_empty(WithDefaults_fields, &msg, sizeof(msg)));
+        TEST(!msg.has_inner);
+        TEST(!msg.inner.has_x && msg.inner.x == 42);
+        TEST(!msg.inner.has_s && strcmp(msg.inner.s, "abc") == 0);
+        TEST(msg.inner.y == 1234);
+        TEST(msg.inners_count == 0);
+        TEST(!msg.has_f && msg.f == 1.5f);
+        TEST(!msg.has_b && msg.b.size == 2 && msg.b.bytes[0] == 1 && msg.b.bytes[1] == 2);
+        TEST(msg.which_choice == 0);
+    }
+
+    COMMENT("Defaults in repeated submessages");
+    {
+        pb_byte_t data[] = {0x12, 0x00, 0x12, 0x02, 0x08, 0x07};
+        pb_istream_t stream = pb_istream_from_buffer(data, sizeof(data));
+        WithDefaults msg;
+        memset(&msg, 0x55, sizeof(msg));
+        TEST(pb_decode(&stream, WithDefaults_fields, &msg));
+        TEST(msg.inners_count == 2);
+        TEST(msg.inners[0].x == 42 && strcmp(msg.inners[0].s, "abc") == 0);
+        TEST(msg.inners[1].has_x && msg.inners[1].x == 7 && msg.inners[1].y == 1234);
+    }
+
+    COMMENT("Defaults set field by field");
+    {
+        FirstEnumValue msg1;
+        InfinityDefault msg2;
+        TEST(decode_empty(FirstEnumValue_fields, &msg1, sizeof(msg1)));
+        TEST(!msg1.has_color && msg1.color == Color_GREEN);
+        TEST(decode_empty(InfinityDefault_fields, &msg2, sizeof(msg2)));
+        TEST(!msg2.has_f && msg2.f > 1e38f);
+    }
+
+    COMMENT("Callbacks are not overwritten");
+    {
+        OuterWithCallback msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.cb.s.arg = &msg;
+        {
+            pb_istream_t stream = pb_istream_from_buffer(NULL, 0);
+            TEST(pb_decode(&stream, OuterWithCallback_fields, &msg));
+        }
+        TEST(msg.cb.s.arg == &msg);
+        TEST(msg.cb.a == 5);
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
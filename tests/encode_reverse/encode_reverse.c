@@ -0,0 +1,47 @@
+/* Reads an AllTypes message from stdin, encodes it again using
+ * pb_encode_reverse() and writes the result to stdout.
+ * The output should be identical to the input.
+ */
+
+#include <stdio.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "alltypes.pb.h"
+#include "test_helpers.h"
+
+int main(void)
+{
+    uint8_t buffer[AllTypes_size];
+    size_t count;
+    size_t start;
+    AllTypes alltypes = AllTypes_init_zero;
+    pb_istream_t istream;
+    pb_ostream_t ostream;
+
+    SET_BINARY_MODE(stdin);
+    count = fread(buffer, 1, sizeof(buffer), stdin);
+
+    istream = pb_istream_from_buffer(buffer, count);
+    if (!pb_decode(&istream, AllTypes_fields, &alltypes))
+    {
+        fprintf(stderr, "Decoding failed: %s\n", PB_GET_ERROR(&istream));
+        return 1;
+    }
+
+    ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+    if (!pb_encode_reverse(&ostream, AllTypes_fields, &alltypes, &start))
+    {
+        fprintf(stderr, "Encoding failed: %s\n", PB_GET_ERROR(&ostream));
+        return 1;
+    }
+
+    if (start + ostream.bytes_written != sizeof(buffer))
+    {
+        fprintf(stderr, "Message is not at the end of the buffer\n");
+        return 1;
+    }
+
+    SET_BINARY_MODE(stdout);
+    fwrite(buffer + start, 1, ostream.bytes_written, stdout);
+    return 0;
+}
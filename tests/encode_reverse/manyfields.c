@@ -0,0 +1,42 @@
+/* Encode a message with hundreds of fields both with pb_encode() and
+ * pb_encode_reverse(), and check that the results are identical. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_common.h>
+#include <pb_encode.h>
+#include "manyfields.pb.h"
+#include "unittests.h"
+
+int main()
+{
+    int status = 0;
+    uint8_t forward[ManyFields_size];
+    uint8_t reverse[ManyFields_size];
+    size_t start = 0;
+    ManyFields msg = ManyFields_init_zero;
+    pb_ostream_t fstream = pb_ostream_from_buffer(forward, sizeof(forward));
+    pb_ostream_t rstream = pb_ostream_from_buffer(reverse, sizeof(reverse));
+    pb_field_iter_t iter;
+
+    /* Set every other field, with values of varying length */
+    if (pb_field_iter_begin(&iter, ManyFields_fields, &msg))
+    {
+        do
+        {
+            if (iter.tag % 2 == 1)
+            {
+                *(bool*)iter.pSize = true;
+                *(int32_t*)iter.pData = (int32_t)(iter.tag * iter.tag * 97);
+            }
+        } while (pb_field_iter_next(&iter));
+    }
+
+    COMMENT("Encode ManyFields in both directions");
+    TEST(pb_encode(&fstream, ManyFields_fields, &msg));
+    TEST(pb_encode_reverse(&rstream, ManyFields_fields, &msg, &start));
+    TEST(rstream.bytes_written == fstream.bytes_written);
+    TEST(memcmp(reverse + start, forward, fstream.bytes_written) == 0);
+
+    return status;
+}
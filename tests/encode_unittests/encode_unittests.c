@@ -36,6 +36,17 @@ bool crazyfieldcallback(pb_ostream_t *stream, const pb_field_t *field, void * co
     return pb_encode_varint(stream, *state);
 }
 
+bool largefieldcallback(pb_ostream_t *stream, const pb_field_t *field, void * const *arg)
+{
+    /* This callback writes a 200 byte field, so that the containing
+     * submessage needs a 2-byte length prefix. */
+    pb_byte_t data[200];
+    memset(data, 'x', sizeof(data));
+    if (!pb_encode_tag(stream, PB_WT_STRING, field->tag))
+        return false;
+    return pb_encode_string(stream, data, sizeof(data));
+}
+
 /* Check that expression x writes data y.
  * Y is a string, which may contain null bytes. Null terminator is ignored.
  */
@@ -107,6 +118,37 @@ int main()
         TEST(WRITES(pb_encode_varint(&s, UINT32_MAX), "\xFF\xFF\xFF\xFF\x0F"));
     }
     
+    {
+        uint8_t buffer[10];
+        pb_ostream_t s = pb_ostream_from_buffer(buffer, 2);
+        pb_ostream_t sizing = PB_OSTREAM_SIZING;
+        pb_ostream_t cb = {&streamcallback, 0, SIZE_MAX, 0};
+        uint64_t value = 1;
+        int bits;
+        bool ok = true;
+
+        COMMENT("Test pb_encode_varint lengths on buffer, sizing and callback streams")
+        memset(buffer, 0xAA, sizeof(buffer));
+        TEST(!pb_encode_varint(&s, 0x4000) && s.bytes_written == 0 && buffer[0] == 0xAA)
+        TEST(pb_encode_varint(&s, 0x3FFF) && s.bytes_written == 2 && !pb_encode_varint(&s, 0))
+
+        for (bits = 1; bits <= 64; bits++)
+        {
+            size_t expected = (size_t)(bits + 6) / 7;
+            s = pb_ostream_from_buffer(buffer, sizeof(buffer));
+            sizing.bytes_written = 0;
+            ok = ok && pb_encode_varint(&s, value) && s.bytes_written == expected &&
+                 (buffer[expected - 1] & 0x80) == 0 &&
+                 pb_encode_varint(&sizing, value) && sizing.bytes_written == expected &&
+                 varint_size64(value) == expected;
+            value = (value << 1) | 1;
+        }
+        TEST(ok)
+
+        /* Callback streams still go through pb_write() */
+        TEST(!pb_encode_varint(&cb, 0x80))
+    }
+    
     {
         uint8_t buffer[50];
         pb_ostream_t s;
@@ -282,7 +324,22 @@ int main()
     }
     
     {
-        uint8_t buffer[10];
+        uint8_t buffer[64];
+        pb_ostream_t s;
+        PackedVarints msg = {6, {0, 127, 128, 16384, -1, 2147483647},
+                             6, {0, -1, 1, -64, 64, INT64_MIN},
+                             4, {0, 127, 128, 255}};
+
+        COMMENT("Test pb_encode with packed varint arrays of varying lengths")
+
+        TEST(WRITES(pb_encode(&s, PackedVarints_fields, &msg),
+            "\x0A\x16\x00\x7F\x80\x01\x80\x80\x01\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x01\xFF\xFF\xFF\xFF\x07"
+            "\x12\x10\x00\x01\x02\x7F\x80\x01\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x01"
+            "\x1A\x06\x00\x7F\x80\x01\xFF\x01"))
+    }
+    
+    {
+        uint8_t buffer[12];
         pb_ostream_t s;
         FloatArray msg = {1, {99.0f}};
         
@@ -290,7 +347,12 @@ int main()
         
         TEST(WRITES(pb_encode(&s, FloatArray_fields, &msg),
                     "\x0A\x04\x00\x00\xc6\x42"))
-        
+
+        msg.data_count = 2;
+        msg.data[1] = -2.0f;
+        TEST(WRITES(pb_encode(&s, FloatArray_fields, &msg),
+                    "\x0A\x08\x00\x00\xc6\x42\x00\x00\x00\xc0"))
+
         msg.data_count = 0;
         TEST(WRITES(pb_encode(&s, FloatArray_fields, &msg), ""))
         
@@ -392,6 +454,70 @@ int main()
         TEST(!pb_encode(&s, CallbackContainerContainer_fields, &msg2))
     }
     
+    {
+        uint8_t buffer[256];
+        uint8_t expected[256];
+        pb_ostream_t s;
+        CallbackContainer msg;
+        CallbackContainerContainer msg2;
+        size_t size;
+        
+        msg.submsg.data.funcs.encode = &largefieldcallback;
+        msg2.submsg.submsg.data.funcs.encode = &largefieldcallback;
+        
+        memset(expected, 'x', sizeof(expected));
+        memcpy(expected, "\x0A\xCE\x01\x0A\xCB\x01\x0A\xC8\x01", 9);
+        
+        COMMENT("Test pb_encode with submessages longer than 127 bytes.")
+        s = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        TEST(pb_encode(&s, CallbackContainer_fields, &msg) &&
+             s.bytes_written == 206 &&
+             memcmp(buffer, expected + 3, 206) == 0)
+        
+        s = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        TEST(pb_encode(&s, CallbackContainerContainer_fields, &msg2) &&
+             s.bytes_written == 209 &&
+             memcmp(buffer, expected, 209) == 0)
+        
+        TEST(pb_get_encoded_size(&size, CallbackContainerContainer_fields, &msg2) &&
+             size == 209)
+        
+        /* Buffer is large enough for the contents but not for the length prefix */
+        s = pb_ostream_from_buffer(buffer, 208);
+        TEST(!pb_encode(&s, CallbackContainerContainer_fields, &msg2))
+    }
+    
+    {
+        uint8_t buffer[256];
+        uint8_t expected[256];
+        pb_ostream_t s;
+        CallbackContainerContainer msg;
+        IntegerArray msg2 = {5, {1, 2, 3, 4, 300}};
+        size_t start;
+        
+        msg.submsg.submsg.data.funcs.encode = &largefieldcallback;
+        
+        memset(expected, 'x', sizeof(expected));
+        memcpy(expected, "\x0A\xCE\x01\x0A\xCB\x01\x0A\xC8\x01", 9);
+        
+        COMMENT("Test pb_encode_reverse")
+        s = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        TEST(pb_encode_reverse(&s, CallbackContainerContainer_fields, &msg, &start) &&
+             start == 256 - 209 && s.bytes_written == 209 &&
+             memcmp(buffer + start, expected, 209) == 0)
+        
+        s = pb_ostream_from_buffer(buffer, 10);
+        TEST(pb_encode_reverse(&s, IntegerArray_fields, &msg2, &start) &&
+             start == 2 && s.bytes_written == 8 &&
+             memcmp(buffer + start, "\x0A\x06\x01\x02\x03\x04\xAC\x02", 8) == 0)
+        
+        s = pb_ostream_from_buffer(buffer, 7);
+        TEST(!pb_encode_reverse(&s, IntegerArray_fields, &msg2, &start))
+        
+        s.callback = &streamcallback;
+        TEST(!pb_encode_reverse(&s, IntegerArray_fields, &msg2, &start))
+    }
+    
     {
         uint8_t buffer[StringMessage_size];
         pb_ostream_t s;
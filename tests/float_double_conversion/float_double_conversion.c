@@ -14,6 +14,13 @@ typedef struct {
 } FloatMsg;
 PB_BIND(DoubleMsg, FloatMsg, AUTO)
 
+/* Same for DoubleArrayMsg, to test packed arrays. */
+typedef struct {
+    pb_size_t values_count;
+    float values[32];
+} FloatArrayMsg;
+PB_BIND(DoubleArrayMsg, FloatArrayMsg, AUTO)
+
 static const double testvalues[] = {
            0.0,        -0.0,         0.1,         -0.1,
           M_PI,       -M_PI,  123456.789,  -123456.789,
@@ -86,5 +93,33 @@ int main()
         }
     }
 
+    {
+        uint8_t arraybuf[512];
+        DoubleArrayMsg dmsg = { 0 };
+        FloatArrayMsg fmsg = { 0 };
+        pb_ostream_t ostream = pb_ostream_from_buffer(arraybuf, sizeof(arraybuf));
+        pb_istream_t istream;
+
+        printf("\n---- Testcase: packed array ----\n");
+
+        for (i = 0; i < TESTVALUES_COUNT; i++)
+        {
+            dmsg.values[i] = testvalues[i];
+        }
+        dmsg.values_count = TESTVALUES_COUNT;
+
+        TEST(pb_encode(&ostream, &DoubleArrayMsg_msg, &dmsg));
+
+        istream = pb_istream_from_buffer(arraybuf, ostream.bytes_written);
+        TEST(pb_decode(&istream, &FloatArrayMsg_msg, &fmsg));
+        TEST(fmsg.values_count == TESTVALUES_COUNT);
+
+        for (i = 0; i < TESTVALUES_COUNT; i++)
+        {
+            float expected_float = (float)testvalues[i];
+            TEST(memcmp(&fmsg.values[i], &expected_float, sizeof(float)) == 0);
+        }
+    }
+
     return status;
 }
@@ -202,6 +202,52 @@ static bool test_OneofMessage()
     return true;
 }
 
+/* Repeated pointer fields with many entries */
+static bool test_RepeatedGrowth()
+{
+    uint8_t buffer[1024];
+    size_t msgsize = 0;
+    char *strs[100];
+    SubMessage subs[5] = {SubMessage_init_zero, SubMessage_init_zero, SubMessage_init_zero,
+                          SubMessage_init_zero, SubMessage_init_zero};
+    int i;
+
+    for (i = 0; i < 100; i++)
+        strs[i] = "x";
+
+    /* Concatenated messages are merged when decoding, so the entries
+     * of the two arrays come in interleaved. */
+    for (i = 0; i < 3; i++)
+    {
+        SubMessage msg = SubMessage_init_zero;
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer + msgsize, sizeof(buffer) - msgsize);
+        msg.dynamic_str_arr_count = 100;
+        msg.dynamic_str_arr = strs;
+        msg.dynamic_submsg_count = 5;
+        msg.dynamic_submsg = subs;
+        TEST(pb_encode(&stream, SubMessage_fields, &msg));
+        msgsize += stream.bytes_written;
+    }
+
+    {
+        SubMessage msg = SubMessage_init_zero;
+        pb_istream_t stream = pb_istream_from_buffer(buffer, msgsize);
+        TEST(pb_decode(&stream, SubMessage_fields, &msg));
+        TEST(msg.dynamic_str_arr_count == 300);
+        TEST(msg.dynamic_submsg_count == 15);
+        TEST(strcmp(msg.dynamic_str_arr[299], "x") == 0);
+
+        /* Extra capacity is released at the end of the message */
+        TEST(get_allocation_size(msg.dynamic_str_arr) == 300 * sizeof(char*));
+        TEST(get_allocation_size(msg.dynamic_submsg) == 15 * sizeof(SubMessage));
+
+        pb_release(SubMessage_fields, &msg);
+        TEST(get_alloc_count() == 0);
+    }
+
+    return true;
+}
+
 static bool dummy_decode_cb(pb_istream_t *stream, const pb_field_t *field, void **arg)
 {
     return false;
@@ -238,7 +284,7 @@ static bool test_Garbage()
 
 int main()
 {
-    if (test_TestMessage() && test_OneofMessage() && test_Garbage())
+    if (test_TestMessage() && test_OneofMessage() && test_RepeatedGrowth() && test_Garbage())
         return 0;
     else
         return 1;
@@ -0,0 +1,116 @@
+/* Decode only some fields of a message with pb_decode_projected(), and
+ * check that the other fields are left untouched. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_decode.h>
+#include "alltypes.pb.h"
+#include "test_helpers.h"
+#include "unittests.h"
+
+/* Check that the memory of a field still has the fill pattern */
+static bool untouched(const void *field, size_t size)
+{
+    const uint8_t *p = (const uint8_t*)field;
+    size_t i;
+
+    for (i = 0; i < size; i++)
+    {
+        if (p[i] != 0x55)
+            return false;
+    }
+
+    return true;
+}
+
+#define UNTOUCHED(field) untouched(&(field), sizeof(field))
+
+int main()
+{
+    int status = 0;
+    uint8_t input[1024];
+    size_t count;
+    uint32_t mask[AllTypes_FIELDMASK_WORDS] = {0};
+    AllTypes full = AllTypes_init_zero;
+    AllTypes msg;
+
+    SET_BINARY_MODE(stdin);
+    count = fread(input, 1, sizeof(input), stdin);
+
+    {
+        pb_istream_t stream = pb_istream_from_buffer(input, count);
+        if (!pb_decode(&stream, AllTypes_fields, &full))
+        {
+            fprintf(stderr, "Decode failed: %s\n", PB_GET_ERROR(&stream));
+            return 1;
+        }
+    }
+
+    PB_FIELDMASK_SET(mask, AllTypes_req_int32_index);
+    PB_FIELDMASK_SET(mask, AllTypes_req_string_index);
+    PB_FIELDMASK_SET(mask, AllTypes_rep_submsg_index);
+    PB_FIELDMASK_SET(mask, AllTypes_opt_int32_index);
+    PB_FIELDMASK_SET(mask, AllTypes_oneof_msg1_index);
+    PB_FIELDMASK_SET(mask, AllTypes_end_index);
+
+    {
+        pb_istream_t stream = pb_istream_from_buffer(input, count);
+
+        COMMENT("Decode selected fields");
+        memset(&msg, 0x55, sizeof(msg));
+        TEST(pb_decode_projected(&stream, AllTypes_fields, &msg, 0, mask));
+        TEST(stream.bytes_left == 0);
+
+        TEST(msg.req_int32 == full.req_int32);
+        TEST(strcmp(msg.req_string, full.req_string) == 0);
+        TEST(msg.rep_submsg_count == full.rep_submsg_count);
+        TEST(strcmp(msg.rep_submsg[4].substuff1, full.rep_submsg[4].substuff1) == 0);
+        TEST(msg.rep_submsg[4].substuff2 == full.rep_submsg[4].substuff2);
+        TEST(msg.has_opt_int32 == full.has_opt_int32 && msg.opt_int32 == full.opt_int32);
+        TEST(msg.which_oneof == full.which_oneof);
+        TEST(msg.end == full.end);
+
+        if (full.which_oneof == AllTypes_oneof_msg1_tag)
+        {
+            TEST(strcmp(msg.oneof.oneof_msg1.substuff1, full.oneof.oneof_msg1.substuff1) == 0);
+        }
+    }
+
+    {
+        COMMENT("Other fields are not written");
+        TEST(UNTOUCHED(msg.req_int64));
+        TEST(UNTOUCHED(msg.req_bytes));
+        TEST(UNTOUCHED(msg.req_submsg));
+        TEST(UNTOUCHED(msg.rep_int32_count));
+        TEST(UNTOUCHED(msg.rep_string));
+        TEST(UNTOUCHED(msg.has_opt_string));
+        TEST(UNTOUCHED(msg.opt_string));
+        TEST(UNTOUCHED(msg.req_limits));
+        TEST(UNTOUCHED(msg.extensions));
+    }
+
+    {
+        pb_istream_t stream = pb_istream_from_buffer(input, 0);
+        uint32_t optmask[AllTypes_FIELDMASK_WORDS] = {0};
+
+        COMMENT("Selected fields get default values");
+        PB_FIELDMASK_SET(optmask, AllTypes_opt_int32_index);
+        PB_FIELDMASK_SET(optmask, AllTypes_opt_string_index);
+        memset(&msg, 0x55, sizeof(msg));
+        TEST(pb_decode_projected(&stream, AllTypes_fields, &msg, 0, optmask));
+        TEST(!msg.has_opt_int32 && msg.opt_int32 == 4041);
+        TEST(!msg.has_opt_string && strcmp(msg.opt_string, "4054") == 0);
+        TEST(UNTOUCHED(msg.opt_int64));
+        TEST(UNTOUCHED(msg.has_opt_bytes));
+    }
+
+    {
+        pb_istream_t stream = pb_istream_from_buffer(input, 0);
+
+        COMMENT("Selected required fields are checked");
+        TEST(!pb_decode_projected(&stream, AllTypes_fields, &msg, 0, mask));
+        TEST(strcmp(PB_GET_ERROR(&stream), "missing required field") == 0);
+    }
+
+    return status;
+}
@@ -0,0 +1,121 @@
+/* Decode messages with pb_decoder_t, passing the data in small chunks
+ * like it would arrive from a non-blocking socket. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_decode.h>
+#include <pb_encode.h>
+#include "alltypes.pb.h"
+#include "test_helpers.h"
+#include "unittests.h"
+
+/* Check that the message encodes back to the same data */
+static bool compare(const AllTypes *alltypes, const uint8_t *data, size_t count)
+{
+    uint8_t buffer[1024];
+    pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+    return pb_encode(&ostream, AllTypes_fields, alltypes) &&
+           ostream.bytes_written == count &&
+           memcmp(buffer, data, count) == 0;
+}
+
+/* Feed the data to the decoder in chunks of the given size */
+static bool feed(pb_decoder_t *dec, const uint8_t *data, size_t count, size_t chunk)
+{
+    while (count > 0 && !dec->done)
+    {
+        size_t n = (count < chunk) ? count : chunk;
+
+        if (!pb_decoder_feed(dec, data, n))
+        {
+            fprintf(stderr, "Decode failed: %s\n", PB_GET_ERROR(dec));
+            return false;
+        }
+
+        data += dec->consumed;
+        count -= dec->consumed;
+    }
+
+    return true;
+}
+
+int main()
+{
+    int status = 0;
+    uint8_t input[1024];
+    size_t count;
+    pb_decoder_frame_t stack[3];
+    pb_decoder_t dec;
+    AllTypes alltypes;
+
+    SET_BINARY_MODE(stdin);
+    count = fread(input, 1, sizeof(input), stdin);
+
+    pb_decoder_init(&dec, stack, 3, NULL, 0);
+
+    {
+        const size_t chunks[] = {1, 2, 3, 7, 64, sizeof(input)};
+        size_t i;
+
+        COMMENT("Decode with different chunk sizes");
+        for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+        {
+            memset(&alltypes, 0xAA, sizeof(alltypes));
+            alltypes.extensions = 0;
+
+            if (!pb_decoder_start(&dec, AllTypes_fields, &alltypes, 0) ||
+                !feed(&dec, input, count, chunks[i]) ||
+                !pb_decoder_finish(&dec) ||
+                !compare(&alltypes, input, count))
+            {
+                fprintf(stderr, "Failed with chunk %d\n", (int)chunks[i]);
+                status = 1;
+            }
+        }
+    }
+
+    {
+        COMMENT("Incomplete message");
+        TEST(pb_decoder_start(&dec, AllTypes_fields, &alltypes, 0));
+        TEST(feed(&dec, input, count - 1, 5));
+        TEST(!dec.done && !pb_decoder_finish(&dec));
+    }
+
+    {
+        uint8_t data[2048];
+        pb_ostream_t ostream = pb_ostream_from_buffer(data, sizeof(data));
+        AllTypes alltypes2 = AllTypes_init_zero;
+        pb_istream_t msgstream = pb_istream_from_buffer(input, count);
+        size_t pos = 0;
+
+        COMMENT("Decode multiple delimited messages from the same chunks");
+        TEST(pb_decode(&msgstream, AllTypes_fields, &alltypes2));
+        TEST(pb_encode_ex(&ostream, AllTypes_fields, &alltypes2, PB_ENCODE_DELIMITED));
+        TEST(pb_encode_ex(&ostream, AllTypes_fields, &alltypes2, PB_ENCODE_DELIMITED));
+
+        TEST(pb_decoder_start(&dec, AllTypes_fields, &alltypes, PB_DECODE_DELIMITED));
+        TEST(pb_decoder_feed(&dec, data, 100) && !dec.done && dec.consumed == 100);
+        pos = 100;
+        TEST(pb_decoder_feed(&dec, data + pos, ostream.bytes_written - pos) && dec.done);
+        pos += dec.consumed;
+        TEST(compare(&alltypes, input, count));
+
+        TEST(pb_decoder_start(&dec, AllTypes_fields, &alltypes, PB_DECODE_DELIMITED));
+        TEST(pb_decoder_feed(&dec, data + pos, ostream.bytes_written - pos) && dec.done);
+        TEST(pos + dec.consumed == ostream.bytes_written);
+        TEST(compare(&alltypes, input, count));
+    }
+
+    {
+        pb_decoder_frame_t small_stack[1];
+
+        COMMENT("Submessages need stack frames");
+        pb_decoder_init(&dec, small_stack, 1, NULL, 0);
+        TEST(pb_decoder_start(&dec, AllTypes_fields, &alltypes, 0));
+        TEST(!pb_decoder_feed(&dec, input, count));
+        TEST(strcmp(PB_GET_ERROR(&dec), "decoder stack full") == 0);
+    }
+
+    return status;
+}
@@ -0,0 +1,115 @@
+/* Encode messages with pb_encoder_t, writing the output in small chunks
+ * like it would be sent to a non-blocking socket. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_decode.h>
+#include <pb_encode.h>
+#include "alltypes.pb.h"
+#include "test_helpers.h"
+#include "unittests.h"
+
+/* Run the encoder with output chunks of the given size */
+static bool write_chunks(pb_encoder_t *enc, uint8_t *data, size_t size, size_t *count, size_t chunk)
+{
+    *count = 0;
+
+    while (!enc->done)
+    {
+        size_t n = (size - *count < chunk) ? size - *count : chunk;
+        pb_ostream_t stream = pb_ostream_from_buffer(data + *count, n);
+
+        if (n == 0)
+        {
+            fprintf(stderr, "Output buffer too small\n");
+            return false;
+        }
+
+        if (!pb_encoder_write(enc, &stream))
+        {
+            fprintf(stderr, "Encode failed: %s\n", PB_GET_ERROR(&stream));
+            return false;
+        }
+
+        *count += stream.bytes_written;
+    }
+
+    return true;
+}
+
+/* Compare the output with pb_encode_ex() */
+static bool compare(const AllTypes *alltypes, unsigned int flags, const uint8_t *data, size_t count)
+{
+    uint8_t buffer[1024];
+    pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+    return pb_encode_ex(&ostream, AllTypes_fields, alltypes, flags) &&
+           ostream.bytes_written == count &&
+           memcmp(buffer, data, count) == 0;
+}
+
+int main()
+{
+    int status = 0;
+    uint8_t input[1024];
+    uint8_t output[1024];
+    size_t count;
+    pb_encoder_t enc;
+    AllTypes alltypes = AllTypes_init_zero;
+
+    SET_BINARY_MODE(stdin);
+    count = fread(input, 1, sizeof(input), stdin);
+
+    {
+        pb_istream_t stream = pb_istream_from_buffer(input, count);
+        if (!pb_decode(&stream, AllTypes_fields, &alltypes))
+        {
+            fprintf(stderr, "Decode failed: %s\n", PB_GET_ERROR(&stream));
+            return 1;
+        }
+    }
+
+    {
+        const size_t chunks[] = {1, 2, 3, 7, 64, sizeof(output)};
+        const unsigned int flags[] = {0, PB_ENCODE_DELIMITED, PB_ENCODE_NULLTERMINATED};
+        size_t i, j, written;
+
+        COMMENT("Encode with different chunk sizes");
+        for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+        {
+            for (j = 0; j < sizeof(flags) / sizeof(flags[0]); j++)
+            {
+                if (!pb_encoder_start(&enc, AllTypes_fields, &alltypes, flags[j]) ||
+                    !write_chunks(&enc, output, sizeof(output), &written, chunks[i]) ||
+                    !compare(&alltypes, flags[j], output, written))
+                {
+                    fprintf(stderr, "Failed with chunk %d, flags %d\n", (int)chunks[i], (int)flags[j]);
+                    status = 1;
+                }
+            }
+        }
+
+        TEST(compare(&alltypes, 0, input, count));
+    }
+
+    {
+        pb_ostream_t stream = pb_ostream_from_buffer(output, 0);
+
+        COMMENT("Full stream is not an error");
+        TEST(pb_encoder_start(&enc, AllTypes_fields, &alltypes, 0));
+        TEST(pb_encoder_write(&enc, &stream) && !enc.done);
+        TEST(stream.bytes_written == 0);
+    }
+
+    {
+        size_t written;
+
+        COMMENT("Errors are reported");
+        alltypes.rep_int32_count = 100;
+        TEST(pb_encoder_start(&enc, AllTypes_fields, &alltypes, 0));
+        TEST(!write_chunks(&enc, output, sizeof(output), &written, 16));
+        TEST(strcmp(PB_GET_ERROR(&enc), "array max size exceeded") == 0);
+    }
+
+    return status;
+}
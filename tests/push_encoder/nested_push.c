@@ -0,0 +1,138 @@
+/* Encode nested submessages with pb_encoder_t in small chunks, and check
+ * that the encoder continues inside them instead of starting over. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include "nested.pb.h"
+#include "unittests.h"
+
+static int counter_calls;
+static bool counter_grows;
+
+static bool write_counter(pb_ostream_t *stream, const pb_field_iter_t *field, void * const *arg)
+{
+    uint32_t value = counter_grows ? (uint32_t)counter_calls * 1000 : 5;
+    counter_calls++;
+    return pb_encode_tag_for_field(stream, field) &&
+           pb_encode_varint(stream, value);
+}
+
+static void fill_message(Root *root)
+{
+    int i, j;
+
+    root->has_sub = true;
+    strcpy(root->name, "root");
+    root->sub.subs_count = 3;
+    root->sub.has_end = true;
+    root->sub.end = 0x12345678;
+
+    for (i = 0; i < 3; i++)
+    {
+        Level2 *level2 = &root->sub.subs[i];
+        Level4 *level4 = &level2->sub.sub;
+
+        level2->has_sub = true;
+        level2->counter.funcs.encode = &write_counter;
+        level2->has_data = true;
+        level2->data.size = 64;
+        memset(level2->data.bytes, 'a' + i, 64);
+
+        level2->sub.has_sub = true;
+        level2->sub.has_data = true;
+        level2->sub.data.size = 32;
+        memset(level2->sub.data.bytes, 'A' + i, 32);
+
+        level4->leaves_count = 3;
+        strcpy(level4->name, "level4");
+        for (j = 0; j < 3; j++)
+        {
+            level4->leaves[j].has_value = true;
+            level4->leaves[j].value = i * 3 + j;
+            level4->leaves[j].has_data = true;
+            level4->leaves[j].data.size = 16;
+            memset(level4->leaves[j].data.bytes, '0' + j, 16);
+        }
+    }
+}
+
+/* Run the encoder with output chunks of the given size */
+static bool write_chunks(pb_encoder_t *enc, uint8_t *data, size_t size, size_t *count, size_t chunk)
+{
+    *count = 0;
+
+    while (!enc->done)
+    {
+        size_t n = (size - *count < chunk) ? size - *count : chunk;
+        pb_ostream_t stream = pb_ostream_from_buffer(data + *count, n);
+
+        if (n == 0 || !pb_encoder_write(enc, &stream))
+            return false;
+
+        *count += stream.bytes_written;
+    }
+
+    return true;
+}
+
+int main()
+{
+    int status = 0;
+    uint8_t expected[2048];
+    uint8_t output[2048];
+    pb_ostream_t ostream;
+    pb_encoder_t enc;
+    Root root = Root_init_zero;
+    size_t written;
+
+    fill_message(&root);
+    ostream = pb_ostream_from_buffer(expected, sizeof(expected));
+    if (!pb_encode(&ostream, Root_fields, &root))
+    {
+        fprintf(stderr, "Encode failed: %s\n", PB_GET_ERROR(&ostream));
+        return 1;
+    }
+
+    {
+        const size_t chunks[] = {1, 2, 3, 5, 16, sizeof(output)};
+        size_t i;
+
+        COMMENT("Encode nested submessages with different chunk sizes");
+        for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+        {
+            if (!pb_encoder_start(&enc, Root_fields, &root, 0) ||
+                !write_chunks(&enc, output, sizeof(output), &written, chunks[i]) ||
+                written != ostream.bytes_written ||
+                memcmp(output, expected, written) != 0)
+            {
+                fprintf(stderr, "Failed with chunk %d\n", (int)chunks[i]);
+                status = 1;
+            }
+        }
+    }
+
+    {
+        COMMENT("Fields before the stopping point are not encoded again");
+        counter_calls = 0;
+        TEST(pb_encoder_start(&enc, Root_fields, &root, 0));
+        TEST(write_chunks(&enc, output, sizeof(output), &written, 4));
+        TEST(written == ostream.bytes_written && memcmp(output, expected, written) == 0);
+
+        /* Each Level2 is sized along with Level1 and on its own, and the
+         * two byte counter field can be split in two writes. */
+        TEST(counter_calls <= 3 * 4);
+    }
+
+    {
+        COMMENT("Submessage that changes size is detected");
+        counter_calls = 0;
+        counter_grows = true;
+        TEST(pb_encoder_start(&enc, Root_fields, &root, 0));
+        TEST(!write_chunks(&enc, output, sizeof(output), &written, 16));
+        TEST(strcmp(PB_GET_ERROR(&enc), "submsg size changed") == 0);
+        counter_grows = false;
+    }
+
+    return status;
+}
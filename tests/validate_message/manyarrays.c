@@ -0,0 +1,89 @@
+/* Check that pb_validate() counts the entries of arrays after the first
+ * PB_VALIDATE_ARRAY_FIELDS fields exactly, also when they are interleaved
+ * with other fields. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_decode.h>
+#include "manyarrays.pb.h"
+#include "unittests.h"
+
+/* Validate and decode a message, returning true if both give the
+ * expected result and the same error message. */
+static bool check(const uint8_t *input, size_t count, bool expected)
+{
+    ManyArrays msg = ManyArrays_init_zero;
+    pb_istream_t vstream = pb_istream_from_buffer(input, count);
+    pb_istream_t dstream = pb_istream_from_buffer(input, count);
+    bool valid = pb_validate(&vstream, ManyArrays_fields);
+    bool decoded = pb_decode(&dstream, ManyArrays_fields, &msg);
+
+    if (valid != expected || decoded != expected)
+    {
+        fprintf(stderr, "pb_validate() %s (%s), pb_decode() %s (%s)\n",
+                valid ? "passed" : "failed", PB_GET_ERROR(&vstream),
+                decoded ? "passed" : "failed", PB_GET_ERROR(&dstream));
+        return false;
+    }
+
+    return expected || strcmp(PB_GET_ERROR(&vstream), PB_GET_ERROR(&dstream)) == 0;
+}
+
+static bool callback(pb_istream_t *stream, uint8_t *buf, size_t count)
+{
+    const uint8_t **source = (const uint8_t**)stream->state;
+    memcpy(buf, *source, count);
+    *source += count;
+    return true;
+}
+
+/* Validate a message through a callback stream */
+static bool validate_callback(const uint8_t *input, size_t count, const char **errmsg)
+{
+    pb_istream_t stream = {&callback, NULL, 0};
+    bool status;
+
+    stream.state = &input;
+    stream.bytes_left = count;
+    status = pb_validate(&stream, ManyArrays_fields);
+    *errmsg = PB_GET_ERROR(&stream);
+    return status;
+}
+
+int main()
+{
+    int status = 0;
+
+    {
+        /* Field 70, the 70th field of the message, interleaved with field 1 */
+        const uint8_t input[] = "\xB0\x04\x01\x08\x05\xB0\x04\x02\x08\x06\xB0\x04\x03";
+
+        COMMENT("Interleaved array after the first 64 fields");
+        TEST(check(input, 8, true));
+        TEST(check(input, sizeof(input) - 1, false));
+    }
+
+    {
+        /* Field 140, counted on the third pass over the message */
+        const uint8_t input[] = "\xE0\x08\x01\xB0\x04\x01\xE0\x08\x02\x08\x01\xE0\x08\x03";
+
+        COMMENT("Interleaved array after the first 128 fields");
+        TEST(check(input, 11, true));
+        TEST(check(input, sizeof(input) - 1, false));
+    }
+
+    {
+        const uint8_t input[] = "\x08\x05\xB0\x04\x01";
+        const char *errmsg;
+
+        COMMENT("Later arrays cannot be counted in a callback stream");
+        TEST(validate_callback(input, 2, &errmsg));
+        TEST(!validate_callback(input, sizeof(input) - 1, &errmsg));
+        TEST(strcmp(errmsg, "too many array fields") == 0);
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
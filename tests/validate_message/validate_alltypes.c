@@ -0,0 +1,120 @@
+/* Check a message with pb_validate(), and that every truncated version of
+ * it is accepted by pb_validate() exactly when pb_decode() accepts it. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_decode.h>
+#include "alltypes.pb.h"
+#include "test_helpers.h"
+#include "unittests.h"
+
+/* Validate and decode the first count bytes, returning true if the
+ * results agree. */
+static bool check_prefix(const uint8_t *input, size_t count)
+{
+    AllTypes msg = AllTypes_init_zero;
+    pb_istream_t stream = pb_istream_from_buffer(input, count);
+    bool valid, decoded;
+
+    valid = pb_validate(&stream, AllTypes_fields);
+    stream = pb_istream_from_buffer(input, count);
+    decoded = pb_decode(&stream, AllTypes_fields, &msg);
+
+    if (valid != decoded)
+    {
+        fprintf(stderr, "Length %d: pb_validate() %s, pb_decode() %s\n", (int)count,
+                valid ? "passed" : "failed", decoded ? "passed" : "failed");
+        return false;
+    }
+
+    return true;
+}
+
+/* Copy the message without the rep_farray field, returns the new length */
+static size_t without_farray(const uint8_t *input, size_t count, uint8_t *output)
+{
+    pb_istream_t stream = pb_istream_from_buffer(input, count);
+    size_t len = 0;
+
+    while (stream.bytes_left > 0)
+    {
+        const uint8_t *start = (const uint8_t*)stream.state;
+        pb_wire_type_t wire_type;
+        uint32_t tag;
+        bool eof;
+
+        if (!pb_decode_tag(&stream, &wire_type, &tag, &eof) ||
+            !pb_skip_field(&stream, wire_type))
+        {
+            break;
+        }
+
+        if (tag != AllTypes_rep_farray_tag)
+        {
+            size_t size = (size_t)((const uint8_t*)stream.state - start);
+            memcpy(output + len, start, size);
+            len += size;
+        }
+    }
+
+    return len;
+}
+
+int main()
+{
+    int status = 0;
+    uint8_t input[1024];
+    size_t count;
+
+    SET_BINARY_MODE(stdin);
+    count = fread(input, 1, sizeof(input), stdin);
+
+    {
+        pb_istream_t stream = pb_istream_from_buffer(input, count);
+
+        COMMENT("Validate the whole message");
+        TEST(pb_validate(&stream, AllTypes_fields));
+        TEST(stream.bytes_left == 0);
+    }
+
+    {
+        size_t i;
+        bool all_match = true;
+
+        COMMENT("Compare truncated messages against pb_decode()");
+        for (i = 0; i < count; i++)
+        {
+            if (!check_prefix(input, i))
+                all_match = false;
+        }
+        TEST(all_match);
+    }
+
+    {
+        pb_istream_t stream = pb_istream_from_buffer(input, count - 1);
+
+        COMMENT("Truncated message is rejected");
+        TEST(!pb_validate(&stream, AllTypes_fields));
+    }
+
+    {
+        uint8_t buffer[1024];
+        size_t len = without_farray(input, count, buffer);
+        pb_istream_t stream;
+
+        /* Add rep_farray back with 3 of its 5 entries, as a packed array */
+        memcpy(buffer + len, "\xC2\x02\x03\x01\x02\x03", 6);
+        len += 6;
+        stream = pb_istream_from_buffer(buffer, len);
+
+        COMMENT("Fixed count array with missing entries is rejected");
+        TEST(!pb_validate(&stream, AllTypes_fields));
+        TEST(strcmp(PB_GET_ERROR(&stream), "wrong size for fixed count field") == 0);
+        TEST(check_prefix(buffer, len));
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
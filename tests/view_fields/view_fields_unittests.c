@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <string.h>
+#include <pb_decode.h>
+#include <pb_encode.h>
+#include "unittests.h"
+#include "view_fields.pb.h"
+
+/* Input stream that is not a memory buffer */
+static bool callback_read(pb_istream_t *stream, uint8_t *buf, size_t count)
+{
+    const uint8_t **source = (const uint8_t**)stream->state;
+    memcpy(buf, *source, count);
+    *source += count;
+    return true;
+}
+
+/* Check that the view points to the given data inside the buffer */
+static bool view_in_buffer(const pb_view_t *view, const char *data,
+                           const pb_byte_t *buffer, size_t length)
+{
+    size_t size = strlen(data);
+    return view->size == size &&
+           view->ptr >= buffer && view->ptr + size <= buffer + length &&
+           memcmp(view->ptr, data, size) == 0;
+}
+
+int main()
+{
+    int status = 0;
+    pb_byte_t buffer[256];
+    size_t message_length;
+
+    {
+        CopyMessage msg = CopyMessage_init_zero;
+        pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+        msg.blob.size = 5;
+        memcpy(msg.blob.bytes, "\x00\x01\x02\x03\x04", 5);
+        msg.items_count = 2;
+        msg.items[0].size = 3;
+        memcpy(msg.items[0].bytes, "abc", 3);
+        msg.items[1].size = 0;
+        msg.has_sub = true;
+        msg.sub.has_name = true;
+        strcpy(msg.sub.name, "nested");
+        msg.which_choice = CopyMessage_str_tag;
+        strcpy(msg.choice.str, "oneof");
+
+        TEST(pb_encode(&ostream, CopyMessage_fields, &msg));
+        message_length = ostream.bytes_written;
+    }
+
+    {
+        ViewMessage msg = ViewMessage_init_zero;
+        pb_istream_t stream = pb_istream_from_buffer(buffer, message_length);
+
+        COMMENT("Test decoding into view fields");
+        TEST(pb_decode(&stream, ViewMessage_fields, &msg));
+        TEST(msg.blob.size == 5 && msg.blob.ptr == buffer + 2);
+        TEST(memcmp(msg.blob.ptr, "\x00\x01\x02\x03\x04", 5) == 0);
+        TEST(!msg.has_text && msg.text.size == 5);
+        TEST(memcmp(msg.text.ptr, "hello", 5) == 0);
+        TEST(msg.items_count == 2);
+        TEST(view_in_buffer(&msg.items[0], "abc", buffer, message_length));
+        TEST(msg.items[1].size == 0);
+        TEST(msg.has_sub && msg.sub.has_name && view_in_buffer(&msg.sub.name, "nested", buffer, message_length));
+        TEST(msg.which_choice == ViewMessage_str_tag);
+        TEST(view_in_buffer(&msg.choice.str, "oneof", buffer, message_length));
+    }
+
+    {
+        ViewMessage msg = ViewMessage_init_zero;
+        pb_istream_t stream = pb_istream_from_buffer(buffer, message_length);
+        pb_byte_t buffer2[256];
+        pb_ostream_t ostream = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+
+        COMMENT("Test encoding from view fields");
+        TEST(pb_decode(&stream, ViewMessage_fields, &msg));
+        TEST(pb_encode(&ostream, ViewMessage_fields, &msg));
+        TEST(ostream.bytes_written == message_length);
+        TEST(memcmp(buffer, buffer2, message_length) == 0);
+
+        {
+            size_t start;
+            ostream = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+            TEST(pb_encode_reverse(&ostream, ViewMessage_fields, &msg, &start));
+            TEST(ostream.bytes_written == message_length);
+            TEST(memcmp(buffer, buffer2 + start, message_length) == 0);
+        }
+    }
+
+    {
+        ViewMessage msg = ViewMessage_init_default;
+        CopyMessage copy = CopyMessage_init_zero;
+        pb_byte_t buffer2[64];
+        pb_ostream_t ostream = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+        pb_istream_t stream;
+
+        COMMENT("Test default value and data from outside the message");
+        TEST(msg.text.size == 5 && memcmp(msg.text.ptr, "hello", 5) == 0);
+        msg.blob.ptr = (const pb_byte_t*)"external";
+        msg.blob.size = 8;
+        msg.has_text = true;
+        TEST(pb_encode(&ostream, ViewMessage_fields, &msg));
+
+        stream = pb_istream_from_buffer(buffer2, ostream.bytes_written);
+        TEST(pb_decode(&stream, CopyMessage_fields, &copy));
+        TEST(copy.blob.size == 8 && memcmp(copy.blob.bytes, "external", 8) == 0);
+        TEST(copy.has_text && strcmp(copy.text, "hello") == 0);
+
+        msg.blob.ptr = NULL;
+        ostream = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+        TEST(!pb_encode(&ostream, ViewMessage_fields, &msg));
+    }
+
+    {
+        ViewMessage msg = ViewMessage_init_zero;
+        const pb_byte_t *source = buffer;
+        pb_istream_t stream = {&callback_read, NULL, 0};
+        stream.state = &source;
+        stream.bytes_left = message_length;
+
+        COMMENT("Test that views cannot be decoded from callback streams");
+        TEST(!pb_decode(&stream, ViewMessage_fields, &msg));
+        TEST(strcmp(PB_GET_ERROR(&stream), "view needs buffer stream") == 0);
+    }
+
+#ifdef PB_VALIDATE_UTF8
+    {
+        /* blob = "\xff", text = "a\xffb" */
+        const pb_byte_t invalid_text[] = {0x0A, 0x01, 0xFF, 0x12, 0x03, 'a', 0xFF, 'b'};
+        ViewMessage msg = ViewMessage_init_zero;
+        pb_istream_t stream;
+        pb_byte_t buffer2[64];
+        pb_ostream_t ostream;
+
+        COMMENT("Test UTF-8 validation of string views");
+        stream = pb_istream_from_buffer(invalid_text, sizeof(invalid_text));
+        TEST(!pb_decode(&stream, ViewMessage_fields, &msg));
+        TEST(strcmp(PB_GET_ERROR(&stream), "invalid utf8") == 0);
+
+        stream = pb_istream_from_buffer(invalid_text, sizeof(invalid_text));
+        TEST(!pb_validate(&stream, ViewMessage_fields));
+        TEST(strcmp(PB_GET_ERROR(&stream), "invalid utf8") == 0);
+
+        /* Bytes views are not text, and are not validated */
+        stream = pb_istream_from_buffer(invalid_text, 3);
+        TEST(pb_decode(&stream, ViewMessage_fields, &msg));
+        TEST(msg.blob.size == 1 && msg.blob.ptr[0] == 0xFF);
+
+        msg.has_text = true;
+        msg.text.ptr = invalid_text + 5;
+        msg.text.size = 3;
+        ostream = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+        TEST(!pb_encode(&ostream, ViewMessage_fields, &msg));
+        TEST(strcmp(PB_GET_ERROR(&ostream), "invalid utf8") == 0);
+    }
+#endif
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}